@@ -251,6 +251,9 @@ syscall(struct trapframe *tf)
 	    case SYS_fsync:
 		err = sys_fsync(tf->tf_a0);
 		break;
+	    case SYS_ioctl:
+		err = sys_ioctl(tf->tf_a0, tf->tf_a1, (userptr_t)tf->tf_a2);
+		break;
 	    case SYS_ftruncate:
 		{
 			/* Like lseek, the length is 64 bits and aligned */
@@ -43,6 +43,7 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 typedef struct ft_entry {
         unsigned allocated:1; /* the corresponding frame is allocated */
         unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        void *owner;         /* kmalloc pageref if a subpage heap page */
 } ft_entry_t;
 
 
@@ -130,6 +131,7 @@ ram_bootstrap(void)
                 /* Mark as allocated as individual pages */
                 frame_table[i].allocated = TRUE;
                 frame_table[i].not_last = FALSE;
+                frame_table[i].owner = NULL;
         }                                            
         
         /* 
@@ -212,6 +214,7 @@ static paddr_t alloc_one_frame(unsigned int npages)
                 if (frame_table[i].allocated == FALSE) {
                         frame_table[i].allocated = TRUE;
                         frame_table[i].not_last = FALSE;
+                        frame_table[i].owner = NULL;
 
                         spinlock_release(&frame_table_spinlock);
 
@@ -254,9 +257,11 @@ static paddr_t alloc_multiple_frames(unsigned int npages)
                 for (j = i; j < i + npages - 1; j++) {
                         frame_table[j].allocated = TRUE; /* mark frame allocated */
                         frame_table[j].not_last = TRUE;  /* as a contiguous block */
+                        frame_table[j].owner = NULL;
                 }
                 frame_table[j].allocated = TRUE;
                 frame_table[j].not_last = FALSE;
+                frame_table[j].owner = NULL;
 
                 spinlock_release(&frame_table_spinlock);
                 
@@ -319,3 +324,41 @@ free_kpages(vaddr_t addr)
         free_frames(addr);
 }
 
+/*
+ * Record which kmalloc pageref manages the (single, allocated) kernel
+ * heap page at ADDR, so kfree can find it without searching. The
+ * owner field is only used by kmalloc, under its own lock, and is
+ * reset whenever the frame is allocated.
+ */
+void
+kpage_setowner(vaddr_t addr, void *owner)
+{
+        uint32_t i;
+
+        i = KVADDR_TO_PADDR(addr) >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+        KASSERT(frame_table[i].allocated == TRUE);
+
+        frame_table[i].owner = owner;
+}
+
+/*
+ * Return the owner recorded for the page containing ADDR, or NULL if
+ * there isn't one (including if ADDR isn't a kernel heap address at
+ * all).
+ */
+void *
+kpage_getowner(vaddr_t addr)
+{
+        uint32_t i;
+
+        if (addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+                return NULL;
+        }
+        i = KVADDR_TO_PADDR(addr) >> PAGE_BITS;
+        if (i < first_frame || i >= last_frame) {
+                return NULL;
+        }
+        return frame_table[i].owner;
+}
+
@@ -35,10 +35,16 @@
  *
  * As long as the device we're connected to does, we allow printing in
  * an interrupt handler or with interrupts off (by polling),
- * transparently to the caller. Note that getch by polling is not
+ * transparently to the caller. Otherwise output is queued in a ring
+ * buffer and sent by the write-done interrupt, so writers don't wait
+ * for each character to go out. Note that getch by polling is not
  * supported, although such support could be added without undue
  * difficulty.
  *
+ * User reads can be in raw mode, where characters are passed through
+ * as typed, or line mode, where the input interrupt echoes and edits
+ * a line and a read gets a whole line at once.
+ *
  * Note that nothing happens until we have a device to write to. A
  * buffer of size DELAYBUFSIZE is used to hold output that is
  * generated before this point. This means that (1) using kprintf for
@@ -49,12 +55,16 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioctl.h>
 #include <lib.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -112,16 +122,114 @@ flush_delay_buf(void)
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
+ *
+ * Anything still queued for the interrupt-driven path is sent first,
+ * also by polling, so output comes out in order. (This is also what
+ * gets buffered output out before a panic or poweroff.) If we got
+ * here with the output lock already held, we're in the middle of the
+ * queueing code; just send the character.
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	unsigned char qch;
+
+	if (spinlock_do_i_hold(&cs->cs_outlock)) {
+		cs->cs_sendpolled(cs->cs_devdata, ch);
+		return;
+	}
+
+	spinlock_acquire(&cs->cs_outlock);
+	if (cs->cs_outbuf_head != cs->cs_outbuf_tail) {
+		while (cs->cs_outbuf_head != cs->cs_outbuf_tail) {
+			qch = cs->cs_outbuf[cs->cs_outbuf_tail];
+			cs->cs_outbuf_tail = (cs->cs_outbuf_tail + 1) %
+				CONSOLE_OUTPUT_BUFFER_SIZE;
+			cs->cs_sendpolled(cs->cs_devdata, qch);
+		}
+		wchan_wakeall(cs->cs_outwchan, &cs->cs_outlock);
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
 
+/*
+ * Start the transmitter on the next queued character, if it's idle
+ * and there is one. Call with the output lock held.
+ */
+static
+void
+con_kick(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+
+	if (cs->cs_sending || cs->cs_outbuf_head == cs->cs_outbuf_tail) {
+		return;
+	}
+	ch = cs->cs_outbuf[cs->cs_outbuf_tail];
+	cs->cs_outbuf_tail = (cs->cs_outbuf_tail + 1) %
+		CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_sending = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+/*
+ * Queue LEN characters for output, using interrupts to send them.
+ * Waits only if the ring fills up. As with the input buffer, head ==
+ * tail means empty, so one slot is always left unused.
+ */
+static
+void
+con_output(struct con_softc *cs, const char *buf, size_t len)
+{
+	unsigned nexthead;
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		nexthead = (cs->cs_outbuf_head + 1) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+		while (nexthead == cs->cs_outbuf_tail) {
+			con_kick(cs);
+			wchan_sleep(cs->cs_outwchan, &cs->cs_outlock);
+		}
+		cs->cs_outbuf[cs->cs_outbuf_head] = buf[i];
+		cs->cs_outbuf_head = nexthead;
+	}
+	con_kick(cs);
+	spinlock_release(&cs->cs_outlock);
+}
+
+/*
+ * Queue characters to echo. This is called from the input interrupt,
+ * so it can't wait; whatever doesn't fit in the ring is dropped.
+ */
+static
+void
+con_echo(struct con_softc *cs, const char *buf, size_t len)
+{
+	unsigned nexthead;
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		nexthead = (cs->cs_outbuf_head + 1) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+		if (nexthead == cs->cs_outbuf_tail) {
+			break;
+		}
+		cs->cs_outbuf[cs->cs_outbuf_head] = buf[i];
+		cs->cs_outbuf_head = nexthead;
+	}
+	con_kick(cs);
+	spinlock_release(&cs->cs_outlock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -129,34 +237,198 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	con_output(cs, &c, 1);
+}
+
+//////////////////////////////////////////////////
+
+/*
+ * Line mode. These are called from the input interrupt with the
+ * input lock held.
+ */
+
+/*
+ * Take the last character off the line being edited.
+ */
+static
+void
+con_rubout(struct con_softc *cs)
+{
+	KASSERT(cs->cs_linelen > 0);
+	cs->cs_linelen--;
+	con_echo(cs, "\b \b", 3);
+}
+
+/*
+ * The line is finished: move it, with its newline, to the buffer of
+ * lines waiting to be read, and wake up readers. If there isn't room
+ * the line is thrown away.
+ */
+static
+void
+con_endline(struct con_softc *cs)
+{
+	unsigned used, i;
+
+	cs->cs_line[cs->cs_linelen++] = '\n';
+
+	used = (cs->cs_cooked_head + CONSOLE_COOKED_BUFFER_SIZE -
+		cs->cs_cooked_tail) % CONSOLE_COOKED_BUFFER_SIZE;
+	if (used + cs->cs_linelen >= CONSOLE_COOKED_BUFFER_SIZE) {
+		con_echo(cs, "\a", 1);
+		cs->cs_linelen = 0;
+		return;
+	}
+
+	for (i=0; i<cs->cs_linelen; i++) {
+		cs->cs_cooked[cs->cs_cooked_head] = cs->cs_line[i];
+		cs->cs_cooked_head = (cs->cs_cooked_head + 1) %
+			CONSOLE_COOKED_BUFFER_SIZE;
+	}
+	cs->cs_cooked_lines++;
+	cs->cs_linelen = 0;
+	wchan_wakeall(cs->cs_inwchan, &cs->cs_inlock);
+}
+
+/*
+ * Handle one input character. Supports the same editing characters
+ * as kgets, less ^C and ^R. The last slot of cs_line is kept for the
+ * newline.
+ */
+static
+void
+con_linedisc(struct con_softc *cs, int ch)
+{
+	char c;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_inlock));
+
+	switch (ch) {
+	    case '\r':
+	    case '\n':
+		con_echo(cs, "\r\n", 2);
+		con_endline(cs);
+		break;
+	    case '\b':
+	    case 127:
+		if (cs->cs_linelen > 0) {
+			con_rubout(cs);
+		}
+		break;
+	    case 21:
+		/* ^U - erase line */
+		while (cs->cs_linelen > 0) {
+			con_rubout(cs);
+		}
+		break;
+	    case 23:
+		/* ^W - erase word */
+		while (cs->cs_linelen > 0 &&
+		       cs->cs_line[cs->cs_linelen-1] == ' ') {
+			con_rubout(cs);
+		}
+		while (cs->cs_linelen > 0 &&
+		       cs->cs_line[cs->cs_linelen-1] != ' ') {
+			con_rubout(cs);
+		}
+		break;
+	    default:
+		/* Only allow the normal 7-bit ascii, and tab */
+		if ((ch < 32 && ch != '\t') || ch >= 127 ||
+		    cs->cs_linelen >= CONSOLE_LINE_SIZE - 1) {
+			con_echo(cs, "\a", 1);
+			break;
+		}
+		c = ch;
+		cs->cs_line[cs->cs_linelen++] = c;
+		con_echo(cs, &c, 1);
+		break;
+	}
 }
 
 /*
- * Read a character, using interrupts to wait for I/O completion.
+ * Switch between raw and line mode; call with the input lock held.
+ * Raw characters not yet read when going to line mode are fed through
+ * the line discipline, so type-ahead isn't lost. Anything typed but
+ * not yet read in line mode is thrown away when going to raw mode.
+ * Readers of both kinds are woken so they can look again.
+ */
+static
+void
+con_setmode(struct con_softc *cs, bool raw)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_inlock));
+
+	if (cs->cs_rawmode == raw) {
+		return;
+	}
+	cs->cs_rawmode = raw;
+	cs->cs_linelen = 0;
+	cs->cs_cooked_head = cs->cs_cooked_tail = 0;
+	cs->cs_cooked_lines = 0;
+	if (!raw) {
+		while (cs->cs_gotchars_tail != cs->cs_gotchars_head) {
+			ch = cs->cs_gotchars[cs->cs_gotchars_tail];
+			cs->cs_gotchars_tail = (cs->cs_gotchars_tail + 1) %
+				CONSOLE_INPUT_BUFFER_SIZE;
+			con_linedisc(cs, ch);
+		}
+	}
+	wchan_wakeall(cs->cs_inwchan, &cs->cs_inlock);
+}
+
+static
+void
+con_setraw(struct con_softc *cs, bool raw)
+{
+	spinlock_acquire(&cs->cs_inlock);
+	con_setmode(cs, raw);
+	spinlock_release(&cs->cs_inlock);
+}
+
+/*
+ * Read a raw character, using interrupts to wait for I/O completion.
+ * If the console is in line mode, FORCE switches it back to raw mode;
+ * otherwise -1 is returned.
  */
 static
 int
-getch_intr(struct con_softc *cs)
+getch_intr(struct con_softc *cs, bool force)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
+	spinlock_acquire(&cs->cs_inlock);
+	while (1) {
+		if (!cs->cs_rawmode) {
+			if (!force) {
+				spinlock_release(&cs->cs_inlock);
+				return -1;
+			}
+			con_setmode(cs, true);
+		}
+		if (cs->cs_gotchars_tail != cs->cs_gotchars_head) {
+			break;
+		}
+		wchan_sleep(cs->cs_inwchan, &cs->cs_inlock);
+	}
 	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_release(&cs->cs_inlock);
 	return ret;
 }
 
+//////////////////////////////////////////////////
+
 /*
  * Called from underlying device when a read-ready interrupt occurs.
  *
  * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
- * if gotchars_head+1 == gotchars_tail, the buffer is full. A slightly
- * tidier way to implement this check (that avoids wasting a slot,
- * too) would be with a second semaphore used with a nonblocking P,
- * but we don't have that in OS/161.
+ * if gotchars_head+1 == gotchars_tail, the buffer is full.
  */
 void
 con_input(void *vcs, int ch)
@@ -164,27 +436,47 @@ con_input(void *vcs, int ch)
 	struct con_softc *cs = vcs;
 	unsigned nexthead;
 
+	spinlock_acquire(&cs->cs_inlock);
+	if (!cs->cs_rawmode) {
+		con_linedisc(cs, ch);
+		spinlock_release(&cs->cs_inlock);
+		return;
+	}
+
 	nexthead = (cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE;
 	if (nexthead == cs->cs_gotchars_tail) {
 		/* overflow; drop character */
+		spinlock_release(&cs->cs_inlock);
 		return;
 	}
 
 	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
 	cs->cs_gotchars_head = nexthead;
-
-	V(cs->cs_rsem);
+	wchan_wakeall(cs->cs_inwchan, &cs->cs_inlock);
+	spinlock_release(&cs->cs_inlock);
 }
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next queued character, if any. Writers waiting for space
+ * are woken once the ring is half empty, rather than once per
+ * character.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
-
-	V(cs->cs_wsem);
+	unsigned used;
+
+	spinlock_acquire(&cs->cs_outlock);
+	cs->cs_sending = false;
+	con_kick(cs);
+	used = (cs->cs_outbuf_head + CONSOLE_OUTPUT_BUFFER_SIZE -
+		cs->cs_outbuf_tail) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	if (used <= CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		wchan_wakeall(cs->cs_outwchan, &cs->cs_outlock);
+	}
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
@@ -194,7 +486,8 @@ con_start(void *vcs)
  *
  * Warning: putch must work even in an interrupt handler or with
  * interrupts disabled, and before the console is probed. getch need
- * not, and does not.
+ * not, and does not. getch always reads raw characters; if a program
+ * left the console in line mode, getch puts it back in raw mode.
  */
 
 void
@@ -222,7 +515,7 @@ getch(void)
 	KASSERT(cs != NULL);
 	KASSERT(!curthread->t_in_interrupt && curthread->t_iplhigh_count == 0);
 
-	return getch_intr(cs);
+	return getch_intr(cs, true);
 }
 
 ////////////////////////////////////////////////////////////
@@ -240,15 +533,116 @@ con_eachopen(struct device *dev, int openflags)
 	return 0;
 }
 
+/*
+ * Write from a uio. The data is copied in a chunk at a time, newlines
+ * are turned into CR-LF, and the result is queued in one go.
+ */
+#define CON_WRITECHUNK 64
+
 static
 int
-con_io(struct device *dev, struct uio *uio)
+con_write(struct con_softc *cs, struct uio *uio)
 {
+	char inbuf[CON_WRITECHUNK];
+	char outbuf[2 * CON_WRITECHUNK];
+	size_t len, i, n;
 	int result;
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > sizeof(inbuf)) {
+			len = sizeof(inbuf);
+		}
+		result = uiomove(inbuf, len, uio);
+		if (result) {
+			return result;
+		}
+		n = 0;
+		for (i=0; i<len; i++) {
+			if (inbuf[i]=='\n') {
+				outbuf[n++] = '\r';
+			}
+			outbuf[n++] = inbuf[i];
+		}
+		con_output(cs, outbuf, n);
+	}
+	return 0;
+}
+
+/*
+ * Raw-mode read: return characters as they're typed, stopping after
+ * a newline, when the uio is full, or if someone switches the console
+ * to line mode.
+ */
+static
+int
+con_readraw(struct con_softc *cs, struct uio *uio)
+{
+	int result, c;
 	char ch;
-	struct lock *lk;
 
-	(void)dev;  // unused
+	while (uio->uio_resid > 0) {
+		c = getch_intr(cs, false);
+		if (c < 0) {
+			break;
+		}
+		ch = c;
+		if (ch=='\r') {
+			ch = '\n';
+		}
+		result = uiomove(&ch, 1, uio);
+		if (result) {
+			return result;
+		}
+		if (ch=='\n') {
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read: in line mode, wait for a complete line and copy out as much
+ * of it as fits, in one go. The rest of a line that doesn't fit is
+ * left for the next read.
+ */
+static
+int
+con_read(struct con_softc *cs, struct uio *uio)
+{
+	char buf[CONSOLE_LINE_SIZE];
+	size_t len;
+
+	spinlock_acquire(&cs->cs_inlock);
+	while (!cs->cs_rawmode && cs->cs_cooked_lines == 0) {
+		wchan_sleep(cs->cs_inwchan, &cs->cs_inlock);
+	}
+	if (cs->cs_rawmode) {
+		spinlock_release(&cs->cs_inlock);
+		return con_readraw(cs, uio);
+	}
+
+	len = 0;
+	while (len < uio->uio_resid && len < sizeof(buf)) {
+		buf[len] = cs->cs_cooked[cs->cs_cooked_tail];
+		cs->cs_cooked_tail = (cs->cs_cooked_tail + 1) %
+			CONSOLE_COOKED_BUFFER_SIZE;
+		if (buf[len++] == '\n') {
+			cs->cs_cooked_lines--;
+			break;
+		}
+	}
+	spinlock_release(&cs->cs_inlock);
+
+	return uiomove(buf, len, uio);
+}
+
+static
+int
+con_io(struct device *dev, struct uio *uio)
+{
+	int result;
+	struct lock *lk;
 
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
@@ -260,45 +654,38 @@ con_io(struct device *dev, struct uio *uio)
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
 
-	while (uio->uio_resid > 0) {
-		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				break;
-			}
-		}
-		else {
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
-		}
+	if (uio->uio_rw==UIO_WRITE) {
+		result = con_write(dev->d_data, uio);
+		lock_release(lk);
+		return result;
 	}
+
+	result = con_read(dev->d_data, uio);
 	lock_release(lk);
-	return 0;
+	return result;
 }
 
 static
 int
 con_ioctl(struct device *dev, int op, userptr_t data)
 {
-	/* No ioctls. */
-	(void)dev;
-	(void)op;
-	(void)data;
+	struct con_softc *cs = dev->d_data;
+	int raw, result;
+
+	switch (op) {
+	    case CONSOLE_IOCTL_SETRAW:
+		result = copyin(data, &raw, sizeof(raw));
+		if (result) {
+			return result;
+		}
+		con_setraw(cs, raw != 0);
+		return 0;
+	    case CONSOLE_IOCTL_GETRAW:
+		spinlock_acquire(&cs->cs_inlock);
+		raw = cs->cs_rawmode;
+		spinlock_release(&cs->cs_inlock);
+		return copyout(&raw, data, sizeof(raw));
+	}
 	return EINVAL;
 }
 
@@ -343,7 +730,7 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct wchan *inwchan, *outwchan;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -359,33 +746,43 @@ config_con(struct con_softc *cs, int unit)
 	}
 	KASSERT(the_console==NULL);
 
-	rsem = sem_create("console read", 0);
-	if (rsem == NULL) {
+	inwchan = wchan_create("console read");
+	if (inwchan == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
-		sem_destroy(rsem);
+	outwchan = wchan_create("console write");
+	if (outwchan == NULL) {
+		wchan_destroy(inwchan);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(inwchan);
+		wchan_destroy(outwchan);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(inwchan);
+		wchan_destroy(outwchan);
 		return ENOMEM;
 	}
 
-	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	spinlock_init(&cs->cs_inlock);
+	cs->cs_inwchan = inwchan;
+	cs->cs_rawmode = true;
+	cs->cs_linelen = 0;
+	cs->cs_cooked_head = 0;
+	cs->cs_cooked_tail = 0;
+	cs->cs_cooked_lines = 0;
+	spinlock_init(&cs->cs_outlock);
+	cs->cs_outwchan = outwchan;
+	cs->cs_sending = false;
+	cs->cs_outbuf_head = 0;
+	cs->cs_outbuf_tail = 0;
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -35,9 +35,27 @@
  *
  * devdata, send, and sendpolled are provided by the underlying
  * device, and are to be initialized by the attach routine.
+ *
+ * Output goes into a ring buffer (cs_outbuf) that the write-done
+ * interrupt drains one character at a time; writers only wait when
+ * it's full. cs_outlock protects the ring and cs_sending, which is
+ * true while a character handed to cs_send has not yet completed.
+ *
+ * Input is either raw or line mode (the default is raw, selected with
+ * CONSOLE_IOCTL_SETRAW). In raw mode each character goes into the
+ * cs_gotchars ring for getch. In line mode the interrupt handler does
+ * the editing: characters are echoed and collected in cs_line, and
+ * when a line is finished it's moved into the cs_cooked ring for
+ * readers. cs_inlock protects all the input state, and readers of
+ * either kind wait on cs_inwchan.
  */
 
+#include <spinlock.h>
+
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
+#define CONSOLE_LINE_SIZE 256
+#define CONSOLE_COOKED_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -46,11 +64,26 @@ struct con_softc {
 	void (*cs_sendpolled)(void *devdata, int ch);
 
 	/* initialized by config routine */
-	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+
+	struct spinlock cs_inlock;
+	struct wchan *cs_inwchan;	/* readers waiting for input */
+	bool cs_rawmode;
+	char cs_line[CONSOLE_LINE_SIZE]; /* line being edited */
+	unsigned cs_linelen;
+	char cs_cooked[CONSOLE_COOKED_BUFFER_SIZE]; /* finished lines */
+	unsigned cs_cooked_head;
+	unsigned cs_cooked_tail;
+	unsigned cs_cooked_lines;	/* complete lines in cs_cooked */
+
+	struct spinlock cs_outlock;
+	struct wchan *cs_outwchan;	/* writers waiting for ring space */
+	bool cs_sending;		/* transmitter busy */
+	unsigned char cs_outbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_outbuf_head;	/* next slot to put a char in */
+	unsigned cs_outbuf_tail;	/* next slot to take a char out */
 };
 
 /*
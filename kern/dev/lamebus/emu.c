@@ -38,6 +38,12 @@
  * This makes it unnecessary to copy the system files to the simulated
  * disk, although we recommend doing so and trying running without this
  * device as part of testing your filesystem.
+ *
+ * The device has one set of registers and one I/O buffer, so it can
+ * only do one operation at a time. To keep that from serializing
+ * everyone, file contents are cached in memory (see "Page cache"
+ * below) and the device lock is held only while talking to the
+ * device, not while copying to and from user space.
  */
 
 #include <types.h>
@@ -49,6 +55,7 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <vm.h>
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
@@ -404,6 +411,216 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Page cache
+//
+// Data read from files is kept in page-sized chunks, named by
+// (handle, offset). A miss reads EMU_MAXIO bytes from the device at
+// once, so sequential reads mostly hit. A handle lives as long as its
+// vnode, which the VFS name cache keeps around between opens, so e.g.
+// repeated execs of the same program hit too. A handle's pages are
+// dropped when it's closed.
+//
+// Several handles can be open on the same host file, and the device
+// gives us no way to tell, so a write or truncate through any handle
+// drops the whole cache rather than just that handle's pages.
+//
+// Files are assumed not to change on the host behind our back; one
+// that does may be seen stale until its pages are evicted.
+//
+// Lock order: e_lock, then ef_cachelock. Neither is held while
+// copying out to the caller; instead the reader marks the page busy,
+// which keeps it from being recycled. A busy page that gets dropped
+// is only marked stale, and the last reader frees it.
+//
+
+/*
+ * Find the page of HANDLE at OFFSET, or return NULL.
+ */
+static
+struct emufs_cpage *
+emufs_cache_find(struct emufs_fs *ef, uint32_t handle, uint32_t offset)
+{
+	struct emufs_cpage *cp;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+	for (i=0; i<EMUFS_CACHEPAGES; i++) {
+		cp = &ef->ef_cache[i];
+		if (cp->cp_data != NULL && !cp->cp_stale &&
+		    cp->cp_handle == handle && cp->cp_offset == offset) {
+			cp->cp_stamp = ++ef->ef_cachestamp;
+			return cp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Choose a slot for a new page: an empty one if there is one,
+ * otherwise the least recently used one that isn't busy. Returns
+ * NULL if they're all busy.
+ */
+static
+struct emufs_cpage *
+emufs_cache_victim(struct emufs_fs *ef)
+{
+	struct emufs_cpage *cp, *best;
+	unsigned i;
+
+	best = NULL;
+	for (i=0; i<EMUFS_CACHEPAGES; i++) {
+		cp = &ef->ef_cache[i];
+		if (cp->cp_data == NULL) {
+			return cp;
+		}
+		if (cp->cp_busy > 0) {
+			continue;
+		}
+		if (best == NULL || cp->cp_stamp < best->cp_stamp) {
+			best = cp;
+		}
+	}
+	return best;
+}
+
+/*
+ * Read a chunk of HANDLE starting at OFFSET (which is page-aligned)
+ * and put it in the cache. Call with both locks held.
+ */
+static
+int
+emufs_cache_fill(struct emufs_fs *ef, uint32_t handle, uint32_t offset)
+{
+	struct emu_softc *sc = ef->ef_emu;
+	struct emufs_cpage *cp;
+	uint32_t len, pos, amt;
+	int result;
+
+	KASSERT(lock_do_i_hold(sc->e_lock));
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	emu_wreg(sc, REG_HANDLE, handle);
+	emu_wreg(sc, REG_IOLEN, EMU_MAXIO);
+	emu_wreg(sc, REG_OFFSET, offset);
+	emu_wreg(sc, REG_OPER, EMU_OP_READ);
+	result = emu_waitdone(sc);
+	if (result) {
+		return result;
+	}
+
+	membar_load_load();
+	len = emu_rreg(sc, REG_IOLEN);
+
+	/* A short (or empty) page marks EOF; stop after it. */
+	pos = 0;
+	do {
+		amt = len - pos;
+		if (amt > PAGE_SIZE) {
+			amt = PAGE_SIZE;
+		}
+		if (emufs_cache_find(ef, handle, offset + pos) == NULL) {
+			cp = emufs_cache_victim(ef);
+			if (cp == NULL) {
+				return ENOMEM;
+			}
+			if (cp->cp_data == NULL) {
+				cp->cp_data = kmalloc(PAGE_SIZE);
+				if (cp->cp_data == NULL) {
+					return ENOMEM;
+				}
+			}
+			memcpy(cp->cp_data, (char *)sc->e_iobuf + pos, amt);
+			cp->cp_handle = handle;
+			cp->cp_offset = offset + pos;
+			cp->cp_len = amt;
+			cp->cp_stamp = ++ef->ef_cachestamp;
+		}
+		pos += amt;
+	} while (amt == PAGE_SIZE && pos < len);
+
+	return 0;
+}
+
+/*
+ * Drop a page, or if someone is copying out of it, leave that to
+ * them.
+ */
+static
+void
+emufs_cache_drop(struct emufs_cpage *cp)
+{
+	if (cp->cp_busy > 0) {
+		cp->cp_stale = true;
+		return;
+	}
+	kfree(cp->cp_data);
+	cp->cp_data = NULL;
+	cp->cp_stale = false;
+}
+
+/*
+ * Done copying out of a page.
+ */
+static
+void
+emufs_cache_unbusy(struct emufs_fs *ef, struct emufs_cpage *cp)
+{
+	lock_acquire(ef->ef_cachelock);
+	KASSERT(cp->cp_busy > 0);
+	cp->cp_busy--;
+	if (cp->cp_stale) {
+		emufs_cache_drop(cp);
+	}
+	lock_release(ef->ef_cachelock);
+}
+
+/*
+ * Drop all cached pages.
+ */
+static
+void
+emufs_cache_purge(struct emufs_fs *ef)
+{
+	struct emufs_cpage *cp;
+	unsigned i;
+
+	lock_acquire(ef->ef_cachelock);
+	for (i=0; i<EMUFS_CACHEPAGES; i++) {
+		cp = &ef->ef_cache[i];
+		if (cp->cp_data != NULL) {
+			emufs_cache_drop(cp);
+		}
+	}
+	lock_release(ef->ef_cachelock);
+}
+
+/*
+ * Drop all cached pages of HANDLE.
+ */
+static
+void
+emufs_cache_invalidate(struct emufs_fs *ef, uint32_t handle)
+{
+	struct emufs_cpage *cp;
+	unsigned i;
+
+	lock_acquire(ef->ef_cachelock);
+	for (i=0; i<EMUFS_CACHEPAGES; i++) {
+		cp = &ef->ef_cache[i];
+		if (cp->cp_data != NULL && cp->cp_handle == handle) {
+			emufs_cache_drop(cp);
+		}
+	}
+	lock_release(ef->ef_cachelock);
+}
+
+//
+////////////////////////////////////////////////////////////
+
 ////////////////////////////////////////////////////////////
 //
 // vnode functions
@@ -507,6 +724,9 @@ emufs_reclaim(struct vnode *v)
 		return result;
 	}
 
+	/* Still under e_lock, so nobody can get this handle yet */
+	emufs_cache_invalidate(ef, ev->ev_handle);
+
 	num = vnodearray_num(ef->ef_vnodes);
 	ix = num;
 	for (i=0; i<num; i++) {
@@ -534,19 +754,16 @@ emufs_reclaim(struct vnode *v)
 }
 
 /*
- * VOP_READ
+ * Read without the cache, for when there's no memory for it.
  */
 static
 int
-emufs_read(struct vnode *v, struct uio *uio)
+emufs_read_uncached(struct emufs_vnode *ev, struct uio *uio)
 {
-	struct emufs_vnode *ev = v->vn_data;
 	uint32_t amt;
 	size_t oldresid;
 	int result;
 
-	KASSERT(uio->uio_rw==UIO_READ);
-
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
@@ -569,6 +786,76 @@ emufs_read(struct vnode *v, struct uio *uio)
 	return 0;
 }
 
+/*
+ * VOP_READ
+ *
+ * Copy out of the page cache a page at a time, filling it from the
+ * device on a miss.
+ */
+static
+int
+emufs_read(struct vnode *v, struct uio *uio)
+{
+	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_cpage *cp;
+	uint32_t pageoff, skip, amt;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	while (uio->uio_resid > 0) {
+		if (uio->uio_offset >= (off_t)0xffffffff) {
+			/* beyond the largest size the file can have */
+			break;
+		}
+		pageoff = uio->uio_offset - uio->uio_offset % PAGE_SIZE;
+
+		lock_acquire(ef->ef_cachelock);
+		cp = emufs_cache_find(ef, ev->ev_handle, pageoff);
+		if (cp == NULL) {
+			lock_release(ef->ef_cachelock);
+			lock_acquire(ev->ev_emu->e_lock);
+			lock_acquire(ef->ef_cachelock);
+			result = emufs_cache_fill(ef, ev->ev_handle, pageoff);
+			lock_release(ev->ev_emu->e_lock);
+			if (result == 0) {
+				cp = emufs_cache_find(ef, ev->ev_handle,
+						      pageoff);
+			}
+			if (cp == NULL) {
+				lock_release(ef->ef_cachelock);
+				if (result == ENOMEM) {
+					return emufs_read_uncached(ev, uio);
+				}
+				return result;
+			}
+		}
+
+		skip = uio->uio_offset - pageoff;
+		if (skip >= cp->cp_len) {
+			/* EOF */
+			lock_release(ef->ef_cachelock);
+			break;
+		}
+		amt = cp->cp_len - skip;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
+		}
+
+		/* Copy out without the lock; being busy keeps the page. */
+		cp->cp_busy++;
+		lock_release(ef->ef_cachelock);
+		result = uiomove(cp->cp_data + skip, amt, uio);
+		emufs_cache_unbusy(ef, cp);
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
+
 /*
  * VOP_READDIR
  */
@@ -597,9 +884,10 @@ int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
 	uint32_t amt;
 	size_t oldresid;
-	int result;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
@@ -613,7 +901,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
-			return result;
+			break;
 		}
 
 		if (uio->uio_resid == oldresid) {
@@ -622,7 +910,13 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
-	return 0;
+	/*
+	 * Drop cached pages afterwards, not before, so that nothing
+	 * read in while we were writing survives. Other handles may be
+	 * open on the same file; drop theirs too.
+	 */
+	emufs_cache_purge(ef);
+	return result;
 }
 
 /*
@@ -725,7 +1019,13 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	int result;
+
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	/* As in emufs_write, other handles may be cached too */
+	emufs_cache_purge(ef);
+	return result;
 }
 
 /*
@@ -785,12 +1085,14 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	}
 
 	result = emufs_loadvnode(ef, handle, isdir, &newguy);
-	vfs_biglock_release();
 	if (result) {
+		vfs_biglock_release();
 		emu_close(ev->ev_emu, handle);
 		return result;
 	}
 
+	vfs_biglock_release();
+
 	*ret = &newguy->ev_v;
 	return 0;
 }
@@ -1316,6 +1618,15 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 		return ENOMEM;
 	}
 
+	ef->ef_cachelock = lock_create("emufs-cache");
+	if (ef->ef_cachelock == NULL) {
+		vnodearray_destroy(ef->ef_vnodes);
+		kfree(ef);
+		return ENOMEM;
+	}
+	bzero(ef->ef_cache, sizeof(ef->ef_cache));
+	ef->ef_cachestamp = 0;
+
 	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
 	if (result) {
 		kfree(ef);
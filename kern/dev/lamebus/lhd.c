@@ -36,7 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +60,12 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Most sectors that can be merged into one back-to-back run */
+#define LHD_MAXRUN      128
+
+/* Bounce buffer size for I/O to user memory */
+#define LHD_BOUNCESIZE  4096
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,41 +101,169 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 	return EAGAIN;
 }
 
+////////////////////////////////////////////////////////////
+// Request queue
+
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * The hardware does one sector per command, through a one-sector
+ * buffer on the card. Requests (struct devreq, see device.h) wait in
+ * the I/O scheduler (iosched.h), which decides the order and merges
+ * adjacent requests into runs. The interrupt handler moves on to the
+ * next sector, and to the next request, by itself; no thread is woken
+ * up between sectors. The submitter hears about the request only
+ * once, through its completion function, when all of it is done.
+ *
+ * Runs are limited to LHD_MAXRUN sectors so one stream can't hold the
+ * disk forever.
+ *
+ * All of this is protected by lh_lock, which is a spinlock because
+ * the interrupt handler needs it.
+ */
+
+/*
+ * Start the current sector of the active request.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_start(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL);
+
+	/* If writing, transfer the data to the on-card buffer. */
+	if (req->dr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)req->dr_data + lh->lh_activesect*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT,
+		 req->dr_offset / LHD_SECTSIZE + lh->lh_activesect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, start the next queued request.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh)
+{
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL) {
+		return;
+	}
+	lh->lh_active = iosched_next(&lh->lh_sched);
+	if (lh->lh_active == NULL) {
+		return;
+	}
+	lh->lh_activesect = 0;
+	lhd_start(lh);
+}
+
+/*
+ * Queue a request.
+ */
+static
+void
+lhd_submit(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow I/O that isn't sector-aligned or is off the disk. */
+	if (req->dr_offset < 0 ||
+	    req->dr_offset % LHD_SECTSIZE != 0 ||
+	    req->dr_len % LHD_SECTSIZE != 0 ||
+	    (uint64_t)(req->dr_offset / LHD_SECTSIZE)
+	    + req->dr_len / LHD_SECTSIZE > (uint64_t)lh->lh_dev.d_blocks) {
+		req->dr_done(req, EINVAL);
+		return;
+	}
+	if (req->dr_len == 0) {
+		req->dr_done(req, 0);
+		return;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	iosched_add(&lh->lh_sched, req, lh->lh_active);
+	lhd_dispatch(lh);
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, finish the sector, and start the next one. If that was
+ * the end of a request, call its completion function.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devreq *req, *done;
 	uint32_t val;
+	int result;
+
+	spinlock_acquire(&lh->lh_lock);
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
-		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+	lhd_wreg(lh, LHD_REG_STAT, 0);
+	result = lhd_code_to_errno(lh, val);
+
+	req = lh->lh_active;
+	if (req == NULL) {
+		/* Nothing was running; ignore it */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/* If reading, transfer the data out of the on-card buffer. */
+	if (result == 0 && !req->dr_write) {
+		membar_load_load();
+		memcpy((char *)req->dr_data + lh->lh_activesect*LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_activesect++;
+
+	done = NULL;
+	if (result != 0 || lh->lh_activesect * LHD_SECTSIZE == req->dr_len) {
+		/* Request finished; go on to the rest of its run, if any */
+		done = req;
+		lh->lh_active = req->dr_mergenext;
+		lh->lh_activesect = 0;
+		done->dr_mergenext = NULL;
+		iosched_done(&lh->lh_sched, done);
+	}
+	if (lh->lh_active != NULL) {
+		lhd_start(lh);
+	}
+	else {
+		lhd_dispatch(lh);
+	}
+
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		done->dr_done(done, result);
 	}
 }
 
@@ -179,8 +313,73 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+////////////////////////////////////////////////////////////
+// Synchronous I/O
+
+/*
+ * A request being waited for.
+ */
+struct lhd_waiter {
+	struct devreq lw_req;
+	struct lhd_softc *lw_lh;
+	int lw_result;
+	bool lw_done;
+};
+
+/*
+ * Completion function for lhd_wait.
+ */
+static
+void
+lhd_wakeup(struct devreq *req, int result)
+{
+	struct lhd_waiter *lw = req->dr_arg;
+	struct lhd_softc *lh = lw->lw_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	lw->lw_result = result;
+	lw->lw_done = true;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Queue a request and wait for it to finish.
+ */
+static
+int
+lhd_wait(struct lhd_softc *lh, void *data, size_t len, off_t offset,
+	 bool write)
+{
+	struct lhd_waiter lw;
+
+	lw.lw_req.dr_offset = offset;
+	lw.lw_req.dr_data = data;
+	lw.lw_req.dr_len = len;
+	lw.lw_req.dr_write = write;
+	lw.lw_req.dr_done = lhd_wakeup;
+	lw.lw_req.dr_arg = &lw;
+	lw.lw_lh = lh;
+	lw.lw_result = 0;
+	lw.lw_done = false;
+
+	lhd_submit(&lh->lh_dev, &lw.lw_req);
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!lw.lw_done) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return lw.lw_result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * A single kernel buffer (the usual case, from the buffer cache) is
+ * transferred as one request directly to or from its memory. Anything
+ * else goes through a bounce buffer, LHD_BOUNCESIZE at a time.
  */
 static
 int
@@ -192,8 +391,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = uio->uio_rw == UIO_WRITE;
+	struct iovec *iov;
+	void *bounce;
+	size_t amt;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -207,67 +408,62 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		iov = uio->uio_iov;
+		amt = uio->uio_resid;
+		KASSERT(iov->iov_len >= amt);
+		result = lhd_wait(lh, iov->iov_kbase, amt, uio->uio_offset,
+				  write);
+		if (result) {
+			return result;
+		}
+		/* Advance the uio the way uiomove would have */
+		iov->iov_kbase = (char *)iov->iov_kbase + amt;
+		iov->iov_len -= amt;
+		uio->uio_offset += amt;
+		uio->uio_resid = 0;
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+	bounce = kmalloc(LHD_BOUNCESIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	result = 0;
+	while (uio->uio_resid > 0) {
+		amt = uio->uio_resid;
+		if (amt > LHD_BOUNCESIZE) {
+			amt = LHD_BOUNCESIZE;
+		}
+		if (write) {
+			result = uiomove(bounce, amt, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
+			result = lhd_wait(lh, bounce, amt,
+					  uio->uio_offset - amt, true);
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		else {
+			result = lhd_wait(lh, bounce, amt, uio->uio_offset,
+					  false);
+			if (result) {
+				break;
+			}
+			result = uiomove(bounce, amt, uio);
 		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
-
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_submit = lhd_submit,
 };
 
 /*
@@ -276,25 +472,23 @@ static const struct device_ops lhd_devops = {
 int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
-	char name[32];
-
 	/* Figure out what our name is. */
-	snprintf(name, sizeof(name), "lhd%d", lhdno);
+	snprintf(lh->lh_name, sizeof(lh->lh_name), "lhd%d", lhdno);
 
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	iosched_init(&lh->lh_sched, lh->lh_name, &lh->lh_lock,
+		     LHD_MAXRUN * LHD_SECTSIZE);
+	lh->lh_active = NULL;
+	lh->lh_activesect = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -304,5 +498,5 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	lh->lh_dev.d_data = lh;
 
 	/* Add the VFS device structure to the VFS device list. */
-	return vfs_adddev(name, &lh->lh_dev, 1);
+	return vfs_adddev(lh->lh_name, &lh->lh_dev, 1);
 }
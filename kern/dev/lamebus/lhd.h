@@ -30,7 +30,11 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
+#include <iosched.h>
+
+struct wchan;
 
 /*
  * Our sector size
@@ -51,10 +55,13 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct wchan *lh_wchan;		/* For waiting for synchronous I/O */
+	struct iosched lh_sched;	/* Queued requests */
+	struct devreq *lh_active;	/* Request in progress */
+	uint32_t lh_activesect;		/* Sector within lh_active */
 
+	char lh_name[16];		/* Our name, for the I/O scheduler */
 	struct device lh_dev;		/* VFS device structure */
 };
 
@@ -35,20 +35,54 @@
 #include <types.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This happens in the buffer cache; the zeros
+ * reach the disk when the buffer is written back. If OWNER isn't
+ * NULL the block belongs to that file.
  */
 static
 int
-sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
+sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct bufowner *owner)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	if (owner != NULL) {
+		buffer_mark_dirty_owner(buf, owner);
+	}
+	else {
+		buffer_mark_dirty(buf);
+	}
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Note that the freemap bit for BLOCK has changed, so the freemap
+ * block it's in needs to be written. Call with the freemap lock held.
+ */
+static
+void
+sfs_freemap_setdirty(struct sfs_fs *sfs, daddr_t block)
+{
+	unsigned fmblock = block / SFS_BITSPERBLOCK;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	if (!bitmap_isset(sfs->sfs_freemapdirtymap, fmblock)) {
+		bitmap_mark(sfs->sfs_freemapdirtymap, fmblock);
+	}
+	sfs->sfs_freemapdirty = true;
 }
 
 /*
@@ -59,33 +93,248 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_setdirty(sfs, *diskblock);
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
-	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
+	/*
+	 * Clear block before returning it. Nobody else can get at
+	 * it, so we don't need the freemap lock for this.
+	 */
+	result = sfs_clearblock(sfs, *diskblock, NULL);
 	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs_freemap_setdirty(sfs, *diskblock);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
+////////////////////////////////////////////////////////////
+// Allocation for file contents
+
+/*
+ * Plain sfs_balloc hands out the first free block on the disk, so
+ * files written at the same time end up interleaved block by block.
+ * For blocks that belong to a file we try harder:
+ *
+ *    - we aim for the block right after the file's previous block
+ *      (or, failing that, the last block we gave the file);
+ *
+ *    - each file being written holds a small run of reserved blocks
+ *      just past its most recent allocation, so another writer can't
+ *      take them out from under it. Reserved blocks are marked in use
+ *      in the freemap; they're given back by sfs_bunreserve when the
+ *      vnode is reclaimed, or when the file starts a new run. (If we
+ *      crash meanwhile, sfsck finds and frees them.)
+ *
+ *    - callers that will overwrite the whole block can skip clearing
+ *      it.
+ */
+
+/* Number of blocks reserved ahead for a file being written */
+#define SFS_RESERVE        8
+
+/* How far to look past the goal for a free block before giving up */
+#define SFS_SEARCHWINDOW   1024
+
+/*
+ * Release the unused part of SV's reservation. Call with the freemap
+ * lock held.
+ */
+static
+void
+sfs_bunreserve_locked(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	while (sv->sv_resvnext < sv->sv_resvend) {
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_resvnext);
+		sfs_freemap_setdirty(sfs, sv->sv_resvnext);
+		sv->sv_resvnext++;
+	}
+	sv->sv_resvnext = sv->sv_resvend = 0;
+}
+
+/*
+ * Release the unused part of SV's reservation.
+ */
+void
+sfs_bunreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_bunreserve_locked(sv);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Reserve up to SFS_RESERVE free blocks immediately following BLOCK
+ * for SV, replacing any previous reservation. Call with the freemap
+ * lock held.
+ */
+static
+void
+sfs_breserve(struct sfs_vnode *sv, daddr_t block)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t next;
+
+	sfs_bunreserve_locked(sv);
+
+	next = block + 1;
+	while (next < sfs->sfs_sb.sb_nblocks && next <= block + SFS_RESERVE &&
+	       !bitmap_isset(sfs->sfs_freemap, next)) {
+		bitmap_mark(sfs->sfs_freemap, next);
+		sfs_freemap_setdirty(sfs, next);
+		next++;
+	}
+	if (next > block + 1) {
+		sv->sv_resvnext = block + 1;
+		sv->sv_resvend = next;
+	}
+}
+
+/*
+ * Find and take a free block at or shortly after GOAL. Fall back to
+ * the first free block on the disk. Call with the freemap lock held.
+ */
+static
+int
+sfs_bsearch(struct sfs_fs *sfs, daddr_t goal, daddr_t *ret)
+{
+	daddr_t block;
+	unsigned i;
+
+	for (i=0; i<SFS_SEARCHWINDOW; i++) {
+		block = goal + i;
+		if (block >= sfs->sfs_sb.sb_nblocks) {
+			break;
+		}
+		if (!bitmap_isset(sfs->sfs_freemap, block)) {
+			bitmap_mark(sfs->sfs_freemap, block);
+			*ret = block;
+			return 0;
+		}
+	}
+	return bitmap_alloc(sfs->sfs_freemap, ret);
+}
+
+/*
+ * Allocate a block for file SV. PREVBLOCK is the disk block holding
+ * the file block before the one being allocated, if known, and 0
+ * otherwise. If CLEAR is false the block is not zeroed; the caller
+ * promises to overwrite all of it through the buffer cache (with
+ * buffer_get) before anyone can read it.
+ */
+int
+sfs_balloc_file(struct sfs_vnode *sv, daddr_t prevblock, bool clear,
+		daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t goal, block;
+	bool fromresv;
+	int result;
+
+	if (prevblock != 0) {
+		goal = prevblock + 1;
+	}
+	else if (sv->sv_lastalloc != 0) {
+		goal = sv->sv_lastalloc + 1;
+	}
+	else {
+		goal = 0;
+	}
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	fromresv = false;
+	if (sv->sv_resvnext < sv->sv_resvend &&
+	    (goal == 0 || goal == sv->sv_resvnext)) {
+		/* The reservation continues where we want to be */
+		block = sv->sv_resvnext++;
+		fromresv = true;
+	}
+	else if (goal != 0 && goal < sfs->sfs_sb.sb_nblocks &&
+		 !bitmap_isset(sfs->sfs_freemap, goal)) {
+		/* The block we want is free */
+		bitmap_mark(sfs->sfs_freemap, goal);
+		block = goal;
+	}
+	else if (sv->sv_resvnext < sv->sv_resvend) {
+		/* Not where we wanted, but still near our other blocks */
+		block = sv->sv_resvnext++;
+		fromresv = true;
+	}
+	else {
+		result = sfs_bsearch(sfs, goal, &block);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+	}
+	sfs_freemap_setdirty(sfs, block);
+
+	if (!fromresv) {
+		/* Start a new run after this block */
+		sfs_breserve(sv, block);
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	if (block >= sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc: invalid block %u\n",
+		      sfs->sfs_sb.sb_volname, block);
+	}
+
+	if (clear) {
+		result = sfs_clearblock(sfs, block, &sv->sv_bufs);
+		if (result) {
+			lock_acquire(sfs->sfs_freemaplock);
+			bitmap_unmark(sfs->sfs_freemap, block);
+			sfs_freemap_setdirty(sfs, block);
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+	}
+
+	sv->sv_lastalloc = block;
+	*diskblock = block;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Freeing and checking
+
 /*
- * Free a block.
+ * Free a block. Any cached copy is thrown away unwritten; nobody
+ * cares what's in a free block.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	sfs_jrevoke(sfs, diskblock);
+	buffer_drop(sfs->sfs_device, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_setdirty(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +343,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int result;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return result;
 }
 
@@ -35,39 +35,154 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <vfs.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Block mapping.
+ *
+ * The first SFS_NDIRECT blocks of a file are mapped directly from the
+ * inode. After that come the blocks mapped by the single indirect
+ * block (SFS_DBPERIDB of them), then the double indirect block
+ * (SFS_DBPERIDB squared), then the triple indirect block (cubed).
+ *
+ * Every data block past the direct blocks is ultimately found in some
+ * "leaf" indirect block, one that holds data block numbers. Sequential
+ * access tends to use the same leaf over and over, so each vnode
+ * remembers the last leaf it used and which file blocks it covers;
+ * when the next lookup falls in the same range we can skip walking
+ * down from the inode. sfs_itrunc clears this, since it may free the
+ * leaf.
+ */
+
+/*
+ * Return a pointer to the inode's slot for the top-level indirect
+ * block with LEVELS levels of indirection (1, 2, or 3).
+ */
+static
+uint32_t *
+sfs_bmap_topslot(struct sfs_vnode *sv, unsigned levels)
+{
+	switch (levels) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: invalid indirection level %u\n", levels);
+	return NULL;
+}
+
+/*
+ * Walk down the indirect tree with LEVELS levels of indirection to
+ * find the leaf indirect block that maps block OFFSET of that tree.
+ * Allocate missing indirect blocks along the way if DOALLOC is set;
+ * otherwise, if there is a hole, return 0 for the leaf.
+ */
+static
+int
+sfs_bmap_getleaf(struct sfs_vnode *sv, unsigned levels, uint32_t offset,
+		 bool doalloc, daddr_t *leafret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *idbuf = NULL;
+	uint32_t *slot, *idptr;
+	uint32_t span;
+	daddr_t block, idblock = 0;
+	unsigned i;
+	int result;
+
+	slot = sfs_bmap_topslot(sv, levels);
+
+	/* Number of file blocks covered by the block in *slot */
+	span = 1;
+	for (i=0; i<levels; i++) {
+		span *= SFS_DBPERIDB;
+	}
+
+	while (1) {
+		block = *slot;
+		if (block == 0) {
+			if (!doalloc) {
+				if (idbuf != NULL) {
+					buffer_release(idbuf);
+				}
+				*leafret = 0;
+				return 0;
+			}
+
+			/*
+			 * Allocate the missing indirect block. sfs_balloc
+			 * leaves it zeroed in the buffer cache.
+			 */
+			result = sfs_balloc_file(sv, 0, true, &block);
+			if (result) {
+				if (idbuf != NULL) {
+					buffer_release(idbuf);
+				}
+				return result;
+			}
+			*slot = block;
+			if (idbuf != NULL) {
+				sfs_jdirty(sv, idbuf, idblock);
+			}
+			else {
+				sfs_dirtyinode(sv);
+			}
+		}
+		if (idbuf != NULL) {
+			buffer_release(idbuf);
+			idbuf = NULL;
+		}
+
+		span /= SFS_DBPERIDB;
+		if (span == 1) {
+			/* BLOCK holds data block numbers; we're done */
+			break;
+		}
+
+		/* Go down a level */
+		idblock = block;
+		result = buffer_read(sfs->sfs_device, idblock, &idbuf);
+		if (result) {
+			return result;
+		}
+		idptr = buffer_map(idbuf);
+		slot = &idptr[offset / span];
+		offset %= span;
+	}
+
+	*leafret = block;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated; it is zeroed first only if CLEAR is set.
  */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+sfs_bmap_common(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		bool clear, daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
+	struct buf *idbuf;
+	uint32_t *idptr;
+	daddr_t block, prevblock;
 	daddr_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t offset, span, idoff, leafbase;
+	unsigned levels;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_NINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NDINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NTINDIRECT == 1);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,14 +197,18 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			/* Try to put it after the previous block */
+			prevblock = fileblock > 0 ?
+				sv->sv_i.sfi_direct[fileblock-1] : 0;
+			result = sfs_balloc_file(sv, prevblock, clear,
+						 &block);
 			if (result) {
 				return result;
 			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_dirtyinode(sv);
 		}
 
 		/*
@@ -105,88 +224,81 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block. Figure out which indirect tree it's
+	 * in and where in that tree it is.
 	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
-	}
-
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
+	offset = fileblock - SFS_NDIRECT;
+	levels = 1;
+	span = SFS_DBPERIDB;
+	while (offset >= span) {
+		offset -= span;
+		levels++;
+		if (levels > 3) {
+			/* Past the end of the triple indirect block */
+			return EFBIG;
 		}
+		span *= SFS_DBPERIDB;
+	}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+	/* Offset within the leaf, and the first file block the leaf maps */
+	idoff = offset % SFS_DBPERIDB;
+	leafbase = fileblock - idoff;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	if (sv->sv_bmapblock != 0 && sv->sv_bmapbase == leafbase) {
+		/* Same leaf as last time */
+		idblock = sv->sv_bmapblock;
 	}
 	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_bmap_getleaf(sv, levels, offset, doalloc,
+					  &idblock);
 		if (result) {
 			return result;
 		}
+		if (idblock == 0) {
+			/*
+			 * There's no indirect block allocated. We weren't
+			 * asked to allocate anything, so pretend the
+			 * indirect block was filled with all zeros.
+			 */
+			KASSERT(!doalloc);
+			*diskblock = 0;
+			return 0;
+		}
+		sv->sv_bmapbase = leafbase;
+		sv->sv_bmapblock = idblock;
 	}
 
+	/*
+	 * Load the indirect block. (If we just allocated it,
+	 * sfs_balloc left it zeroed in the buffer cache.)
+	 */
+	result = buffer_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptr = buffer_map(idbuf);
+
 	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	block = idptr[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		prevblock = idoff > 0 ? idptr[idoff-1] : 0;
+		result = sfs_balloc_file(sv, prevblock, clear, &block);
 		if (result) {
+			buffer_release(idbuf);
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		idptr[idoff] = block;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+		/* The indirect block is now dirty */
+		sfs_jdirty(sv, idbuf, idblock);
 	}
 
+	buffer_release(idbuf);
+
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: %s: Data block %u (block %u of file %u) "
@@ -198,34 +310,166 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Look up (and with DOALLOC, allocate) a block of a file.
  */
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	return sfs_bmap_common(sv, fileblock, doalloc, true, diskblock);
+}
 
+/*
+ * Same as sfs_bmap with DOALLOC set, for a caller that is about to
+ * overwrite the whole block: a newly allocated block is not zeroed,
+ * and the caller must fill it with buffer_get.
+ */
+int
+sfs_bmap_overwrite(struct sfs_vnode *sv, uint32_t fileblock,
+		   daddr_t *diskblock)
+{
+	return sfs_bmap_common(sv, fileblock, true, false, diskblock);
+}
+
+/*
+ * Truncate the indirect tree whose top block is in *SLOT. LEVELS is
+ * its level of indirection and BASEBLOCK is the first file block it
+ * maps. Free every data block at or past BLOCKLEN, and every indirect
+ * block that ends up empty, including the top one; set *CHANGED if
+ * that happens and *SLOT gets cleared.
+ */
+static
+int
+sfs_itrunc_indirect(struct sfs_vnode *sv, uint32_t *slot, unsigned levels,
+		    uint32_t baseblock, uint32_t blocklen, bool *changed)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *idptr;
+	daddr_t idblock;
+	uint32_t span, entrybase;
+	unsigned i, j;
+	bool hasnonzero, iddirty, childchanged;
+	int result;
+
+	idblock = *slot;
+	if (idblock == 0) {
+		return 0;
+	}
+
+	/* Number of file blocks covered by each entry */
+	span = 1;
+	for (i=1; i<levels; i++) {
+		span *= SFS_DBPERIDB;
+	}
+
+	if (blocklen >= baseblock + span * SFS_DBPERIDB) {
+		/* The whole tree is before the new EOF */
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = buffer_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptr = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		entrybase = baseblock + j * span;
+
+		/* Discard anything that is past the new EOF */
+		if (idptr[j] != 0 && entrybase + span > blocklen) {
+			if (levels == 1) {
+				sfs_bfree(sfs, idptr[j]);
+				idptr[j] = 0;
+				iddirty = true;
+			}
+			else {
+				childchanged = false;
+				result = sfs_itrunc_indirect(sv, &idptr[j],
+							     levels - 1,
+							     entrybase,
+							     blocklen,
+							     &childchanged);
+				if (childchanged) {
+					iddirty = true;
+				}
+				if (result) {
+					if (iddirty) {
+						sfs_jdirty(sv, idbuf, idblock);
+					}
+					buffer_release(idbuf);
+					return result;
+				}
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idptr[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (iddirty) {
+		/* The indirect block is dirty */
+		sfs_jdirty(sv, idbuf, idblock);
+	}
+	buffer_release(idbuf);
+
+	if (!hasnonzero) {
+		/*
+		 * The whole indirect block is empty now; free it.
+		 * (This also drops it from the cache.)
+		 */
+		sfs_bfree(sfs, idblock);
+		*slot = 0;
+		*changed = true;
+	}
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock, span;
+	unsigned levels;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (len <= SFS_INLINESIZE) {
+			/* Keep the bytes past EOF zeroed */
+			if (len < (off_t)sv->sv_i.sfi_size) {
+				bzero(sv->sv_i.sfi_inline + len,
+				      sv->sv_i.sfi_size - len);
+			}
+			sv->sv_i.sfi_size = len;
+			sfs_dirtyinode(sv);
+			return 0;
+		}
+		result = sfs_inline_migrate(sv);
+		if (result) {
+			return result;
+		}
+	}
 
-	vfs_biglock_acquire();
+	/* The cached leaf indirect block may be about to go away */
+	sv->sv_bmapbase = 0;
+	sv->sv_bmapblock = 0;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -236,68 +480,39 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		if (i >= blocklen && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_dirtyinode(sv);
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Now the single, double, and triple indirect trees */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+	span = SFS_DBPERIDB;
+	for (levels=1; levels<=3; levels++) {
+		changed = false;
+		result = sfs_itrunc_indirect(sv,
+					     sfs_bmap_topslot(sv, levels),
+					     levels, baseblock, blocklen,
+					     &changed);
+		if (changed) {
+			sfs_dirtyinode(sv);
+		}
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+		baseblock += span;
+		span *= SFS_DBPERIDB;
 	}
 
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
+	/* An emptied file has no blocks left and can go back inline */
+	if (len == 0 && sv->sv_i.sfi_type == SFS_TYPE_FILE) {
+		sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+	}
+
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_dirtyinode(sv);
 
-	vfs_biglock_release();
 	return 0;
 }
-
@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -95,14 +96,191 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Directory index
+
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Searching a directory by reading every slot makes creating N files
+ * in one directory cost O(N^2) slot reads. So the first time a
+ * directory is searched we build an in-memory index for it: a hash
+ * table mapping name hashes to slot numbers, plus a list of the empty
+ * slots. Only the hash is kept; on a hash match we read that one slot
+ * to compare the name, which is normally a buffer cache hit.
+ *
+ * sfs_dir_link and sfs_dir_unlink keep the index up to date. It is
+ * thrown away when the vnode is reclaimed. If we can't get memory for
+ * the index we just fall back to scanning.
+ */
+
+struct sfs_dirslot {
+	uint32_t ds_hash;		/* hash of name (if in use) */
+	int ds_slot;			/* slot number in directory */
+	struct sfs_dirslot *ds_next;	/* next in bucket or free list */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirslot **di_table;	/* hash buckets */
+	unsigned di_tablesize;		/* # of buckets; power of 2 */
+	unsigned di_nnames;		/* # of names in table */
+	struct sfs_dirslot *di_free;	/* empty slots */
+};
+
+/* Initial number of buckets; doubles when average chain exceeds 2 */
+#define SFS_DIRINDEX_MINSIZE  16
+
+/*
+ * Hash a name (FNV-1a).
+ */
+static
+uint32_t
+sfs_dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Put a slot into the hash table. If the table is getting crowded,
+ * try to make it bigger first; if that fails, live with long chains.
  */
+static
+void
+sfs_dirindex_insert(struct sfs_dirindex *di, struct sfs_dirslot *ds)
+{
+	struct sfs_dirslot **newtable, *cur, *next;
+	unsigned newsize, i, b;
+
+	if (di->di_nnames >= 2 * di->di_tablesize) {
+		newsize = di->di_tablesize * 2;
+		newtable = kmalloc(newsize * sizeof(*newtable));
+		if (newtable != NULL) {
+			for (i=0; i<newsize; i++) {
+				newtable[i] = NULL;
+			}
+			for (i=0; i<di->di_tablesize; i++) {
+				for (cur = di->di_table[i]; cur; cur = next) {
+					next = cur->ds_next;
+					b = cur->ds_hash & (newsize - 1);
+					cur->ds_next = newtable[b];
+					newtable[b] = cur;
+				}
+			}
+			kfree(di->di_table);
+			di->di_table = newtable;
+			di->di_tablesize = newsize;
+		}
+	}
+
+	b = ds->ds_hash & (di->di_tablesize - 1);
+	ds->ds_next = di->di_table[b];
+	di->di_table[b] = ds;
+	di->di_nnames++;
+}
+
+/*
+ * Free a directory's index.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirslot *ds;
+	unsigned i;
+
+	if (di == NULL) {
+		return;
+	}
+	for (i=0; i<di->di_tablesize; i++) {
+		while ((ds = di->di_table[i]) != NULL) {
+			di->di_table[i] = ds->ds_next;
+			kfree(ds);
+		}
+	}
+	while ((ds = di->di_free) != NULL) {
+		di->di_free = ds->ds_next;
+		kfree(ds);
+	}
+	kfree(di->di_table);
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
+
+/*
+ * Build the index for a directory by reading all its slots, unless
+ * it already exists.
+ */
+static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_buildindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
+	struct sfs_direntry tsd;
+	int nentries, i, result;
+	unsigned j;
+
+	if (sv->sv_dirindex != NULL) {
+		return 0;
+	}
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	di->di_tablesize = SFS_DIRINDEX_MINSIZE;
+	di->di_table = kmalloc(di->di_tablesize * sizeof(*di->di_table));
+	if (di->di_table == NULL) {
+		kfree(di);
+		return ENOMEM;
+	}
+	for (j=0; j<di->di_tablesize; j++) {
+		di->di_table[j] = NULL;
+	}
+	di->di_nnames = 0;
+	di->di_free = NULL;
+	sv->sv_dirindex = di;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+		ds = kmalloc(sizeof(*ds));
+		if (ds == NULL) {
+			sfs_dir_dropindex(sv);
+			return ENOMEM;
+		}
+		ds->ds_slot = i;
+		if (tsd.sfd_ino == SFS_NOINO) {
+			ds->ds_hash = 0;
+			ds->ds_next = di->di_free;
+			di->di_free = ds;
+		}
+		else {
+			/* Ensure null termination, just in case */
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			ds->ds_hash = sfs_dir_hash(tsd.sfd_name);
+			sfs_dirindex_insert(di, ds);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Search a directory by reading every slot. Used if there's no
+ * memory for an index.
+ */
+static
+int
+sfs_dir_scan(struct sfs_vnode *sv, const char *name,
+	     uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
@@ -146,6 +324,62 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
+	struct sfs_direntry tsd;
+	uint32_t hash;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_dir_buildindex(sv);
+	if (result == ENOMEM) {
+		return sfs_dir_scan(sv, name, ino, slot, emptyslot);
+	}
+	if (result) {
+		return result;
+	}
+	di = sv->sv_dirindex;
+
+	if (emptyslot != NULL && di->di_free != NULL) {
+		*emptyslot = di->di_free->ds_slot;
+	}
+
+	hash = sfs_dir_hash(name);
+	for (ds = di->di_table[hash & (di->di_tablesize - 1)];
+	     ds != NULL; ds = ds->ds_next) {
+		if (ds->ds_hash != hash) {
+			continue;
+		}
+		result = sfs_readdir(sv, ds->ds_slot, &tsd);
+		if (result) {
+			return result;
+		}
+		KASSERT(tsd.sfd_ino != SFS_NOINO);
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (!strcmp(tsd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = ds->ds_slot;
+			}
+			if (ino != NULL) {
+				*ino = tsd.sfd_ino;
+			}
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -156,6 +390,10 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -170,6 +408,26 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
+	/*
+	 * Get the index entry for the slot we're going to use: the
+	 * head of the free list if findname handed that back, or a
+	 * new one if we're adding the entry at the end.
+	 */
+	di = sv->sv_dirindex;
+	ds = NULL;
+	if (di != NULL) {
+		if (emptyslot >= 0) {
+			KASSERT(di->di_free != NULL);
+			KASSERT(di->di_free->ds_slot == emptyslot);
+		}
+		else {
+			ds = kmalloc(sizeof(*ds));
+			if (ds == NULL) {
+				return ENOMEM;
+			}
+		}
+	}
+
 	/* If we didn't get an empty slot, add the entry at the end. */
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
@@ -186,7 +444,25 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		if (ds != NULL) {
+			kfree(ds);
+		}
+		return result;
+	}
+
+	/* Update the index. */
+	if (di != NULL) {
+		if (ds == NULL) {
+			ds = di->di_free;
+			di->di_free = ds->ds_next;
+		}
+		ds->ds_slot = emptyslot;
+		ds->ds_hash = sfs_dir_hash(name);
+		sfs_dirindex_insert(di, ds);
+	}
+	return 0;
 }
 
 /*
@@ -196,13 +472,48 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirslot **dsp, *ds;
+	uint32_t hash = 0;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* If we have an index, we need the name to find the slot in it */
+	if (di != NULL) {
+		result = sfs_readdir(sv, slot, &sd);
+		if (result) {
+			return result;
+		}
+		KASSERT(sd.sfd_ino != SFS_NOINO);
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		hash = sfs_dir_hash(sd.sfd_name);
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Move the slot from the hash table to the free list */
+	if (di != NULL) {
+		dsp = &di->di_table[hash & (di->di_tablesize - 1)];
+		while ((ds = *dsp) != NULL && ds->ds_slot != slot) {
+			dsp = &ds->ds_next;
+		}
+		KASSERT(ds != NULL);
+		*dsp = ds->ds_next;
+		di->di_nnames--;
+		ds->ds_hash = 0;
+		ds->ds_next = di->di_free;
+		di->di_free = ds;
+	}
+	return 0;
 }
 
 /*
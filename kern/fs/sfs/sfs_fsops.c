@@ -38,13 +38,18 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
+/* Initial size of the loaded vnode table (see sfs_inode.c) */
+#define SFS_VNHASH_MINSIZE         32
+
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
 #define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
@@ -52,8 +57,9 @@
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads do the whole bitmap. Writes only do the blocks of it marked
+ * in sfs_freemapdirtymap (see sfs_balloc.c), which usually is a small
+ * fraction of it, and clear those marks.
  *
  * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
  * sectors of bits, one bit for each sector on the filesystem. The
@@ -92,9 +98,16 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
 					       SFS_BLOCKSIZE);
 		}
-		else {
+		else if (bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
 			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
 						SFS_BLOCKSIZE);
+			if (result == 0) {
+				bitmap_unmark(sfs->sfs_freemapdirtymap, j);
+				sfs->sfs_freemapwrites++;
+			}
+		}
+		else {
+			result = 0;
 		}
 
 		/* If we failed, stop. */
@@ -102,64 +115,153 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 			return result;
 		}
 	}
+	if (rw == UIO_WRITE) {
+		sfs->sfs_freemapsyncs++;
+	}
 	return 0;
 }
 
 /*
- * Sync routine for the vnode table.
+ * Sync routine for the vnode table. Only vnodes on the dirty list are
+ * looked at. If AGED, only sync inodes that were already dirty at the
+ * previous call with AGED set (that is, the previous syncer pass) and
+ * just note the rest.
  */
 static
 int
-sfs_sync_vnodes(struct sfs_fs *sfs)
+sfs_sync_vnodes(struct sfs_fs *sfs, bool aged)
 {
+	struct sfs_vnode **svs, *sv;
 	unsigned i, num;
+	int result, finalresult;
+
+	/*
+	 * We can't lock the vnodes while holding sfs_vnlock, so take
+	 * a reference to each dirty vnode under it and work from that
+	 * copy of the list afterwards. Holding sfs_vnlock also keeps
+	 * vnodes on the list from being reclaimed in the meantime.
+	 * Skip busy ones: one being reclaimed syncs itself, and one
+	 * being loaded has nothing to sync yet.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(sfs->sfs_dirtylock);
+	num = sfs->sfs_ndirty;
+	if (num == 0) {
+		lock_release(sfs->sfs_dirtylock);
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	svs = kmalloc(num * sizeof(*svs));
+	if (svs == NULL) {
+		lock_release(sfs->sfs_dirtylock);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	i = 0;
+	for (sv = sfs->sfs_dirtyvnodes; sv != NULL; sv = sv->sv_dirtynext) {
+		if (sv->sv_busy) {
+			continue;
+		}
+		VOP_INCREF(&sv->sv_absvn);
+		svs[i++] = sv;
+	}
+	KASSERT(i <= num);
+	num = i;
+	lock_release(sfs->sfs_dirtylock);
+	lock_release(sfs->sfs_vnlock);
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Sync each one. This only moves the inodes into the buffer
+	 * cache; the caller flushes the cache afterwards, so don't
+	 * use VOP_FSYNC, which would flush it once per vnode.
+	 */
+	finalresult = 0;
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sv = svs[i];
+		sfs_jbegin(sfs);
+		lock_acquire(sv->sv_lock);
+		if (aged && !sv->sv_dirtyseen) {
+			sv->sv_dirtyseen = sv->sv_dirty;
+			result = 0;
+		}
+		else {
+			result = sfs_sync_inode(sv);
+		}
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		if (result) {
+			finalresult = result;
+		}
+		VOP_DECREF(&sv->sv_absvn);
 	}
-	return 0;
+	kfree(svs);
+	return finalresult;
 }
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap. AGED is as for sfs_sync_vnodes.
+ *
+ * With a journal, the freemap goes into the log with everything else
+ * when a transaction commits, and home at checkpoints; see
+ * sfs_journal.c.
  */
 static
 int
-sfs_sync_freemap(struct sfs_fs *sfs)
+sfs_sync_freemap(struct sfs_fs *sfs, bool aged)
 {
+	unsigned writes;
 	int result;
 
-	if (sfs->sfs_freemapdirty) {
+	if (sfs->sfs_journal != NULL) {
+		return 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (aged && !sfs->sfs_freemapseen) {
+		sfs->sfs_freemapseen = sfs->sfs_freemapdirty;
+	}
+	else if (sfs->sfs_freemapdirty) {
+		writes = sfs->sfs_freemapwrites;
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
+		DEBUG(DB_SFS, "sfs: %s: wrote %u of %u freemap blocks\n",
+		      sfs->sfs_sb.sb_volname, sfs->sfs_freemapwrites - writes,
+		      SFS_FS_FREEMAPBLOCKS(sfs));
 		sfs->sfs_freemapdirty = false;
+		sfs->sfs_freemapseen = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
 
 /*
- * Sync routine for the superblock.
+ * Sync routine for the superblock. AGED is as for sfs_sync_vnodes.
  */
 static
 int
-sfs_sync_superblock(struct sfs_fs *sfs)
+sfs_sync_superblock(struct sfs_fs *sfs, bool aged)
 {
 	int result;
 
-	if (sfs->sfs_superdirty) {
+	lock_acquire(sfs->sfs_freemaplock);
+	if (aged && !sfs->sfs_superseen) {
+		sfs->sfs_superseen = sfs->sfs_superdirty;
+	}
+	else if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
+		sfs->sfs_superseen = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -174,8 +276,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -209,30 +309,72 @@ sfs_sync(struct fs *fs)
 	sfs = fs->fs_data;
 
 	/* If any vnodes need to be written, write them. */
-	result = sfs_sync_vnodes(sfs);
+	result = sfs_sync_vnodes(sfs, false);
+	if (result) {
+		return result;
+	}
+
+	/* Commit the journal, so nothing is left pinned. */
+	result = sfs_jcommit(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* Write back dirty blocks (including the inodes just synced). */
+	result = buffer_sync(sfs->sfs_device);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
-	result = sfs_sync_freemap(sfs);
+	result = sfs_sync_freemap(sfs, false);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
-	result = sfs_sync_superblock(sfs);
+	result = sfs_sync_superblock(sfs, false);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Periodic write-back, called by the syncer thread. Inodes that have
+ * been dirty since the last pass are copied into the buffer cache,
+ * which writes them back when they've been dirty long enough. The
+ * freemap and superblock don't go through the buffer cache, so they
+ * are written directly if they've been dirty since the last pass.
+ * Other dirty state is left for the next pass.
+ *
+ * If there's a journal, this is also where the running transaction
+ * gets committed if nobody has asked for it sooner, so everything
+ * done since the last pass goes to the log together.
+ */
+static
+int
+sfs_writeback(struct fs *fs)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	int result;
+
+	result = sfs_sync_vnodes(sfs, true);
+	if (result) {
+		return result;
+	}
+	result = sfs_jcommit(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_sync_freemap(sfs, true);
+	if (result) {
+		return result;
+	}
+	return sfs_sync_superblock(sfs, true);
+}
+
 /*
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
@@ -243,13 +385,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* The volume name never changes after mount; no lock needed */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -259,10 +397,20 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	sfs_jclose(sfs);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	if (sfs->sfs_freemapdirtymap != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirtymap);
+	}
+	KASSERT(sfs->sfs_nvnodes == 0);
+	KASSERT(sfs->sfs_ndirty == 0);
+	kfree(sfs->sfs_vnhash);
+	lock_destroy(sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_freemaplock);
+	cv_destroy(sfs->sfs_vncv);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,19 +425,58 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (VFS holds
+	 * the big lock for the device table across unmount, so nobody
+	 * can start using the filesystem after we check.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
+
+	/* Report how well the vnode table did (probes per lookup) */
+	if (sfs->sfs_vnlookups > 0) {
+		kprintf("sfs: %s: %u vnode lookups, average probe length "
+			"%u.%02u\n", sfs->sfs_sb.sb_volname,
+			sfs->sfs_vnlookups,
+			sfs->sfs_vnprobes / sfs->sfs_vnlookups,
+			(sfs->sfs_vnprobes % sfs->sfs_vnlookups) * 100 /
+			sfs->sfs_vnlookups);
+	}
+
+	/* Report how much of the freemap each sync had to write */
+	if (sfs->sfs_freemapsyncs > 0) {
+		kprintf("sfs: %s: %u freemap syncs wrote %u blocks, "
+			"average %u.%02u of %u\n", sfs->sfs_sb.sb_volname,
+			sfs->sfs_freemapsyncs, sfs->sfs_freemapwrites,
+			sfs->sfs_freemapwrites / sfs->sfs_freemapsyncs,
+			(sfs->sfs_freemapwrites % sfs->sfs_freemapsyncs) *
+			100 / sfs->sfs_freemapsyncs,
+			SFS_FS_FREEMAPBLOCKS(sfs));
+	}
+
+	/* Write everything home and empty the journal. */
+	result = sfs_jcheckpoint(sfs);
+	if (result) {
+		return result;
+	}
+	sfs_jprintstats(sfs);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Flush anything left and drop our blocks from the buffer cache. */
+	result = buffer_invalidate(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,7 +484,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -309,6 +495,7 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_getvolname = sfs_getvolname,
 	.fsop_getroot = sfs_getroot,
 	.fsop_unmount = sfs_unmount,
+	.fsop_writeback = sfs_writeback,
 };
 
 /*
@@ -321,6 +508,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -346,22 +534,69 @@ sfs_fs_create(void)
 	/* superblock */
 	/* (ignore sfs_super, we'll read in over it shortly) */
 	sfs->sfs_superdirty = false;
+	sfs->sfs_superseen = false;
 
 	/* device we mount on */
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vncv = cv_create("sfs vnodes");
+	if (sfs->sfs_vncv == NULL) {
+		goto cleanup_vnlock;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_MINSIZE;
+	sfs->sfs_vnhash = kmalloc(sfs->sfs_vnhashsize *
+				  sizeof(*sfs->sfs_vnhash));
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vncv;
+	}
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_vnlookups = 0;
+	sfs->sfs_vnprobes = 0;
+
+	/* dirty vnode list */
+	sfs->sfs_dirtylock = lock_create("sfs dirty vnodes");
+	if (sfs->sfs_dirtylock == NULL) {
+		goto cleanup_vnodes;
+	}
+	sfs->sfs_dirtyvnodes = NULL;
+	sfs->sfs_ndirty = 0;
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_dirtylock;
+	}
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapseen = false;
+	sfs->sfs_freemapdirtymap = NULL;
+	sfs->sfs_freemapsyncs = 0;
+	sfs->sfs_freemapwrites = 0;
+
+	/* journal (see sfs_jopen) */
+	sfs->sfs_journal = NULL;
+
+	/* testing (see sfs_simcrash) */
+	sfs->sfs_crashed = false;
 
 	return sfs;
 
+cleanup_dirtylock:
+	lock_destroy(sfs->sfs_dirtylock);
+cleanup_vnodes:
+	kfree(sfs->sfs_vnhash);
+cleanup_vncv:
+	cv_destroy(sfs->sfs_vncv);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,8 +623,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -402,7 +635,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +642,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -423,7 +654,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,7 +666,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -448,26 +677,37 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Set up the journal and replay it, before loading the freemap */
+	result = sfs_jopen(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
+		return ENOMEM;
+	}
+	sfs->sfs_freemapdirtymap = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemapdirtymap == NULL) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -479,3 +719,21 @@ sfs_mount(const char *device)
 {
 	return vfs_mount(device, NULL, sfs_domount);
 }
+
+/*
+ * Simulate a crash, for testing recovery. Writes through the buffer
+ * cache are dropped by buffer_simcrash; sfs_rwblock drops the rest.
+ */
+int
+sfs_simcrash(struct fs *fs)
+{
+	struct sfs_fs *sfs;
+
+	if (fs->fs_ops != &sfs_fsops) {
+		return EINVAL;
+	}
+	sfs = fs->fs_data;
+	sfs->sfs_crashed = true;
+	buffer_simcrash(sfs->sfs_device);
+	return 0;
+}
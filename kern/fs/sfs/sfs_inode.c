@@ -35,50 +35,244 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Mark the in-memory inode dirty, and put the vnode on the dirty
+ * vnode list if it isn't there already. Call with sv_lock held, or
+ * before the vnode is visible to anyone else.
+ */
+void
+sfs_dirtyinode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sv->sv_dirty) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_dirtylock);
+	sv->sv_dirtyprev = NULL;
+	sv->sv_dirtynext = sfs->sfs_dirtyvnodes;
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv;
+	}
+	sfs->sfs_dirtyvnodes = sv;
+	sfs->sfs_ndirty++;
+	lock_release(sfs->sfs_dirtylock);
+
+	sv->sv_dirty = true;
+}
+
+/*
+ * Write an on-disk inode structure back out to disk. (Or rather, to
+ * the buffer cache; it goes to disk from there, along with the rest
+ * of the file's dirty blocks if fsync'd.)
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		/* The inode is the whole block, so don't read it first */
+		result = buffer_get(sfs->sfs_device, sv->sv_ino, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(buffer_map(buf), &sv->sv_i, sizeof(sv->sv_i));
+		sfs_jdirty(sv, buf, sv->sv_ino);
+		buffer_release(buf);
+
+		/* Take it off the dirty vnode list */
+		lock_acquire(sfs->sfs_dirtylock);
+		if (sv->sv_dirtyprev != NULL) {
+			sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+		}
+		else {
+			sfs->sfs_dirtyvnodes = sv->sv_dirtynext;
+		}
+		if (sv->sv_dirtynext != NULL) {
+			sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+		}
+		sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
+		KASSERT(sfs->sfs_ndirty > 0);
+		sfs->sfs_ndirty--;
+		lock_release(sfs->sfs_dirtylock);
+
 		sv->sv_dirty = false;
+		sv->sv_dirtyseen = false;
 	}
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Table of loaded vnodes
+
+/*
+ * The loaded vnodes are kept in a hash table keyed by inode number,
+ * chained through sv_hashnext. The table doubles in size when the
+ * average chain gets longer than 2. All of this is protected by
+ * sfs_vnlock.
+ *
+ * sfs_vnlock isn't held while reading an inode in or while erasing
+ * and writing one back. Instead the vnode stays in the table with
+ * sv_busy set for the duration, which makes sfs_loadvnode wait (on
+ * sfs_vncv) rather than hand out a vnode that's half loaded, or load
+ * a second, stale copy of one that's being reclaimed.
+ *
+ * sfs_vnlookups and sfs_vnprobes count lookups and the vnodes they
+ * had to look at; their ratio is the average probe length, which
+ * sfs_unmount reports.
+ */
+
+static
+struct sfs_vnode **
+sfs_vnhash_bucket(struct sfs_fs *sfs, uint32_t ino)
+{
+	return &sfs->sfs_vnhash[ino & (sfs->sfs_vnhashsize - 1)];
+}
+
+/*
+ * Find the loaded vnode for inode INO, if any.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sfs->sfs_vnlookups++;
+	for (sv = *sfs_vnhash_bucket(sfs, ino); sv; sv = sv->sv_hashnext) {
+		sfs->sfs_vnprobes++;
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a vnode to the table, growing the table first if it's getting
+ * crowded. Failing to grow it isn't fatal; the chains just get longer.
+ */
+static
+void
+sfs_vnhash_insert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **oldhash, **bucket, *cur, *next;
+	unsigned oldsize, i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_nvnodes >= 2 * sfs->sfs_vnhashsize) {
+		oldhash = sfs->sfs_vnhash;
+		oldsize = sfs->sfs_vnhashsize;
+		sfs->sfs_vnhash = kmalloc(2 * oldsize * sizeof(*oldhash));
+		if (sfs->sfs_vnhash == NULL) {
+			sfs->sfs_vnhash = oldhash;
+		}
+		else {
+			sfs->sfs_vnhashsize = 2 * oldsize;
+			for (i=0; i<sfs->sfs_vnhashsize; i++) {
+				sfs->sfs_vnhash[i] = NULL;
+			}
+			for (i=0; i<oldsize; i++) {
+				for (cur = oldhash[i]; cur; cur = next) {
+					next = cur->sv_hashnext;
+					bucket = sfs_vnhash_bucket(sfs,
+								   cur->sv_ino);
+					cur->sv_hashnext = *bucket;
+					*bucket = cur;
+				}
+			}
+			kfree(oldhash);
+		}
+	}
+
+	bucket = sfs_vnhash_bucket(sfs, sv->sv_ino);
+	sv->sv_hashnext = *bucket;
+	*bucket = sv;
+	sfs->sfs_nvnodes++;
+}
+
+/*
+ * Done with a busy vnode; wake up anyone waiting for it.
+ */
+static
+void
+sfs_vnunbusy(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_busy);
+	sv->sv_busy = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+}
+
+/*
+ * Take a vnode out of the table.
+ */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	svp = sfs_vnhash_bucket(sfs, sv->sv_ino);
+	while (*svp != NULL && *svp != sv) {
+		svp = &(*svp)->sv_hashnext;
+	}
+	if (*svp == NULL) {
+		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
+////////////////////////////////////////////////////////////
+// Vnode lifecycle
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
  * This function should try to avoid returning errors other than EBUSY.
+ *
+ * The vnode is marked busy while we write it back or erase it, so
+ * that nobody can load the inode again (and get a stale copy) until
+ * we're done, but sfs_vnlock itself is dropped for the I/O.
  */
 int
 sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. sfs_loadvnode only hands out
+	 * references while holding sfs_vnlock, so once we've checked
+	 * here nobody else can get one.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,54 +282,63 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
+	KASSERT(!sv->sv_busy);
+	sv->sv_busy = true;
+	lock_release(sfs->sfs_vnlock);
+
+	/* Give back any blocks reserved for future writes */
+	sfs_bunreserve(sv);
+
 	/* If there are no on-disk references to the file either, erase it. */
+	result = 0;
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
 	}
 
 	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
 	}
 
 	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
+	if (result == 0 && sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnunbusy(sfs, sv);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		return result;
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vnhash_remove(sfs, sv);
+
+	/* Discard the directory index, if any */
+	sfs_dir_dropindex(sv);
+
+	/* Our dirty blocks get written back without us */
+	KASSERT(!sv->sv_dirty);
+	buffer_disown(&sv->sv_bufs);
 
 	vnode_cleanup(&sv->sv_absvn);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	/* Release the storage for the vnode structure itself. */
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -145,47 +348,54 @@ sfs_reclaim(struct vnode *v)
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * A vnode we load goes into the table busy before we read the inode,
+ * so sfs_vnlock can be dropped for the read; see above.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	struct buf *buf;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	while ((sv = sfs_vnhash_find(sfs, ino)) != NULL && sv->sv_busy) {
+		/* Being loaded or reclaimed; wait and look again */
+		cv_wait(sfs->sfs_vncv, sfs->sfs_vnlock);
+	}
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: %s: Found inode %u in unallocated block\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -195,15 +405,42 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      "unallocated block\n", sfs->sfs_sb.sb_volname, ino);
 	}
 
+	/* Put it in the table busy, and read it in without the lock */
+	sv->sv_ino = ino;
+	sv->sv_busy = true;
+	sfs_vnhash_insert(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+
 	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
+	result = buffer_read(sfs->sfs_device, ino, &buf);
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
+	memcpy(&sv->sv_i, buffer_map(buf), sizeof(sv->sv_i));
+	buffer_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
+	sv->sv_dirtyseen = false;
+	sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
+	bufowner_init(&sv->sv_bufs);
+
+	/* No reads yet; a read from the start counts as sequential */
+	sv->sv_rapos = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_radone = 0;
+
+	/* Nothing in the indirect block cache */
+	sv->sv_bmapbase = 0;
+	sv->sv_bmapblock = 0;
+
+	/* No allocation history and nothing reserved */
+	sv->sv_lastalloc = 0;
+	sv->sv_resvnext = 0;
+	sv->sv_resvend = 0;
+
+	/* No directory index until someone searches */
+	sv->sv_dirindex = NULL;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -213,7 +450,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
+
+		/* New files start out with their data inline */
+		if (forcetype == SFS_TYPE_FILE) {
+			sv->sv_i.sfi_flags = SFS_IFLAG_INLINE;
+		}
 	}
 
 	/*
@@ -235,24 +476,31 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
 
-	/* Set the other fields in our vnode structure */
-	sv->sv_ino = ino;
-
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
+	/* A new object's inode needs writing (see FORCETYPE above) */
+	if (forcetype != SFS_TYPE_INVAL) {
+		sfs_dirtyinode(sv);
 	}
 
+	/* Ready; let others at it */
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnunbusy(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
+
+ fail:
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnhash_remove(sfs, sv);
+	sfs_vnunbusy(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+	return result;
 }
 
 /*
@@ -296,25 +544,20 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
@@ -36,8 +36,10 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -50,6 +52,12 @@
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
  * except sfs_device.
+ *
+ * These bypass the buffer cache; they are only used for the
+ * superblock and the freemap, which are kept in memory separately
+ * and never go through the cache, and for the journal. Everything
+ * else should use buffer_read/buffer_get. LEN may cover several
+ * consecutive blocks.
  */
 
 /*
@@ -62,12 +70,16 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
 
+	if (uio->uio_rw == UIO_WRITE && sfs->sfs_crashed) {
+		/* See sfs_simcrash */
+		uio->uio_resid = 0;
+		return 0;
+	}
+
  retry:
 	result = DEVOP_IO(sfs->sfs_device, uio);
 	if (result == EINVAL) {
@@ -102,7 +114,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block (or blocks).
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -110,14 +122,15 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block (or blocks).
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -125,9 +138,10 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
@@ -137,9 +151,9 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * need to have the original block in the buffer cache first, even if
+ * we're writing, so we don't clobber the portion of the block we're
+ * not intending to write over.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,16 +164,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *ioptr;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +176,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,40 +188,36 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(iobuf);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+	result = uiomove(ioptr+skipstart, len, uio);
+
+	/*
+	 * If it was a write, the block is now dirty. It gets written
+	 * back when the buffer is evicted or the filesystem is synced.
+	 */
+	if (result == 0 && uio->uio_rw == UIO_WRITE) {
+		buffer_mark_dirty_owner(iobuf, &sv->sv_bufs);
 	}
 
-	return 0;
+	buffer_release(iobuf);
+	return result;
 }
 
 /*
@@ -228,20 +228,26 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Look up the disk block number. If we're writing, we're
+	 * going to overwrite the whole block, so a newly allocated
+	 * one doesn't need to be cleared first.
+	 */
+	if (doalloc) {
+		result = sfs_bmap_overwrite(sv, fileblock, &diskblock);
+	}
+	else {
+		result = sfs_bmap(sv, fileblock, false, &diskblock);
+	}
 	if (result) {
 		return result;
 	}
@@ -258,33 +264,140 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Get the block from the buffer cache. If we're writing,
+	 * we're about to overwrite all of it, so there's no need to
+	 * read the old contents in.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
+	}
+	else {
+		result = buffer_get(sfs->sfs_device, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
 
-	result = sfs_rwblock(sfs, uio);
+	result = uiomove(buffer_map(iobuf), SFS_BLOCKSIZE, uio);
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
+	 * Mark the buffer dirty even if the copy failed partway; it
+	 * may have been partly overwritten and must not be silently
+	 * reverted.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	if (uio->uio_rw == UIO_WRITE) {
+		buffer_mark_dirty_owner(iobuf, &sv->sv_bufs);
+	}
 
+	buffer_release(iobuf);
 	return result;
 }
 
+/*
+ * Read-ahead.
+ *
+ * Each vnode remembers where the last read ended. A read that starts
+ * exactly there is taken to be part of a sequential stream; each one
+ * grows the read-ahead window (doubling, up to SFS_RA_MAXWINDOW
+ * blocks), and any other read collapses it back to nothing. After a
+ * sequential read we ask the buffer cache to fetch the next window's
+ * worth of blocks in the background, skipping the ones we already
+ * asked for last time.
+ */
+#define SFS_RA_MINWINDOW	2
+#define SFS_RA_MAXWINDOW	16
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t startpos, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock, firstblock, lastblock, eofblock;
+	daddr_t diskblock;
+
+	if (startpos != sv->sv_rapos) {
+		/* Random access */
+		sv->sv_rawindow = 0;
+		sv->sv_radone = 0;
+		sv->sv_rapos = endpos;
+		return;
+	}
+	sv->sv_rapos = endpos;
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MINWINDOW;
+	}
+	else if (sv->sv_rawindow < SFS_RA_MAXWINDOW) {
+		sv->sv_rawindow *= 2;
+	}
+
+	/* Blocks after the one the read ended in, not past EOF */
+	firstblock = DIVROUNDUP(endpos, SFS_BLOCKSIZE);
+	lastblock = firstblock + sv->sv_rawindow;
+	eofblock = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (lastblock > eofblock) {
+		lastblock = eofblock;
+	}
+	if (firstblock < sv->sv_radone) {
+		firstblock = sv->sv_radone;
+	}
+
+	for (fileblock = firstblock; fileblock < lastblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(sfs->sfs_device, diskblock);
+		}
+	}
+	if (lastblock > sv->sv_radone) {
+		sv->sv_radone = lastblock;
+	}
+}
+
+/*
+ * Move the contents of an inline file (see kern/sfs.h) out to a data
+ * block, so it can grow past SFS_INLINESIZE. Afterwards it is an
+ * ordinary file. An empty file doesn't need a block at all.
+ */
+int
+sfs_inline_migrate(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *ioptr;
+	daddr_t diskblock;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_INLINE);
+
+	if (sv->sv_i.sfi_size > 0) {
+		result = sfs_bmap_overwrite(sv, 0, &diskblock);
+		if (result) {
+			return result;
+		}
+		result = buffer_get(sfs->sfs_device, diskblock, &iobuf);
+		if (result) {
+			/* Still inline; give the block back */
+			sfs_bfree(sfs, diskblock);
+			sv->sv_i.sfi_direct[0] = 0;
+			return result;
+		}
+		ioptr = buffer_map(iobuf);
+		memcpy(ioptr, sv->sv_i.sfi_inline, SFS_INLINESIZE);
+		bzero(ioptr + SFS_INLINESIZE, SFS_BLOCKSIZE - SFS_INLINESIZE);
+		buffer_mark_dirty_owner(iobuf, &sv->sv_bufs);
+		buffer_release(iobuf);
+	}
+
+	bzero(sv->sv_i.sfi_inline, SFS_INLINESIZE);
+	sv->sv_i.sfi_flags &= ~SFS_IFLAG_INLINE;
+	sfs_dirtyinode(sv);
+	return 0;
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -295,8 +408,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origoffset;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	origresid = uio->uio_resid;
+	origoffset = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -319,6 +436,30 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/*
+	 * Inline files are read and written straight out of the
+	 * in-memory inode, unless the write takes the file past
+	 * SFS_INLINESIZE, in which case it moves to a data block
+	 * first. The bytes past EOF are kept zero, so a write past
+	 * EOF leaves zeros in the gap as it should.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE) {
+			result = uiomove(sv->sv_i.sfi_inline + uio->uio_offset,
+					 uio->uio_resid, uio);
+			if (uio->uio_rw == UIO_WRITE &&
+			    uio->uio_resid != origresid) {
+				sfs_dirtyinode(sv);
+			}
+			goto out;
+		}
+		result = sfs_inline_migrate(sv);
+		if (result) {
+			return result;
+		}
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -378,7 +519,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirtyinode(sv);
+	}
+
+	/* If reading, start fetching what we'll probably want next */
+	if (result == 0 && uio->uio_rw == UIO_READ) {
+		sfs_readahead(sv, origoffset, uio->uio_offset);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -407,6 +553,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *ioptr;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,17 +562,10 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* Only regular files are ever inline */
+	KASSERT((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0);
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -446,35 +587,32 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(iobuf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(ioptr + blockoffset, data, len);
+		sfs_jdirty(sv, iobuf, diskblock);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)sv->sv_i.sfi_size) {
 			sv->sv_i.sfi_size = endpos;
-			sv->sv_dirty = true;
+			sfs_dirtyinode(sv);
 		}
 	}
 
+	buffer_release(iobuf);
+
 	/* Done */
 	return 0;
 }
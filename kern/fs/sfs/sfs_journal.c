@@ -0,0 +1,922 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * Changes to metadata blocks (inodes, indirect blocks, directory
+ * blocks, and the freemap) are grouped into transactions, which are
+ * written sequentially to the log region described in kern/sfs.h
+ * before any of the changed blocks can go to their home locations.
+ * Many operations share one transaction: it is committed when
+ * someone needs it on disk (sync, fsync), on each pass of the syncer
+ * thread, or when it gets big. After that the blocks are written home
+ * whenever the buffer cache gets around to it. Log space is reclaimed
+ * lazily: only when the log is nearly full is everything written home
+ * (a checkpoint) and the log started over.
+ *
+ * An operation that changes metadata brackets its changes with
+ * sfs_jbegin and sfs_jend, which makes it part of the running
+ * transaction. Metadata buffers it changes are marked dirty with
+ * sfs_jdirty, which pins them in the buffer cache until the
+ * transaction commits. To commit, we wait until no operation is in
+ * progress, copy the pinned blocks and the changed freemap blocks
+ * into the log, write the commit block, and unpin. New operations
+ * wait for the commit to finish; there is only ever one transaction
+ * open. Because sfs_jbegin can wait for a commit, and the commit
+ * waits for operations in progress, an operation must not call
+ * sfs_jbegin again (for instance via VOP_DECREF and sfs_reclaim)
+ * until it has called sfs_jend. It must also call sfs_jbegin before
+ * taking any sv_lock.
+ *
+ * At mount time any committed transactions still in the log are
+ * replayed, which brings the volume back to a consistent state after
+ * a crash without needing sfsck.
+ *
+ * Limits: every block an operation changes must stay pinned until
+ * its transaction commits, so the pin set can't be allowed to fill
+ * up. sfs_jbegin reserves room for SFS_JOPPINS pins for each
+ * operation, and if the running transaction can't take another
+ * operation it is committed first. No single operation changes more
+ * blocks than that; sfs_write splits big writes into pieces of at
+ * most SFS_JWRITEMAX bytes to make sure of it. The pin array has
+ * slack past SFS_JMAXPINS for when a commit fails and operations are
+ * let in anyway; running off the end of that is a panic, never an
+ * unpinned block.
+ *
+ * A transaction also holds at most SFS_JMAXREVOKE freed blocks; one
+ * freed past that forces a checkpoint right after the commit.
+ * Changed freemap blocks that don't fit in the descriptor are
+ * written home directly after the commit. Neither happens with
+ * ordinary operations; they are counted as overflows.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Pinned blocks sfs_jbegin lets a transaction grow to, and freed blocks */
+#define SFS_JMAXPINS    64
+#define SFS_JMAXREVOKE  32
+
+/* Hard limit on pins: what's left of a descriptor after the revokes */
+#define SFS_JPINSLOTS   (SFS_JDESCMAX - SFS_JMAXREVOKE)
+
+/* Transaction size at which sfs_jbegin commits first */
+#define SFS_JCOMMITPINS (SFS_JMAXPINS / 2)
+
+/* A descriptor, the most blocks one can list, and a commit block */
+#define SFS_JMAXTXN     (SFS_JDESCMAX + 2)
+
+/*
+ * In-memory journal state.
+ */
+struct sfs_journal {
+	struct lock *j_lock;            /* protects everything here */
+	struct cv *j_cv;                /* for j_nupdates and j_committing */
+	daddr_t j_start;                /* header block */
+	uint32_t j_logsize;             /* # of log blocks after header */
+
+	/* Running transaction */
+	uint32_t j_seq;                 /* its sequence number */
+	uint32_t j_head;                /* where in the log it will go */
+	unsigned j_nupdates;            /* operations in progress */
+	unsigned j_nops;                /* operations that joined it */
+	bool j_committing;              /* commit in progress */
+	daddr_t j_pins[SFS_JPINSLOTS];  /* blocks pinned for it */
+	unsigned j_npins;
+	daddr_t j_revoked[SFS_JMAXREVOKE]; /* logged blocks it freed */
+	unsigned j_nrevoked;
+	bool j_forcecheckpoint;         /* checkpoint after commit */
+
+	/* Since the last checkpoint */
+	struct bitmap *j_logged;        /* blocks copied into the log */
+	struct bitmap *j_fmhome;        /* freemap blocks not yet home */
+
+	/* Staging area: descriptor, copies, commit block */
+	char *j_buf;
+
+	/* Statistics */
+	unsigned j_commits;             /* transactions committed */
+	unsigned j_ops;                 /* operations in them */
+	unsigned j_logblocks;           /* block copies written to log */
+	unsigned j_fmblocks;            /* ...of which freemap blocks */
+	unsigned j_revokes;             /* freed blocks recorded */
+	unsigned j_checkpoints;
+	unsigned j_overflows;
+};
+
+/* Block number of log block POS */
+#define SFS_JLOGBLOCK(j, pos) ((j)->j_start + 1 + (pos))
+
+/* Pointer to staging block N */
+#define SFS_JBUF(j, n) ((j)->j_buf + (n) * SFS_BLOCKSIZE)
+
+////////////////////////////////////////////////////////////
+// Transactions
+
+/*
+ * Check if the running transaction has room for the pins of one more
+ * operation, on top of those of the operations already in it.
+ */
+static
+bool
+sfs_jroom(struct sfs_journal *j)
+{
+	KASSERT(lock_do_i_hold(j->j_lock));
+	return j->j_npins + (j->j_nupdates + 1) * SFS_JOPPINS
+		<= SFS_JMAXPINS;
+}
+
+/*
+ * Join the running transaction, committing it first if it's getting
+ * big or has no room for us.
+ */
+void
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return;
+	}
+
+	if (j->j_npins >= SFS_JCOMMITPINS ||
+	    j->j_nrevoked >= SFS_JMAXREVOKE / 2) {
+		/* Unlocked peek; it's only a hint. Errors show up later. */
+		(void)sfs_jcommit(sfs);
+	}
+
+	lock_acquire(j->j_lock);
+	while (j->j_committing || !sfs_jroom(j)) {
+		if (j->j_committing) {
+			cv_wait(j->j_cv, j->j_lock);
+			continue;
+		}
+		/*
+		 * Full. Commit, which waits for the operations in it to
+		 * finish. If that fails, go ahead anyway; the pin array
+		 * has some slack, and the error shows up later.
+		 */
+		lock_release(j->j_lock);
+		result = sfs_jcommit(sfs);
+		lock_acquire(j->j_lock);
+		if (result) {
+			j->j_overflows++;
+			while (j->j_committing) {
+				cv_wait(j->j_cv, j->j_lock);
+			}
+			break;
+		}
+	}
+	j->j_nupdates++;
+	j->j_nops++;
+	lock_release(j->j_lock);
+}
+
+/*
+ * Leave the running transaction.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_nupdates > 0);
+	j->j_nupdates--;
+	if (j->j_nupdates == 0) {
+		cv_broadcast(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Mark a busy metadata buffer of SV (holding BLOCK) dirty, and add it
+ * to the running transaction. Call between sfs_jbegin and sfs_jend.
+ */
+void
+sfs_jdirty(struct sfs_vnode *sv, struct buf *buf, daddr_t block)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned i;
+
+	buffer_mark_dirty_owner(buf, &sv->sv_bufs);
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_nupdates > 0);
+	for (i=0; i<j->j_npins; i++) {
+		if (j->j_pins[i] == block) {
+			lock_release(j->j_lock);
+			return;
+		}
+	}
+	if (j->j_npins >= SFS_JPINSLOTS) {
+		panic("sfs: %s: journal transaction has too many blocks\n",
+		      sfs->sfs_sb.sb_volname);
+	}
+	j->j_pins[j->j_npins++] = block;
+	buffer_pin(buf);
+	lock_release(j->j_lock);
+}
+
+/*
+ * Note that BLOCK is being freed, so it drops out of the running
+ * transaction and any older copy in the log must not be replayed.
+ * Call between sfs_jbegin and sfs_jend, before dropping the buffer.
+ */
+void
+sfs_jrevoke(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned i;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_nupdates > 0);
+	for (i=0; i<j->j_npins; i++) {
+		if (j->j_pins[i] == block) {
+			j->j_pins[i] = j->j_pins[--j->j_npins];
+			break;
+		}
+	}
+	if (bitmap_isset(j->j_logged, block)) {
+		for (i=0; i<j->j_nrevoked; i++) {
+			if (j->j_revoked[i] == block) {
+				break;
+			}
+		}
+		if (i == j->j_nrevoked) {
+			if (j->j_nrevoked < SFS_JMAXREVOKE) {
+				j->j_revoked[j->j_nrevoked++] = block;
+				j->j_revokes++;
+			}
+			else {
+				j->j_forcecheckpoint = true;
+				j->j_overflows++;
+			}
+		}
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * If the volume has a journal, copy SV's inode into the buffer cache
+ * now, so the change goes into the running transaction together with
+ * the rest of the operation. Call with sv_lock held, between
+ * sfs_jbegin and sfs_jend. If this fails the inode just stays dirty
+ * and goes into a later transaction.
+ */
+void
+sfs_jsyncinode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sfs->sfs_journal == NULL) {
+		return;
+	}
+	(void)sfs_sync_inode(sv);
+}
+
+////////////////////////////////////////////////////////////
+// Commit and checkpoint
+
+/*
+ * Write everything home and start the log over. Call with j_lock
+ * held, no operations in progress, and nothing pinned.
+ */
+static
+int
+sfs_jcheckpoint_locked(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jheader *jh;
+	uint32_t i, freemapblocks;
+	char *freemapdata;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(j->j_nupdates == 0);
+	KASSERT(j->j_npins == 0);
+
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	freemapblocks = SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks);
+	lock_acquire(sfs->sfs_freemaplock);
+	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	for (i=0; i<freemapblocks; i++) {
+		if (!bitmap_isset(j->j_fmhome, i)) {
+			continue;
+		}
+		result = sfs_writeblock(sfs, SFS_FREEMAP_START + i,
+					freemapdata + i * SFS_BLOCKSIZE,
+					SFS_BLOCKSIZE);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		bitmap_unmark(j->j_fmhome, i);
+		sfs->sfs_freemapwrites++;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Everything in the log is now home; start it over. */
+	jh = (struct sfs_jheader *)SFS_JBUF(j, 0);
+	bzero(jh, SFS_BLOCKSIZE);
+	jh->jh_magic = SFS_JMAGIC_HEADER;
+	jh->jh_seq = j->j_seq;
+	jh->jh_start = 0;
+	result = sfs_writeblock(sfs, j->j_start, jh, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+
+	j->j_head = 0;
+	j->j_forcecheckpoint = false;
+	bzero(bitmap_getdata(j->j_logged),
+	      SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks) / CHAR_BIT);
+	j->j_checkpoints++;
+
+	DEBUG(DB_SFS, "sfs: %s: journal checkpoint, next seq %u\n",
+	      sfs->sfs_sb.sb_volname, j->j_seq);
+	return 0;
+}
+
+/*
+ * Write the running transaction to the log. Call with j_lock held and
+ * no operations in progress.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jdesc *jd;
+	struct sfs_jcommit *jc;
+	struct buf *buf;
+	uint32_t i, n, npins, freemapblocks;
+	char *freemapdata;
+	bool fmleft;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(j->j_nupdates == 0);
+
+	jd = (struct sfs_jdesc *)SFS_JBUF(j, 0);
+	bzero(jd, SFS_BLOCKSIZE);
+
+	/* Copy the pinned blocks. */
+	n = 0;
+	for (i=0; i<j->j_npins; i++) {
+		result = buffer_read(sfs->sfs_device, j->j_pins[i], &buf);
+		if (result) {
+			return result;
+		}
+		memcpy(SFS_JBUF(j, n+1), buffer_map(buf), SFS_BLOCKSIZE);
+		buffer_release(buf);
+		jd->jd_blocks[n++] = j->j_pins[i];
+	}
+	npins = n;
+
+	/* Copy the changed freemap blocks, as many as fit. */
+	freemapblocks = SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks);
+	fmleft = false;
+	lock_acquire(sfs->sfs_freemaplock);
+	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	for (i=0; i<freemapblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemapdirtymap, i)) {
+			continue;
+		}
+		if (n + j->j_nrevoked >= SFS_JDESCMAX) {
+			fmleft = true;
+			break;
+		}
+		memcpy(SFS_JBUF(j, n+1), freemapdata + i * SFS_BLOCKSIZE,
+		       SFS_BLOCKSIZE);
+		jd->jd_blocks[n++] = SFS_FREEMAP_START + i;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	if (n == 0 && j->j_nrevoked == 0) {
+		/* Nothing to commit */
+		j->j_nops = 0;
+		return 0;
+	}
+
+	/* Finish the descriptor; the revoked blocks go after the copies. */
+	jd->jd_magic = SFS_JMAGIC_DESC;
+	jd->jd_seq = j->j_seq;
+	jd->jd_nblocks = n;
+	jd->jd_nrevoke = j->j_nrevoked;
+	for (i=0; i<j->j_nrevoked; i++) {
+		jd->jd_blocks[n + i] = j->j_revoked[i];
+	}
+
+	/* We always leave room for a full transaction after a commit. */
+	KASSERT(j->j_head + n + 2 <= j->j_logsize);
+
+	/*
+	 * Write the descriptor and the copies in one go, then the commit
+	 * block. The transaction doesn't count until the latter is on
+	 * disk.
+	 */
+	result = sfs_writeblock(sfs, SFS_JLOGBLOCK(j, j->j_head), jd,
+				(n + 1) * SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	jc = (struct sfs_jcommit *)SFS_JBUF(j, n+1);
+	bzero(jc, SFS_BLOCKSIZE);
+	jc->jc_magic = SFS_JMAGIC_COMMIT;
+	jc->jc_seq = j->j_seq;
+	result = sfs_writeblock(sfs, SFS_JLOGBLOCK(j, j->j_head + n + 1), jc,
+				SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+
+	/* Committed. The pinned blocks are free to go home now. */
+	for (i=0; i<npins; i++) {
+		buffer_unpin(sfs->sfs_device, jd->jd_blocks[i]);
+		if (!bitmap_isset(j->j_logged, jd->jd_blocks[i])) {
+			bitmap_mark(j->j_logged, jd->jd_blocks[i]);
+		}
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=npins; i<n; i++) {
+		daddr_t fmblock = jd->jd_blocks[i] - SFS_FREEMAP_START;
+
+		bitmap_unmark(sfs->sfs_freemapdirtymap, fmblock);
+		if (!bitmap_isset(j->j_fmhome, fmblock)) {
+			bitmap_mark(j->j_fmhome, fmblock);
+		}
+	}
+	if (fmleft) {
+		/* Didn't fit; these have to go straight home. */
+		for (i=0; i<freemapblocks; i++) {
+			if (!bitmap_isset(sfs->sfs_freemapdirtymap, i)) {
+				continue;
+			}
+			result = sfs_writeblock(sfs, SFS_FREEMAP_START + i,
+						freemapdata +
+						i * SFS_BLOCKSIZE,
+						SFS_BLOCKSIZE);
+			if (result) {
+				lock_release(sfs->sfs_freemaplock);
+				return result;
+			}
+			bitmap_unmark(sfs->sfs_freemapdirtymap, i);
+			sfs->sfs_freemapwrites++;
+			j->j_overflows++;
+		}
+	}
+	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapseen = false;
+	lock_release(sfs->sfs_freemaplock);
+
+	j->j_commits++;
+	j->j_ops += j->j_nops;
+	j->j_logblocks += n;
+	j->j_fmblocks += n - npins;
+	DEBUG(DB_SFS, "sfs: %s: journal commit %u: %u ops, %u blocks "
+	      "(%u freemap), %u revoked\n", sfs->sfs_sb.sb_volname,
+	      j->j_seq, j->j_nops, n, n - npins, j->j_nrevoked);
+
+	j->j_seq++;
+	j->j_head += n + 2;
+	j->j_npins = 0;
+	j->j_nrevoked = 0;
+	j->j_nops = 0;
+
+	/* Reclaim log space if the next transaction might not fit. */
+	if (j->j_head + SFS_JMAXTXN > j->j_logsize || j->j_forcecheckpoint) {
+		return sfs_jcheckpoint_locked(sfs);
+	}
+	return 0;
+}
+
+/*
+ * Wait for operations in progress to finish and hold off new ones,
+ * then call FUNC. Must not be called between sfs_jbegin and sfs_jend.
+ */
+static
+int
+sfs_jquiesce(struct sfs_fs *sfs, int (*func)(struct sfs_fs *))
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	lock_acquire(j->j_lock);
+	while (j->j_committing) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_committing = true;
+	while (j->j_nupdates > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	result = func(sfs);
+	j->j_committing = false;
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+	return result;
+}
+
+/*
+ * Commit the running transaction, and with it every operation that
+ * has finished so far.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_journal == NULL) {
+		return 0;
+	}
+	return sfs_jquiesce(sfs, sfs_jwrite);
+}
+
+static
+int
+sfs_jwrite_checkpoint(struct sfs_fs *sfs)
+{
+	int result;
+
+	result = sfs_jwrite(sfs);
+	if (result) {
+		return result;
+	}
+	return sfs_jcheckpoint_locked(sfs);
+}
+
+/*
+ * Commit, then write everything home and empty the log. Used at
+ * unmount time.
+ */
+int
+sfs_jcheckpoint(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_journal == NULL) {
+		return 0;
+	}
+	return sfs_jquiesce(sfs, sfs_jwrite_checkpoint);
+}
+
+////////////////////////////////////////////////////////////
+// Recovery
+
+/*
+ * A freed block found in the log, and the transaction that freed it.
+ */
+struct sfs_jrevoke {
+	uint32_t jr_block;
+	uint32_t jr_seq;
+};
+
+/*
+ * Read the descriptor for transaction SEQ, which should be at log
+ * position POS, into JD, and check that the transaction was
+ * committed. Returns ENOENT if it wasn't, which is where the log
+ * ends.
+ */
+static
+int
+sfs_jreadtxn(struct sfs_fs *sfs, uint32_t pos, uint32_t seq,
+	     struct sfs_jdesc *jd)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jcommit *jc;
+	int result;
+
+	if (pos + 2 > j->j_logsize) {
+		return ENOENT;
+	}
+	result = sfs_readblock(sfs, SFS_JLOGBLOCK(j, pos), jd, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	if (jd->jd_magic != SFS_JMAGIC_DESC || jd->jd_seq != seq ||
+	    jd->jd_nblocks + jd->jd_nrevoke > SFS_JDESCMAX ||
+	    pos + jd->jd_nblocks + 2 > j->j_logsize) {
+		return ENOENT;
+	}
+
+	/* Use the staging area past the descriptor for the commit block */
+	jc = (struct sfs_jcommit *)SFS_JBUF(j, 1);
+	result = sfs_readblock(sfs, SFS_JLOGBLOCK(j, pos + jd->jd_nblocks + 1),
+			       jc, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	if (jc->jc_magic != SFS_JMAGIC_COMMIT || jc->jc_seq != seq) {
+		return ENOENT;
+	}
+	return 0;
+}
+
+/*
+ * Go through the committed transactions in the log, starting with
+ * transaction SEQ at log position POS. If REVOKES is NULL, just count them
+ * and the freed blocks they list; if it isn't but REPLAY is false,
+ * collect the freed blocks; if REPLAY is true, copy blocks home,
+ * skipping any that were freed by a later transaction.
+ */
+static
+int
+sfs_jscan(struct sfs_fs *sfs, uint32_t pos, uint32_t seq,
+	  struct sfs_jrevoke *revokes, unsigned *nrevokes, bool replay,
+	  unsigned *ntxns, unsigned *nblocks)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jdesc *jd;
+	char *data;
+	uint32_t i, k, block;
+	unsigned nr;
+	int result;
+
+	jd = (struct sfs_jdesc *)SFS_JBUF(j, 0);
+	data = SFS_JBUF(j, 2);
+	nr = 0;
+	*ntxns = 0;
+	*nblocks = 0;
+	while (1) {
+		result = sfs_jreadtxn(sfs, pos, seq, jd);
+		if (result == ENOENT) {
+			break;
+		}
+		if (result) {
+			return result;
+		}
+
+		for (i=0; i<jd->jd_nrevoke && !replay; i++) {
+			if (revokes != NULL) {
+				revokes[nr].jr_block =
+					jd->jd_blocks[jd->jd_nblocks + i];
+				revokes[nr].jr_seq = seq;
+			}
+			nr++;
+		}
+
+		for (i=0; i<jd->jd_nblocks && replay; i++) {
+			block = jd->jd_blocks[i];
+			for (k=0; k<*nrevokes; k++) {
+				if (revokes[k].jr_block == block &&
+				    revokes[k].jr_seq > seq) {
+					break;
+				}
+			}
+			if (k < *nrevokes || block >= sfs->sfs_sb.sb_nblocks) {
+				continue;
+			}
+			result = sfs_readblock(sfs,
+					       SFS_JLOGBLOCK(j, pos + 1 + i),
+					       data, SFS_BLOCKSIZE);
+			if (result) {
+				return result;
+			}
+			result = sfs_writeblock(sfs, block, data,
+						SFS_BLOCKSIZE);
+			if (result) {
+				return result;
+			}
+			(*nblocks)++;
+		}
+
+		pos += jd->jd_nblocks + 2;
+		seq++;
+		(*ntxns)++;
+	}
+	if (!replay) {
+		*nrevokes = nr;
+	}
+	j->j_seq = seq;
+	return 0;
+}
+
+/*
+ * Replay whatever committed transactions are in the log.
+ */
+static
+int
+sfs_jrecover(struct sfs_fs *sfs, const struct sfs_jheader *jh)
+{
+	struct sfs_jrevoke *revokes;
+	unsigned nrevokes, ntxns, nblocks;
+	int result;
+
+	/* First count the freed blocks, then collect them, then replay. */
+	result = sfs_jscan(sfs, jh->jh_start, jh->jh_seq, NULL, &nrevokes,
+			   false, &ntxns, &nblocks);
+	if (result || ntxns == 0) {
+		return result;
+	}
+	revokes = NULL;
+	if (nrevokes > 0) {
+		revokes = kmalloc(nrevokes * sizeof(*revokes));
+		if (revokes == NULL) {
+			return ENOMEM;
+		}
+		result = sfs_jscan(sfs, jh->jh_start, jh->jh_seq, revokes,
+				   &nrevokes, false, &ntxns, &nblocks);
+		if (result) {
+			kfree(revokes);
+			return result;
+		}
+	}
+	result = sfs_jscan(sfs, jh->jh_start, jh->jh_seq, revokes, &nrevokes,
+			   true, &ntxns, &nblocks);
+	kfree(revokes);
+	if (result) {
+		return result;
+	}
+
+	kprintf("sfs: %s: replayed %u transactions (%u blocks) from the "
+		"journal\n", sfs->sfs_sb.sb_volname, ntxns, nblocks);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Setup
+
+/*
+ * Destroy the journal state.
+ */
+void
+sfs_jclose(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_nupdates == 0);
+	KASSERT(j->j_npins == 0);
+	if (j->j_fmhome != NULL) {
+		bitmap_destroy(j->j_fmhome);
+	}
+	if (j->j_logged != NULL) {
+		bitmap_destroy(j->j_logged);
+	}
+	kfree(j->j_buf);
+	if (j->j_cv != NULL) {
+		cv_destroy(j->j_cv);
+	}
+	if (j->j_lock != NULL) {
+		lock_destroy(j->j_lock);
+	}
+	kfree(j);
+	sfs->sfs_journal = NULL;
+}
+
+/*
+ * Set up the journal at mount time, if the volume has one, and replay
+ * it. Called after the superblock is loaded and before the freemap is,
+ * since replaying may change the freemap.
+ */
+int
+sfs_jopen(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	struct sfs_journal *j;
+	struct sfs_jheader *jh;
+	uint32_t freemapend;
+	int result;
+
+	KASSERT(sfs->sfs_journal == NULL);
+	if (sb->sb_journalblocks == 0) {
+		return 0;
+	}
+
+	freemapend = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(sb->sb_nblocks);
+	if (sb->sb_journalstart < freemapend ||
+	    sb->sb_journalblocks < SFS_JOURNAL_MINBLOCKS ||
+	    sb->sb_journalstart + sb->sb_journalblocks > sb->sb_nblocks) {
+		kprintf("sfs: %s: Invalid journal (%u blocks at %u)\n",
+			sb->sb_volname, sb->sb_journalblocks,
+			sb->sb_journalstart);
+		return EINVAL;
+	}
+
+	j = kmalloc(sizeof(*j));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	bzero(j, sizeof(*j));
+	sfs->sfs_journal = j;
+	j->j_start = sb->sb_journalstart;
+	j->j_logsize = sb->sb_journalblocks - 1;
+
+	j->j_lock = lock_create("sfs journal");
+	j->j_cv = cv_create("sfs journal");
+	j->j_buf = kmalloc(SFS_JMAXTXN * SFS_BLOCKSIZE);
+	j->j_logged = bitmap_create(SFS_FREEMAPBITS(sb->sb_nblocks));
+	j->j_fmhome = bitmap_create(SFS_FREEMAPBLOCKS(sb->sb_nblocks));
+	if (j->j_lock == NULL || j->j_cv == NULL || j->j_buf == NULL ||
+	    j->j_logged == NULL || j->j_fmhome == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	/* Read the header and replay. */
+	jh = (struct sfs_jheader *)SFS_JBUF(j, SFS_JMAXTXN - 1);
+	result = sfs_readblock(sfs, j->j_start, jh, SFS_BLOCKSIZE);
+	if (result) {
+		goto fail;
+	}
+	if (jh->jh_magic != SFS_JMAGIC_HEADER) {
+		kprintf("sfs: %s: Bad journal header magic 0x%x\n",
+			sb->sb_volname, jh->jh_magic);
+		result = EINVAL;
+		goto fail;
+	}
+	result = sfs_jrecover(sfs, jh);
+	if (result) {
+		kprintf("sfs: %s: Journal replay failed: %s\n",
+			sb->sb_volname, strerror(result));
+		goto fail;
+	}
+
+	/* Start the log over. */
+	bzero(jh, SFS_BLOCKSIZE);
+	jh->jh_magic = SFS_JMAGIC_HEADER;
+	jh->jh_seq = j->j_seq;
+	jh->jh_start = 0;
+	result = sfs_writeblock(sfs, j->j_start, jh, SFS_BLOCKSIZE);
+	if (result) {
+		goto fail;
+	}
+	j->j_head = 0;
+	return 0;
+
+ fail:
+	sfs_jclose(sfs);
+	return result;
+}
+
+/*
+ * Print statistics.
+ */
+void
+sfs_jprintstats(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL || j->j_commits == 0) {
+		return;
+	}
+	kprintf("sfs: %s: journal: %u commits of %u ops (%u.%02u per "
+		"commit), %u blocks logged (%u freemap)\n",
+		sfs->sfs_sb.sb_volname, j->j_commits, j->j_ops,
+		j->j_ops / j->j_commits,
+		(j->j_ops % j->j_commits) * 100 / j->j_commits,
+		j->j_logblocks, j->j_fmblocks);
+	kprintf("sfs: %s: journal: %u blocks revoked, %u checkpoints, "
+		"%u overflows\n", sfs->sfs_sb.sb_volname, j->j_revokes,
+		j->j_checkpoints, j->j_overflows);
+}
@@ -44,12 +44,17 @@ extern const struct vnode_ops sfs_dirops;
 
 /* Functions in sfs_balloc.c */
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc_file(struct sfs_vnode *sv, daddr_t prevblock, bool clear,
+		daddr_t *diskblock);
+void sfs_bunreserve(struct sfs_vnode *sv);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
+int sfs_bmap_overwrite(struct sfs_vnode *sv, uint32_t fileblock,
+		daddr_t *diskblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -58,11 +63,13 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
 /* Functions in sfs_inode.c */
+void sfs_dirtyinode(struct sfs_vnode *sv);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
@@ -70,9 +77,29 @@ int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
+/*
+ * Most blocks one journaled operation may change (see sfs_journal.c),
+ * and the biggest piece of a write that's done as one operation.
+ */
+#define SFS_JOPPINS     16
+#define SFS_JWRITEMAX   (64 * SFS_BLOCKSIZE)
+
+/* Functions in sfs_journal.c */
+int sfs_jopen(struct sfs_fs *sfs);
+void sfs_jclose(struct sfs_fs *sfs);
+void sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+void sfs_jdirty(struct sfs_vnode *sv, struct buf *buf, daddr_t block);
+void sfs_jrevoke(struct sfs_fs *sfs, daddr_t block);
+void sfs_jsyncinode(struct sfs_vnode *sv);
+int sfs_jcommit(struct sfs_fs *sfs);
+int sfs_jcheckpoint(struct sfs_fs *sfs);
+void sfs_jprintstats(struct sfs_fs *sfs);
+
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_inline_migrate(struct sfs_vnode *sv);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef TMPFS_H
+#define TMPFS_H
+
+/*
+ * tmpfs: a filesystem that lives entirely in memory.
+ *
+ * There is one of these, attached at boot time as "tmp:". It holds
+ * regular files and directories. File data is kept in whole pages
+ * from the page allocator, allocated as they're first written, so
+ * sparse files only use pages for the parts that have been written.
+ * The total number of data pages is limited to TMPFS_MAXPAGES;
+ * writes past that fail with ENOSPC. Nothing survives a reboot.
+ */
+
+#include <array.h>
+#include <spinlock.h>
+#include <fs.h>
+#include <vnode.h>
+#include <vm.h>
+
+#ifndef TMPFS_INLINE
+#define TMPFS_INLINE INLINE
+#endif
+
+/*
+ * Constants
+ */
+
+#define TMPFS_MAXPAGES	512		/* Size limit (2M), in pages */
+#define TMPFS_MAXFILESIZE ((off_t)65536 * PAGE_SIZE) /* Largest file */
+
+/*
+ * Directory entry; name and reference to a node.
+ */
+struct tmpfs_direntry {
+	char *td_name;				/* Name */
+	struct tmpfs_node *td_node;		/* What it names */
+};
+DECLARRAY(tmpfs_direntry, TMPFS_INLINE);
+
+/*
+ * A file or directory.
+ *
+ * Unlike in semfs, the vnode is part of the object and they live and
+ * die together. While a node has links, the directory tree holds a
+ * reference to its vnode (the root's is held by the fs itself), so
+ * VOP_RECLAIM only happens once the node has been removed and the
+ * last user has let go of it; at that point nothing can find it any
+ * more and it can just be destroyed.
+ *
+ * The directory fields, tn_linkcount, and tn_nsubdirs are protected
+ * by the fs-wide tmpfs_lock; the file data fields by tn_lock.
+ */
+struct tmpfs_node {
+	struct vnode tn_absvn;			/* Abstract vnode */
+	struct tmpfs *tn_tmpfs;			/* Back-pointer to fs */
+	unsigned tn_ino;			/* Serial number, for stat */
+	bool tn_isdir;				/* Directory or file */
+	unsigned tn_linkcount;			/* # of names for it */
+
+	/* Directories */
+	struct tmpfs_node *tn_parent;		/* Parent (root: itself) */
+	struct tmpfs_direntryarray *tn_dents;	/* Contents */
+	unsigned tn_nsubdirs;			/* # of subdirs, for stat */
+
+	/* Files */
+	struct lock *tn_lock;			/* Lock for following */
+	off_t tn_size;				/* File size */
+	vaddr_t *tn_pages;			/* Data pages, or 0 if none */
+	unsigned tn_maxpages;			/* Size of tn_pages */
+	unsigned tn_npages;			/* # of pages allocated */
+};
+
+/*
+ * The structure for the filesystem.
+ */
+struct tmpfs {
+	struct fs tmpfs_absfs;			/* Abstract fs object */
+	struct tmpfs_node *tmpfs_root;		/* Root directory */
+
+	struct lock *tmpfs_lock;		/* Lock for the namespace */
+	unsigned tmpfs_nextino;			/* Next serial number */
+	unsigned tmpfs_nnodes;			/* # of nodes, with the root */
+
+	struct spinlock tmpfs_pagelock;		/* Lock for following */
+	unsigned tmpfs_npages;			/* Data pages in use */
+	unsigned tmpfs_maxpages;		/* Limit on tmpfs_npages */
+};
+
+/*
+ * Arrays
+ */
+
+DEFARRAY(tmpfs_direntry, TMPFS_INLINE);
+
+
+/*
+ * Functions.
+ */
+
+/* in tmpfs_obj.c */
+struct tmpfs_direntry *tmpfs_direntry_create(const char *name,
+					     struct tmpfs_node *tn);
+void tmpfs_direntry_destroy(struct tmpfs_direntry *);
+int tmpfs_getpage(struct tmpfs_node *tn, unsigned pagenum, bool doalloc,
+		  vaddr_t *ret);
+void tmpfs_truncpages(struct tmpfs_node *tn, off_t len);
+
+/* in tmpfs_vnops.c */
+struct tmpfs_node *tmpfs_node_create(struct tmpfs *tmpfs, bool isdir);
+void tmpfs_node_destroy(struct tmpfs_node *tn);
+
+
+#endif /* TMPFS_H */
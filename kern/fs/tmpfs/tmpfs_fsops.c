@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * tmpfs fs-level operations, and setup.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <fs.h>
+#include <vnode.h>
+
+#include "tmpfs.h"
+
+////////////////////////////////////////////////////////////
+// fs-level operations
+
+/*
+ * Sync doesn't need to do anything.
+ */
+static
+int
+tmpfs_sync(struct fs *fs)
+{
+	(void)fs;
+	return 0;
+}
+
+/*
+ * We have only one volume name and it's hardwired.
+ */
+static
+const char *
+tmpfs_getvolname(struct fs *fs)
+{
+	(void)fs;
+	return "tmp";
+}
+
+/*
+ * Get the root directory vnode.
+ */
+static
+int
+tmpfs_getroot(struct fs *fs, struct vnode **ret)
+{
+	struct tmpfs *tmpfs = fs->fs_data;
+
+	VOP_INCREF(&tmpfs->tmpfs_root->tn_absvn);
+	*ret = &tmpfs->tmpfs_root->tn_absvn;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// mount and unmount logic
+
+/*
+ * Destructor for struct tmpfs.
+ */
+static
+void
+tmpfs_destroy(struct tmpfs *tmpfs)
+{
+	KASSERT(tmpfs->tmpfs_nnodes == 0);
+	KASSERT(tmpfs->tmpfs_npages == 0);
+
+	spinlock_cleanup(&tmpfs->tmpfs_pagelock);
+	lock_destroy(tmpfs->tmpfs_lock);
+	kfree(tmpfs);
+}
+
+/*
+ * Unmount routine. This only works if everything has been deleted
+ * and nobody is using the root directory. Since tmpfs is attached
+ * with vfs_addfs, with no device behind it, neither vfs_unmount nor
+ * vfs_unmountall will ever call this; it's here for completeness.
+ */
+static
+int
+tmpfs_unmount(struct fs *fs)
+{
+	struct tmpfs *tmpfs = fs->fs_data;
+	struct tmpfs_node *root = tmpfs->tmpfs_root;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	if (tmpfs->tmpfs_nnodes > 1) {
+		lock_release(tmpfs->tmpfs_lock);
+		return EBUSY;
+	}
+	spinlock_acquire(&root->tn_absvn.vn_countlock);
+	if (root->tn_absvn.vn_refcount > 1) {
+		spinlock_release(&root->tn_absvn.vn_countlock);
+		lock_release(tmpfs->tmpfs_lock);
+		return EBUSY;
+	}
+	spinlock_release(&root->tn_absvn.vn_countlock);
+
+	/* Drop the fs's reference to the root; this reclaims it */
+	root->tn_linkcount = 0;
+	lock_release(tmpfs->tmpfs_lock);
+	VOP_DECREF(&root->tn_absvn);
+
+	tmpfs_destroy(tmpfs);
+	return 0;
+}
+
+/*
+ * Operations table.
+ */
+static const struct fs_ops tmpfs_fsops = {
+	.fsop_sync = tmpfs_sync,
+	.fsop_getvolname = tmpfs_getvolname,
+	.fsop_getroot = tmpfs_getroot,
+	.fsop_unmount = tmpfs_unmount,
+};
+
+/*
+ * Constructor for struct tmpfs.
+ */
+static
+struct tmpfs *
+tmpfs_create(void)
+{
+	struct tmpfs *tmpfs;
+
+	tmpfs = kmalloc(sizeof(*tmpfs));
+	if (tmpfs == NULL) {
+		goto fail_total;
+	}
+
+	tmpfs->tmpfs_lock = lock_create("tmpfs");
+	if (tmpfs->tmpfs_lock == NULL) {
+		goto fail_tmpfs;
+	}
+	tmpfs->tmpfs_nextino = 1;
+	tmpfs->tmpfs_nnodes = 0;
+
+	spinlock_init(&tmpfs->tmpfs_pagelock);
+	tmpfs->tmpfs_npages = 0;
+	tmpfs->tmpfs_maxpages = TMPFS_MAXPAGES;
+
+	tmpfs->tmpfs_absfs.fs_data = tmpfs;
+	tmpfs->tmpfs_absfs.fs_ops = &tmpfs_fsops;
+
+	/* The root's vnode reference belongs to the fs */
+	tmpfs->tmpfs_root = tmpfs_node_create(tmpfs, true);
+	if (tmpfs->tmpfs_root == NULL) {
+		goto fail_lock;
+	}
+	tmpfs->tmpfs_root->tn_linkcount = 1;
+	tmpfs->tmpfs_root->tn_parent = tmpfs->tmpfs_root;
+
+	return tmpfs;
+
+ fail_lock:
+	spinlock_cleanup(&tmpfs->tmpfs_pagelock);
+	lock_destroy(tmpfs->tmpfs_lock);
+ fail_tmpfs:
+	kfree(tmpfs);
+ fail_total:
+	return NULL;
+}
+
+/*
+ * Create the tmpfs. There is only one and it's attached as "tmp:"
+ * during bootup.
+ */
+void
+tmpfs_bootstrap(void)
+{
+	struct tmpfs *tmpfs;
+	int result;
+
+	tmpfs = tmpfs_create();
+	if (tmpfs == NULL) {
+		panic("Out of memory creating tmpfs\n");
+	}
+	result = vfs_addfs("tmp", &tmpfs->tmpfs_absfs);
+	if (result) {
+		panic("Attaching tmpfs: %s\n", strerror(result));
+	}
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * tmpfs directory entries and file data pages.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+
+#define TMPFS_INLINE
+#include "tmpfs.h"
+
+////////////////////////////////////////////////////////////
+// tmpfs_direntry
+
+/*
+ * Constructor for tmpfs_direntry.
+ */
+struct tmpfs_direntry *
+tmpfs_direntry_create(const char *name, struct tmpfs_node *tn)
+{
+	struct tmpfs_direntry *dent;
+
+	dent = kmalloc(sizeof(*dent));
+	if (dent == NULL) {
+		return NULL;
+	}
+	dent->td_name = kstrdup(name);
+	if (dent->td_name == NULL) {
+		kfree(dent);
+		return NULL;
+	}
+	dent->td_node = tn;
+	return dent;
+}
+
+/*
+ * Destructor for tmpfs_direntry.
+ */
+void
+tmpfs_direntry_destroy(struct tmpfs_direntry *dent)
+{
+	kfree(dent->td_name);
+	kfree(dent);
+}
+
+////////////////////////////////////////////////////////////
+// data pages
+
+/*
+ * Charge one page to the fs, or fail if it's full.
+ */
+static
+int
+tmpfs_reservepage(struct tmpfs *tmpfs)
+{
+	int result;
+
+	spinlock_acquire(&tmpfs->tmpfs_pagelock);
+	if (tmpfs->tmpfs_npages < tmpfs->tmpfs_maxpages) {
+		tmpfs->tmpfs_npages++;
+		result = 0;
+	}
+	else {
+		result = ENOSPC;
+	}
+	spinlock_release(&tmpfs->tmpfs_pagelock);
+	return result;
+}
+
+/*
+ * Give back a page charged with tmpfs_reservepage.
+ */
+static
+void
+tmpfs_unreservepage(struct tmpfs *tmpfs)
+{
+	spinlock_acquire(&tmpfs->tmpfs_pagelock);
+	KASSERT(tmpfs->tmpfs_npages > 0);
+	tmpfs->tmpfs_npages--;
+	spinlock_release(&tmpfs->tmpfs_pagelock);
+}
+
+/*
+ * Make the page table of a file big enough to hold page PAGENUM.
+ * It grows by doubling.
+ */
+static
+int
+tmpfs_growpages(struct tmpfs_node *tn, unsigned pagenum)
+{
+	vaddr_t *newpages;
+	unsigned newmax, i;
+
+	newmax = tn->tn_maxpages > 0 ? tn->tn_maxpages : 4;
+	while (newmax <= pagenum) {
+		newmax *= 2;
+	}
+
+	newpages = kmalloc(newmax * sizeof(vaddr_t));
+	if (newpages == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<tn->tn_maxpages; i++) {
+		newpages[i] = tn->tn_pages[i];
+	}
+	for (; i<newmax; i++) {
+		newpages[i] = 0;
+	}
+	if (tn->tn_pages != NULL) {
+		kfree(tn->tn_pages);
+	}
+	tn->tn_pages = newpages;
+	tn->tn_maxpages = newmax;
+	return 0;
+}
+
+/*
+ * Find data page PAGENUM of a file. If there isn't one, allocate a
+ * zeroed page if DOALLOC is set, and otherwise hand back 0 (the
+ * page reads as zeros). Call with tn_lock held.
+ */
+int
+tmpfs_getpage(struct tmpfs_node *tn, unsigned pagenum, bool doalloc,
+	      vaddr_t *ret)
+{
+	struct tmpfs *tmpfs = tn->tn_tmpfs;
+	vaddr_t page;
+	int result;
+
+	KASSERT(lock_do_i_hold(tn->tn_lock));
+
+	if (pagenum < tn->tn_maxpages && tn->tn_pages[pagenum] != 0) {
+		*ret = tn->tn_pages[pagenum];
+		return 0;
+	}
+	if (!doalloc) {
+		*ret = 0;
+		return 0;
+	}
+
+	if (pagenum >= tn->tn_maxpages) {
+		result = tmpfs_growpages(tn, pagenum);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = tmpfs_reservepage(tmpfs);
+	if (result) {
+		return result;
+	}
+	page = alloc_kpages(1);
+	if (page == 0) {
+		tmpfs_unreservepage(tmpfs);
+		return ENOSPC;
+	}
+	bzero((void *)page, PAGE_SIZE);
+
+	tn->tn_pages[pagenum] = page;
+	tn->tn_npages++;
+	*ret = page;
+	return 0;
+}
+
+/*
+ * Throw away the data pages of a file that are entirely past LEN,
+ * and zero the part of the last page past LEN so the file reads as
+ * zeros there if it grows again. Call with tn_lock held, or when
+ * destroying the node.
+ */
+void
+tmpfs_truncpages(struct tmpfs_node *tn, off_t len)
+{
+	unsigned firstfree, i;
+	size_t tail;
+
+	firstfree = DIVROUNDUP(len, PAGE_SIZE);
+	for (i=firstfree; i<tn->tn_maxpages; i++) {
+		if (tn->tn_pages[i] != 0) {
+			free_kpages(tn->tn_pages[i]);
+			tn->tn_pages[i] = 0;
+			KASSERT(tn->tn_npages > 0);
+			tn->tn_npages--;
+			tmpfs_unreservepage(tn->tn_tmpfs);
+		}
+	}
+
+	tail = len % PAGE_SIZE;
+	if (tail != 0 && firstfree - 1 < tn->tn_maxpages &&
+	    tn->tn_pages[firstfree - 1] != 0) {
+		bzero((char *)tn->tn_pages[firstfree - 1] + tail,
+		      PAGE_SIZE - tail);
+	}
+
+	if (tn->tn_npages == 0 && tn->tn_pages != NULL) {
+		kfree(tn->tn_pages);
+		tn->tn_pages = NULL;
+		tn->tn_maxpages = 0;
+	}
+}
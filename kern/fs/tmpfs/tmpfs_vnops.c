@@ -0,0 +1,1080 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * tmpfs vnode operations.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <limits.h>
+#include <lib.h>
+#include <stat.h>
+#include <uio.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#include "tmpfs.h"
+
+static const struct vnode_ops tmpfs_fileops;
+static const struct vnode_ops tmpfs_dirops;
+
+////////////////////////////////////////////////////////////
+// directory helpers
+
+/*
+ * Find NAME in directory DIR. Hands back the entry, or NULL, and its
+ * slot in *SLOT. Call with tmpfs_lock held.
+ */
+static
+struct tmpfs_direntry *
+tmpfs_dir_find(struct tmpfs_node *dir, const char *name, unsigned *slot)
+{
+	struct tmpfs_direntry *dent;
+	unsigned i, num;
+
+	KASSERT(lock_do_i_hold(dir->tn_tmpfs->tmpfs_lock));
+
+	num = tmpfs_direntryarray_num(dir->tn_dents);
+	for (i=0; i<num; i++) {
+		dent = tmpfs_direntryarray_get(dir->tn_dents, i);
+		if (dent != NULL && !strcmp(dent->td_name, name)) {
+			if (slot != NULL) {
+				*slot = i;
+			}
+			return dent;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add an entry NAME for TN to directory DIR, reusing an empty slot
+ * if there is one. Call with tmpfs_lock held.
+ */
+static
+int
+tmpfs_dir_add(struct tmpfs_node *dir, const char *name, struct tmpfs_node *tn)
+{
+	struct tmpfs_direntry *dent;
+	unsigned i, num;
+	int result;
+
+	KASSERT(lock_do_i_hold(dir->tn_tmpfs->tmpfs_lock));
+
+	if (strlen(name) > NAME_MAX) {
+		return ENAMETOOLONG;
+	}
+
+	dent = tmpfs_direntry_create(name, tn);
+	if (dent == NULL) {
+		return ENOMEM;
+	}
+
+	num = tmpfs_direntryarray_num(dir->tn_dents);
+	for (i=0; i<num; i++) {
+		if (tmpfs_direntryarray_get(dir->tn_dents, i) == NULL) {
+			tmpfs_direntryarray_set(dir->tn_dents, i, dent);
+			return 0;
+		}
+	}
+	result = tmpfs_direntryarray_add(dir->tn_dents, dent, NULL);
+	if (result) {
+		tmpfs_direntry_destroy(dent);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Remove the entry in SLOT of directory DIR. Call with tmpfs_lock
+ * held.
+ */
+static
+void
+tmpfs_dir_unlink(struct tmpfs_node *dir, unsigned slot)
+{
+	struct tmpfs_direntry *dent;
+
+	KASSERT(lock_do_i_hold(dir->tn_tmpfs->tmpfs_lock));
+
+	dent = tmpfs_direntryarray_get(dir->tn_dents, slot);
+	KASSERT(dent != NULL);
+	tmpfs_direntryarray_set(dir->tn_dents, slot, NULL);
+	tmpfs_direntry_destroy(dent);
+}
+
+/*
+ * Check if directory DIR is empty. Call with tmpfs_lock held.
+ */
+static
+bool
+tmpfs_dir_isempty(struct tmpfs_node *dir)
+{
+	unsigned i, num;
+
+	num = tmpfs_direntryarray_num(dir->tn_dents);
+	for (i=0; i<num; i++) {
+		if (tmpfs_direntryarray_get(dir->tn_dents, i) != NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Take the last name away from TN. If it's a directory, it also
+ * leaves its parent. Returns true if the directory tree's reference
+ * to the vnode should now be dropped, which must be done after
+ * releasing tmpfs_lock, as it may reclaim the node.
+ */
+static
+bool
+tmpfs_unlinknode(struct tmpfs_node *tn)
+{
+	KASSERT(lock_do_i_hold(tn->tn_tmpfs->tmpfs_lock));
+	KASSERT(tn->tn_linkcount > 0);
+
+	tn->tn_linkcount--;
+	if (tn->tn_isdir) {
+		KASSERT(tn->tn_linkcount == 0);
+		KASSERT(tn->tn_parent->tn_nsubdirs > 0);
+		tn->tn_parent->tn_nsubdirs--;
+		/* ".." in a removed directory doesn't go anywhere */
+		tn->tn_parent = NULL;
+	}
+	return tn->tn_linkcount == 0;
+}
+
+////////////////////////////////////////////////////////////
+// basic ops
+
+/*
+ * Files may be opened any which way.
+ */
+static
+int
+tmpfs_eachopen(struct vnode *vn, int openflags)
+{
+	(void)vn;
+	(void)openflags;
+	return 0;
+}
+
+/*
+ * Directories may only be open for read.
+ */
+static
+int
+tmpfs_eachopendir(struct vnode *vn, int openflags)
+{
+	(void)vn;
+
+	if ((openflags & O_ACCMODE) != O_RDONLY) {
+		return EISDIR;
+	}
+	if (openflags & O_APPEND) {
+		return EISDIR;
+	}
+	return 0;
+}
+
+static
+int
+tmpfs_ioctl(struct vnode *vn, int op, userptr_t data)
+{
+	(void)vn;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+tmpfs_gettype(struct vnode *vn, mode_t *ret)
+{
+	struct tmpfs_node *tn = vn->vn_data;
+
+	*ret = tn->tn_isdir ? S_IFDIR : S_IFREG;
+	return 0;
+}
+
+static
+bool
+tmpfs_isseekable(struct vnode *vn)
+{
+	(void)vn;
+	return true;
+}
+
+/*
+ * Nothing is ever on disk, so there's nothing to sync.
+ */
+static
+int
+tmpfs_fsync(struct vnode *vn)
+{
+	(void)vn;
+	return 0;
+}
+
+/*
+ * stat() for files and directories. The size of a directory is its
+ * number of entries; st_blocks counts 512-byte units of data pages.
+ */
+static
+int
+tmpfs_stat(struct vnode *vn, struct stat *buf)
+{
+	struct tmpfs_node *tn = vn->vn_data;
+	struct tmpfs *tmpfs = tn->tn_tmpfs;
+	unsigned i, num;
+
+	bzero(buf, sizeof(*buf));
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	if (tn->tn_isdir) {
+		num = tmpfs_direntryarray_num(tn->tn_dents);
+		for (i=0; i<num; i++) {
+			if (tmpfs_direntryarray_get(tn->tn_dents, i) != NULL) {
+				buf->st_size++;
+			}
+		}
+		buf->st_nlink = tn->tn_linkcount > 0 ?
+			2 + tn->tn_nsubdirs : 0;
+		buf->st_mode = S_IFDIR | 0777;
+	}
+	else {
+		buf->st_nlink = tn->tn_linkcount;
+		buf->st_mode = S_IFREG | 0666;
+	}
+	lock_release(tmpfs->tmpfs_lock);
+
+	if (!tn->tn_isdir) {
+		lock_acquire(tn->tn_lock);
+		buf->st_size = tn->tn_size;
+		buf->st_blocks = tn->tn_npages * (PAGE_SIZE / 512);
+		lock_release(tn->tn_lock);
+	}
+
+	buf->st_dev = 0;
+	buf->st_ino = tn->tn_ino;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// file ops
+
+/*
+ * Read or write file data, a page at a time. Reads stop at EOF;
+ * pages that were never written read as zeros.
+ */
+static
+int
+tmpfs_io(struct tmpfs_node *tn, struct uio *uio)
+{
+	vaddr_t page;
+	size_t pageoff, len, extraresid = 0;
+	off_t endpos;
+	int result = 0;
+
+	lock_acquire(tn->tn_lock);
+
+	endpos = uio->uio_offset + uio->uio_resid;
+	if (uio->uio_rw == UIO_READ) {
+		if (uio->uio_offset >= tn->tn_size) {
+			/* At or past EOF - just return */
+			lock_release(tn->tn_lock);
+			return 0;
+		}
+		if (endpos > tn->tn_size) {
+			extraresid = endpos - tn->tn_size;
+			uio->uio_resid -= extraresid;
+		}
+	}
+	else if (endpos > TMPFS_MAXFILESIZE) {
+		lock_release(tn->tn_lock);
+		return EFBIG;
+	}
+
+	while (uio->uio_resid > 0) {
+		pageoff = uio->uio_offset % PAGE_SIZE;
+		len = PAGE_SIZE - pageoff;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		result = tmpfs_getpage(tn, uio->uio_offset / PAGE_SIZE,
+				       uio->uio_rw == UIO_WRITE, &page);
+		if (result) {
+			break;
+		}
+		if (page == 0) {
+			result = uiomovezeros(len, uio);
+		}
+		else {
+			result = uiomove((char *)page + pageoff, len, uio);
+		}
+		if (result) {
+			break;
+		}
+	}
+
+	/* If writing and we did anything, adjust file length */
+	if (uio->uio_rw == UIO_WRITE && uio->uio_offset > tn->tn_size) {
+		tn->tn_size = uio->uio_offset;
+	}
+
+	/* Add in any extra amount we couldn't read because of EOF */
+	uio->uio_resid += extraresid;
+
+	lock_release(tn->tn_lock);
+	return result;
+}
+
+static
+int
+tmpfs_read(struct vnode *vn, struct uio *uio)
+{
+	KASSERT(uio->uio_rw == UIO_READ);
+	return tmpfs_io(vn->vn_data, uio);
+}
+
+static
+int
+tmpfs_write(struct vnode *vn, struct uio *uio)
+{
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	return tmpfs_io(vn->vn_data, uio);
+}
+
+/*
+ * Truncate. Growing a file just changes its size; the new part reads
+ * as zeros until written.
+ */
+static
+int
+tmpfs_truncate(struct vnode *vn, off_t len)
+{
+	struct tmpfs_node *tn = vn->vn_data;
+
+	if (len < 0) {
+		return EINVAL;
+	}
+	if (len > TMPFS_MAXFILESIZE) {
+		return EFBIG;
+	}
+
+	lock_acquire(tn->tn_lock);
+	if (len < tn->tn_size) {
+		tmpfs_truncpages(tn, len);
+	}
+	tn->tn_size = len;
+	lock_release(tn->tn_lock);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// directory ops
+
+/*
+ * Directory read. The offset is the slot number; skip empty slots
+ * and leave the offset at the slot after the one returned.
+ */
+static
+int
+tmpfs_getdirentry(struct vnode *dirvn, struct uio *uio)
+{
+	struct tmpfs_node *dir = dirvn->vn_data;
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_direntry *dent;
+	unsigned num, pos;
+	int result;
+
+	KASSERT(uio->uio_offset >= 0);
+	pos = uio->uio_offset;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+
+	num = tmpfs_direntryarray_num(dir->tn_dents);
+	dent = NULL;
+	while (pos < num) {
+		dent = tmpfs_direntryarray_get(dir->tn_dents, pos);
+		if (dent != NULL) {
+			break;
+		}
+		pos++;
+	}
+	if (pos >= num) {
+		/* EOF */
+		result = 0;
+	}
+	else {
+		result = uiomove(dent->td_name, strlen(dent->td_name), uio);
+		uio->uio_offset = pos + 1;
+	}
+
+	lock_release(tmpfs->tmpfs_lock);
+	return result;
+}
+
+/*
+ * Backend for getcwd. Walk up to the root, collecting names from the
+ * end of a buffer backwards.
+ */
+static
+int
+tmpfs_namefile(struct vnode *vn, struct uio *uio)
+{
+	struct tmpfs_node *tn = vn->vn_data;
+	struct tmpfs *tmpfs = tn->tn_tmpfs;
+	struct tmpfs_direntry *dent;
+	char *buf;
+	size_t pos, len;
+	unsigned i, num;
+	int result;
+
+	buf = kmalloc(PATH_MAX);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	pos = PATH_MAX;
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	while (tn != tmpfs->tmpfs_root) {
+		if (tn->tn_parent == NULL) {
+			/* removed */
+			result = ENOENT;
+			goto out;
+		}
+		num = tmpfs_direntryarray_num(tn->tn_parent->tn_dents);
+		dent = NULL;
+		for (i=0; i<num; i++) {
+			dent = tmpfs_direntryarray_get(tn->tn_parent->tn_dents,
+						       i);
+			if (dent != NULL && dent->td_node == tn) {
+				break;
+			}
+		}
+		KASSERT(i < num);
+
+		len = strlen(dent->td_name);
+		if (len + 1 > pos) {
+			result = ENAMETOOLONG;
+			goto out;
+		}
+		if (pos < PATH_MAX) {
+			buf[--pos] = '/';
+		}
+		pos -= len;
+		memcpy(buf + pos, dent->td_name, len);
+
+		tn = tn->tn_parent;
+	}
+	lock_release(tmpfs->tmpfs_lock);
+
+	result = uiomove(buf + pos, PATH_MAX - pos, uio);
+	kfree(buf);
+	return result;
+
+ out:
+	lock_release(tmpfs->tmpfs_lock);
+	kfree(buf);
+	return result;
+}
+
+/*
+ * Create a file.
+ */
+static
+int
+tmpfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
+	    struct vnode **ret)
+{
+	struct tmpfs_node *dir = dirvn->vn_data;
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_direntry *dent;
+	struct tmpfs_node *tn;
+	int result;
+
+	(void)mode;
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return EEXIST;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+
+	if (dir->tn_linkcount == 0) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOENT;
+	}
+
+	dent = tmpfs_dir_find(dir, name, NULL);
+	if (dent != NULL) {
+		if (excl) {
+			lock_release(tmpfs->tmpfs_lock);
+			return EEXIST;
+		}
+		if (dent->td_node->tn_isdir) {
+			lock_release(tmpfs->tmpfs_lock);
+			return EISDIR;
+		}
+		VOP_INCREF(&dent->td_node->tn_absvn);
+		lock_release(tmpfs->tmpfs_lock);
+		*ret = &dent->td_node->tn_absvn;
+		return 0;
+	}
+
+	tn = tmpfs_node_create(tmpfs, false);
+	if (tn == NULL) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOMEM;
+	}
+	result = tmpfs_dir_add(dir, name, tn);
+	if (result) {
+		tmpfs->tmpfs_nnodes--;
+		tmpfs_node_destroy(tn);
+		lock_release(tmpfs->tmpfs_lock);
+		return result;
+	}
+	tn->tn_linkcount = 1;
+
+	/* One reference for the directory, one for the caller */
+	VOP_INCREF(&tn->tn_absvn);
+
+	lock_release(tmpfs->tmpfs_lock);
+	*ret = &tn->tn_absvn;
+	return 0;
+}
+
+/*
+ * Make a directory.
+ */
+static
+int
+tmpfs_mkdir(struct vnode *dirvn, const char *name, mode_t mode)
+{
+	struct tmpfs_node *dir = dirvn->vn_data;
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_node *tn;
+	int result;
+
+	(void)mode;
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return EEXIST;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+
+	if (dir->tn_linkcount == 0) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOENT;
+	}
+	if (tmpfs_dir_find(dir, name, NULL) != NULL) {
+		lock_release(tmpfs->tmpfs_lock);
+		return EEXIST;
+	}
+
+	tn = tmpfs_node_create(tmpfs, true);
+	if (tn == NULL) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOMEM;
+	}
+	result = tmpfs_dir_add(dir, name, tn);
+	if (result) {
+		tmpfs->tmpfs_nnodes--;
+		tmpfs_node_destroy(tn);
+		lock_release(tmpfs->tmpfs_lock);
+		return result;
+	}
+
+	/* The reference from tmpfs_node_create is the directory's */
+	tn->tn_linkcount = 1;
+	tn->tn_parent = dir;
+	dir->tn_nsubdirs++;
+
+	lock_release(tmpfs->tmpfs_lock);
+	return 0;
+}
+
+/*
+ * Make a hard link to a file.
+ */
+static
+int
+tmpfs_link(struct vnode *dirvn, const char *name, struct vnode *filevn)
+{
+	struct tmpfs_node *dir = dirvn->vn_data;
+	struct tmpfs_node *tn = filevn->vn_data;
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	int result;
+
+	KASSERT(filevn->vn_fs == dirvn->vn_fs);
+
+	if (tn->tn_isdir) {
+		return EINVAL;
+	}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return EEXIST;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+
+	if (dir->tn_linkcount == 0 || tn->tn_linkcount == 0) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOENT;
+	}
+	if (tmpfs_dir_find(dir, name, NULL) != NULL) {
+		lock_release(tmpfs->tmpfs_lock);
+		return EEXIST;
+	}
+
+	result = tmpfs_dir_add(dir, name, tn);
+	if (result == 0) {
+		tn->tn_linkcount++;
+	}
+
+	lock_release(tmpfs->tmpfs_lock);
+	return result;
+}
+
+/*
+ * Delete a file. As with other files, it may not actually go away if
+ * it's currently open.
+ */
+static
+int
+tmpfs_remove(struct vnode *dirvn, const char *name)
+{
+	struct tmpfs_node *dir = dirvn->vn_data;
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_direntry *dent;
+	struct tmpfs_node *tn;
+	unsigned slot;
+	bool drop;
+
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return EISDIR;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+
+	dent = tmpfs_dir_find(dir, name, &slot);
+	if (dent == NULL) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOENT;
+	}
+	tn = dent->td_node;
+	if (tn->tn_isdir) {
+		lock_release(tmpfs->tmpfs_lock);
+		return EISDIR;
+	}
+
+	tmpfs_dir_unlink(dir, slot);
+	drop = tmpfs_unlinknode(tn);
+
+	lock_release(tmpfs->tmpfs_lock);
+
+	if (drop) {
+		VOP_DECREF(&tn->tn_absvn);
+	}
+	return 0;
+}
+
+/*
+ * Remove an empty directory.
+ */
+static
+int
+tmpfs_rmdir(struct vnode *dirvn, const char *name)
+{
+	struct tmpfs_node *dir = dirvn->vn_data;
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_direntry *dent;
+	struct tmpfs_node *tn;
+	unsigned slot;
+	bool drop;
+
+	if (!strcmp(name, ".")) {
+		return EINVAL;
+	}
+	if (!strcmp(name, "..")) {
+		return ENOTEMPTY;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+
+	dent = tmpfs_dir_find(dir, name, &slot);
+	if (dent == NULL) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOENT;
+	}
+	tn = dent->td_node;
+	if (!tn->tn_isdir) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOTDIR;
+	}
+	if (!tmpfs_dir_isempty(tn)) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOTEMPTY;
+	}
+
+	tmpfs_dir_unlink(dir, slot);
+	drop = tmpfs_unlinknode(tn);
+
+	lock_release(tmpfs->tmpfs_lock);
+
+	if (drop) {
+		VOP_DECREF(&tn->tn_absvn);
+	}
+	return 0;
+}
+
+/*
+ * Rename. Since the whole namespace is under tmpfs_lock, moving
+ * things between directories needs no special care beyond not
+ * moving a directory underneath itself.
+ */
+static
+int
+tmpfs_rename(struct vnode *dirvn1, const char *name1,
+	     struct vnode *dirvn2, const char *name2)
+{
+	struct tmpfs_node *dir1 = dirvn1->vn_data;
+	struct tmpfs_node *dir2 = dirvn2->vn_data;
+	struct tmpfs *tmpfs = dir1->tn_tmpfs;
+	struct tmpfs_direntry *dent1, *dent2;
+	struct tmpfs_node *tn, *p, *victim = NULL;
+	unsigned slot1;
+	bool drop = false;
+	int result;
+
+	if (!strcmp(name1, ".") || !strcmp(name1, "..") ||
+	    !strcmp(name2, ".") || !strcmp(name2, "..")) {
+		return EINVAL;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+
+	if (dir1->tn_linkcount == 0 || dir2->tn_linkcount == 0) {
+		result = ENOENT;
+		goto out;
+	}
+
+	dent1 = tmpfs_dir_find(dir1, name1, &slot1);
+	if (dent1 == NULL) {
+		result = ENOENT;
+		goto out;
+	}
+	tn = dent1->td_node;
+
+	dent2 = tmpfs_dir_find(dir2, name2, NULL);
+	victim = dent2 != NULL ? dent2->td_node : NULL;
+	if (victim == tn) {
+		/* Two names for the same file; nothing to do */
+		result = 0;
+		goto out;
+	}
+
+	if (tn->tn_isdir) {
+		for (p = dir2; p != tmpfs->tmpfs_root; p = p->tn_parent) {
+			if (p == tn) {
+				result = EINVAL;
+				goto out;
+			}
+		}
+	}
+
+	if (victim != NULL) {
+		if (victim->tn_isdir && !tn->tn_isdir) {
+			result = EISDIR;
+			goto out;
+		}
+		if (!victim->tn_isdir && tn->tn_isdir) {
+			result = ENOTDIR;
+			goto out;
+		}
+		if (victim->tn_isdir && !tmpfs_dir_isempty(victim)) {
+			result = ENOTEMPTY;
+			goto out;
+		}
+
+		/* Point the existing entry at the new file */
+		dent2->td_node = tn;
+		drop = tmpfs_unlinknode(victim);
+	}
+	else {
+		result = tmpfs_dir_add(dir2, name2, tn);
+		if (result) {
+			goto out;
+		}
+	}
+
+	tmpfs_dir_unlink(dir1, slot1);
+	if (tn->tn_isdir) {
+		dir1->tn_nsubdirs--;
+		dir2->tn_nsubdirs++;
+		tn->tn_parent = dir2;
+	}
+	result = 0;
+
+ out:
+	lock_release(tmpfs->tmpfs_lock);
+	if (drop) {
+		VOP_DECREF(&victim->tn_absvn);
+	}
+	return result;
+}
+
+/*
+ * Lookup: get a node by name. The VFS layer hands us one path
+ * component at a time.
+ */
+static
+int
+tmpfs_lookup(struct vnode *dirvn, char *path, struct vnode **ret)
+{
+	struct tmpfs_node *dir = dirvn->vn_data;
+	struct tmpfs *tmpfs = dir->tn_tmpfs;
+	struct tmpfs_direntry *dent;
+	struct tmpfs_node *tn;
+
+	if (!strcmp(path, ".")) {
+		VOP_INCREF(dirvn);
+		*ret = dirvn;
+		return 0;
+	}
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	if (!strcmp(path, "..")) {
+		tn = dir->tn_parent;
+	}
+	else {
+		dent = tmpfs_dir_find(dir, path, NULL);
+		tn = dent != NULL ? dent->td_node : NULL;
+	}
+	if (tn == NULL) {
+		lock_release(tmpfs->tmpfs_lock);
+		return ENOENT;
+	}
+	VOP_INCREF(&tn->tn_absvn);
+	lock_release(tmpfs->tmpfs_lock);
+
+	*ret = &tn->tn_absvn;
+	return 0;
+}
+
+/*
+ * Lookparent: the VFS layer has already walked to the directory, so
+ * just return it and copy the name.
+ */
+static
+int
+tmpfs_lookparent(struct vnode *dirvn, char *path,
+		 struct vnode **ret, char *namebuf, size_t bufmax)
+{
+	if (strlen(path)+1 > bufmax) {
+		return ENAMETOOLONG;
+	}
+	strcpy(namebuf, path);
+
+	VOP_INCREF(dirvn);
+	*ret = dirvn;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vnode lifecycle operations
+
+/*
+ * Reclaim. This only happens once the node has no names left and
+ * nobody is using it, so it can't be found again; destroy it.
+ */
+static
+int
+tmpfs_reclaim(struct vnode *vn)
+{
+	struct tmpfs_node *tn = vn->vn_data;
+	struct tmpfs *tmpfs = tn->tn_tmpfs;
+
+	KASSERT(tn->tn_linkcount == 0);
+
+	lock_acquire(tmpfs->tmpfs_lock);
+	KASSERT(tmpfs->tmpfs_nnodes > 0);
+	tmpfs->tmpfs_nnodes--;
+	lock_release(tmpfs->tmpfs_lock);
+
+	tmpfs_node_destroy(tn);
+	return 0;
+}
+
+/*
+ * Vnode ops table for dirs.
+ */
+static const struct vnode_ops tmpfs_dirops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = tmpfs_eachopendir,
+	.vop_reclaim = tmpfs_reclaim,
+
+	.vop_read = vopfail_uio_isdir,
+	.vop_readlink = vopfail_uio_isdir,
+	.vop_getdirentry = tmpfs_getdirentry,
+	.vop_write = vopfail_uio_isdir,
+	.vop_ioctl = tmpfs_ioctl,
+	.vop_stat = tmpfs_stat,
+	.vop_gettype = tmpfs_gettype,
+	.vop_isseekable = tmpfs_isseekable,
+	.vop_fsync = tmpfs_fsync,
+	.vop_mmap = vopfail_mmap_isdir,
+	.vop_truncate = vopfail_truncate_isdir,
+	.vop_namefile = tmpfs_namefile,
+
+	.vop_creat = tmpfs_creat,
+	.vop_symlink = vopfail_symlink_nosys,
+	.vop_mkdir = tmpfs_mkdir,
+	.vop_link = tmpfs_link,
+	.vop_remove = tmpfs_remove,
+	.vop_rmdir = tmpfs_rmdir,
+	.vop_rename = tmpfs_rename,
+	.vop_lookup = tmpfs_lookup,
+	.vop_lookparent = tmpfs_lookparent,
+};
+
+/*
+ * Vnode ops table for files.
+ */
+static const struct vnode_ops tmpfs_fileops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = tmpfs_eachopen,
+	.vop_reclaim = tmpfs_reclaim,
+
+	.vop_read = tmpfs_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = tmpfs_write,
+	.vop_ioctl = tmpfs_ioctl,
+	.vop_stat = tmpfs_stat,
+	.vop_gettype = tmpfs_gettype,
+	.vop_isseekable = tmpfs_isseekable,
+	.vop_fsync = tmpfs_fsync,
+	.vop_mmap = vopfail_mmap_nosys,
+	.vop_truncate = tmpfs_truncate,
+	.vop_namefile = vopfail_uio_notdir,
+
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
+
+/*
+ * Constructor for tmpfs nodes. The new node has no names, and its
+ * vnode has one reference, which belongs to the caller. Call with
+ * tmpfs_lock held, except when creating the root.
+ */
+struct tmpfs_node *
+tmpfs_node_create(struct tmpfs *tmpfs, bool isdir)
+{
+	struct tmpfs_node *tn;
+	int result;
+
+	tn = kmalloc(sizeof(*tn));
+	if (tn == NULL) {
+		return NULL;
+	}
+
+	tn->tn_tmpfs = tmpfs;
+	tn->tn_ino = tmpfs->tmpfs_nextino++;
+	tn->tn_isdir = isdir;
+	tn->tn_linkcount = 0;
+	tn->tn_parent = NULL;
+	tn->tn_dents = NULL;
+	tn->tn_nsubdirs = 0;
+	tn->tn_lock = NULL;
+	tn->tn_size = 0;
+	tn->tn_pages = NULL;
+	tn->tn_maxpages = 0;
+	tn->tn_npages = 0;
+
+	if (isdir) {
+		tn->tn_dents = tmpfs_direntryarray_create();
+		if (tn->tn_dents == NULL) {
+			kfree(tn);
+			return NULL;
+		}
+	}
+	else {
+		tn->tn_lock = lock_create("tmpfs file");
+		if (tn->tn_lock == NULL) {
+			kfree(tn);
+			return NULL;
+		}
+	}
+
+	result = vnode_init(&tn->tn_absvn,
+			    isdir ? &tmpfs_dirops : &tmpfs_fileops,
+			    &tmpfs->tmpfs_absfs, tn);
+	/* vnode_init doesn't actually fail */
+	KASSERT(result == 0);
+
+	tmpfs->tmpfs_nnodes++;
+	return tn;
+}
+
+/*
+ * Destructor for tmpfs nodes. Releases the file's pages.
+ */
+void
+tmpfs_node_destroy(struct tmpfs_node *tn)
+{
+	if (tn->tn_isdir) {
+		KASSERT(tmpfs_dir_isempty(tn));
+		tmpfs_direntryarray_setsize(tn->tn_dents, 0);
+		tmpfs_direntryarray_destroy(tn->tn_dents);
+	}
+	else {
+		tmpfs_truncpages(tn, 0);
+		KASSERT(tn->tn_npages == 0);
+		lock_destroy(tn->tn_lock);
+	}
+	vnode_cleanup(&tn->tn_absvn);
+	kfree(tn);
+}
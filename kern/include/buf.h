@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Disk buffer cache.
+ *
+ * Buffers hold one block of a block device and are named by the pair
+ * (device, block number). A buffer handed out by buffer_read or
+ * buffer_get is "busy": it belongs to the caller until it is given
+ * back with buffer_release, and nobody else can see or evict it in
+ * the meantime. Buffers that have been modified must be marked dirty
+ * before release; they are written back when evicted, or when
+ * buffer_sync is called for their device.
+ *
+ * Idle buffers are kept on an LRU list and the least recently used
+ * one is recycled when a new block is needed and the cache is full.
+ *
+ * A dirty buffer can also belong to an owner (a struct bufowner,
+ * normally embedded in a file's in-memory inode), which keeps a list
+ * of its dirty buffers so they can be written back by themselves,
+ * e.g. for fsync. A buffer leaves the list when it's written back or
+ * dropped, or when marked dirty for a different owner.
+ *
+ * A dirty buffer can be pinned, which keeps it in memory and keeps it
+ * from being written back until it's unpinned. A journaling fs pins
+ * the buffers a transaction changed until the transaction has been
+ * committed to its log.
+ *
+ * Functions:
+ *    buffer_bootstrap - set up the cache at boot time.
+ *    buffer_read      - get a busy buffer for BLOCK of DEV, reading
+ *                       it from disk if not already cached.
+ *    buffer_get       - same, but don't read it; for callers that are
+ *                       about to overwrite the whole block. If the
+ *                       block was not cached the contents are zero.
+ *    buffer_map       - return a pointer to the buffer's data.
+ *    buffer_mark_dirty - note that the buffer contents were changed.
+ *    buffer_mark_dirty_owner - same, and put it on BO's dirty list.
+ *    buffer_release   - give back a busy buffer.
+ *    buffer_readahead - start reading BLOCK of DEV into the cache in
+ *                       the background, if it isn't already there.
+ *                       Does not wait; if the read-ahead queue is
+ *                       full the request is just dropped.
+ *    buffer_drop      - discard any cached copy of BLOCK of DEV
+ *                       without writing it, e.g. when freed.
+ *    buffer_sync      - write back all dirty buffers for DEV.
+ *    buffer_writeback - write back up to MAX buffers (on any device)
+ *                       that have been dirty for MAXAGE seconds or
+ *                       more, all at once; returns how many. Used by
+ *                       the syncer thread.
+ *    buffer_invalidate - sync and then discard all buffers for DEV;
+ *                       used at unmount time.
+ *    buffer_simcrash  - for testing: drop every write to DEV from now
+ *                       until the next buffer_invalidate of DEV, as
+ *                       if the system had crashed.
+ *    bufowner_init    - initialize an owner with no dirty buffers.
+ *    buffer_sync_owner - write back the dirty buffers belonging to BO.
+ *    buffer_disown    - take everything off BO's dirty list; call it
+ *                       before BO goes away. The buffers stay dirty.
+ *    buffer_pin       - pin a busy dirty buffer.
+ *    buffer_unpin     - unpin BLOCK of DEV, if it's cached and pinned.
+ *                       Dropping a pinned buffer also unpins it.
+ *    buffer_printstats - print hit/miss and read-ahead counters.
+ */
+
+struct device;
+struct buf;
+
+struct bufowner {
+	struct buf *bo_dirty;		/* dirty buffers (buffer cache locks) */
+};
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+void *buffer_map(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_mark_dirty_owner(struct buf *b, struct bufowner *bo);
+void buffer_release(struct buf *b);
+void buffer_readahead(struct device *dev, daddr_t block);
+
+void buffer_drop(struct device *dev, daddr_t block);
+int buffer_sync(struct device *dev);
+unsigned buffer_writeback(time_t maxage, unsigned max);
+int buffer_invalidate(struct device *dev);
+void buffer_simcrash(struct device *dev);
+
+void bufowner_init(struct bufowner *bo);
+int buffer_sync_owner(struct bufowner *bo);
+void buffer_disown(struct bufowner *bo);
+
+void buffer_pin(struct buf *b);
+void buffer_unpin(struct device *dev, daddr_t block);
+
+void buffer_printstats(void);
+
+
+#endif /* _BUF_H_ */
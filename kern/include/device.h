@@ -37,6 +37,28 @@
 
 struct uio;  /* in <uio.h> */
 
+/*
+ * Asynchronous block I/O request, for dev_submit.
+ *
+ * The caller fills in the first group of fields and then must leave
+ * the request alone until dr_done is called with the result. dr_done
+ * may be called from an interrupt handler, so it must not sleep; it
+ * may submit further requests.
+ */
+struct devreq {
+	off_t dr_offset;		/* byte offset on device */
+	void *dr_data;			/* kernel buffer */
+	size_t dr_len;			/* length in bytes */
+	bool dr_write;			/* true to write, false to read */
+	void (*dr_done)(struct devreq *, int result);
+	void *dr_arg;			/* for use by dr_done */
+
+	/* Private to the device driver and I/O scheduler (iosched.h) */
+	struct devreq *dr_next;		/* request queue */
+	struct devreq *dr_mergenext;	/* requests merged with this one */
+	uint64_t dr_qtime;		/* when queued, in microseconds */
+};
+
 /*
  * Filesystem-namespace-accessible device.
  */
@@ -56,11 +78,13 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_submit - queue a struct devreq (optional; may be NULL)
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	void (*devop_submit)(struct device *, struct devreq *);
 };
 
 /*
@@ -69,6 +93,14 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_SUBMIT(d, r)	((d)->d_ops->devop_submit(d, r))
+
+/*
+ * Start an asynchronous block I/O. For devices that don't have a
+ * request queue this does the I/O synchronously with devop_io and
+ * then calls the completion function.
+ */
+void dev_submit(struct device *dev, struct devreq *req);
 
 
 /* Create vnode for a vfs-level device. */
@@ -79,6 +111,7 @@ void dev_uncreate_vnode(struct vnode *vn);
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
+void devzero_create(void);
 
 /* Function that kicks off device probe and attach. */
 void dev_bootstrap(void);
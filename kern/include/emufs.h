@@ -37,6 +37,11 @@
 #include <fs.h>
 #include <vnode.h>
 
+/*
+ * Size of the page cache (pages of file data).
+ */
+#define EMUFS_CACHEPAGES	32
+
 /*
  * Our structures
  */
@@ -47,11 +52,25 @@ struct emufs_vnode {
 	uint32_t ev_handle;		/* file handle */
 };
 
+struct emufs_cpage {
+	char *cp_data;			/* contents; NULL if slot unused */
+	uint32_t cp_handle;		/* file handle */
+	uint32_t cp_offset;		/* page-aligned offset in file */
+	uint32_t cp_len;		/* valid bytes; short at EOF */
+	unsigned cp_stamp;		/* last use, for LRU */
+	unsigned cp_busy;		/* readers copying out of it */
+	bool cp_stale;			/* dropped; free when not busy */
+};
+
 struct emufs_fs {
 	struct fs ef_fs;		/* abstract filesystem structure */
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+
+	struct lock *ef_cachelock;	/* protects ef_cache */
+	struct emufs_cpage ef_cache[EMUFS_CACHEPAGES];
+	unsigned ef_cachestamp;
 };
 
 
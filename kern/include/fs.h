@@ -51,6 +51,11 @@ struct fs {
  *      fsop_getvolname - Return volume name of filesystem.
  *      fsop_getroot    - Return root vnode of filesystem.
  *      fsop_unmount    - Attempt unmount of filesystem.
+ *      fsop_writeback  - Called periodically by the syncer thread;
+ *                        push metadata that was already dirty at the
+ *                        previous call toward disk (e.g. into the
+ *                        buffer cache, which writes it back once it's
+ *                        old enough). May be NULL.
  *
  * fsop_getvolname may return NULL on filesystem types that don't
  * support the concept of a volume name. The string returned is
@@ -74,6 +79,7 @@ struct fs_ops {
 	const char   *(*fsop_getvolname)(struct fs *);
 	int           (*fsop_getroot)(struct fs *, struct vnode **);
 	int           (*fsop_unmount)(struct fs *);
+	int           (*fsop_writeback)(struct fs *);
 };
 
 /*
@@ -83,9 +89,11 @@ struct fs_ops {
 #define FSOP_GETVOLNAME(fs)  ((fs)->fs_ops->fsop_getvolname(fs))
 #define FSOP_GETROOT(fs, ret) ((fs)->fs_ops->fsop_getroot(fs, ret))
 #define FSOP_UNMOUNT(fs)     ((fs)->fs_ops->fsop_unmount(fs))
+#define FSOP_WRITEBACK(fs)   ((fs)->fs_ops->fsop_writeback(fs))
 
 /* Initialization functions for builtin fake file systems. */
 void semfs_bootstrap(void);
+void tmpfs_bootstrap(void);
 
 
 #endif /* _FS_H_ */
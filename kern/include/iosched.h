@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+/*
+ * Disk I/O scheduling.
+ *
+ * A block driver with a request queue keeps its pending requests
+ * (struct devreq, see device.h) in a struct iosched, and asks it
+ * which one to start whenever the disk goes idle. The policy that
+ * decides is pluggable and can be changed per device at run time:
+ *
+ *    fifo     - arrival order.
+ *    clook    - elevator: the lowest request at or beyond the end of
+ *               the last one started; when there are none, wrap
+ *               around to the lowest request overall.
+ *    deadline - clook, except that a request that has been waiting
+ *               longer than its deadline goes first. Reads expire
+ *               sooner than writes, since someone is usually waiting
+ *               for a read.
+ *
+ * Whatever the policy, a request that continues a pending one in the
+ * same direction is merged onto that one's run (see dr_mergenext in
+ * device.h), so they go to the disk back to back.
+ *
+ * The driver's lock, passed to iosched_init, protects the structure;
+ * it must be held when calling iosched_add, iosched_next, and
+ * iosched_done. iosched_setpolicy and iosched_printstats take it
+ * themselves.
+ *
+ * Functions:
+ *    iosched_init      - set up for device NAME, with runs of at most
+ *                        MAXRUN bytes.
+ *    iosched_add       - queue a request, merging it onto ACTIVE (the
+ *                        run in progress, or NULL) or a pending run
+ *                        if it can be. The run in progress is capped
+ *                        at MAXRUN bytes counted from when it was
+ *                        started, not from where the driver is now.
+ *    iosched_next      - remove and return the next run to start, or
+ *                        NULL if there's nothing to do.
+ *    iosched_done      - note that a request has finished.
+ *    iosched_setpolicy - select the policy for the device called NAME.
+ *    iosched_printstats - print queue depth and latency for all devices.
+ */
+
+struct spinlock;
+struct devreq;
+struct iosched_policy;
+
+struct iosched {
+	const char *is_name;		/* device name */
+	struct spinlock *is_lock;	/* driver lock that protects us */
+	const struct iosched_policy *is_policy;
+	struct devreq *is_queue;	/* pending runs, in arrival order */
+	off_t is_headpos;		/* end of the last run started */
+	size_t is_maxrun;		/* longest run to merge, in bytes */
+	size_t is_runlen;		/* bytes in the run last started */
+
+	/* Statistics */
+	unsigned is_depth;		/* requests pending or in progress */
+	unsigned is_maxdepth;		/* highest is_depth seen */
+	uint64_t is_depthsum;		/* is_depth summed at each arrival */
+	unsigned is_nreqs;		/* requests submitted */
+	unsigned is_nmerged;		/* ... of which were merged */
+	unsigned is_nexpired;		/* runs started because of deadline */
+	unsigned is_ndone;		/* requests completed */
+	uint64_t is_latsum;		/* their total latency, usec */
+	uint64_t is_latmax;		/* worst latency, usec */
+};
+
+void iosched_init(struct iosched *is, const char *name,
+		  struct spinlock *lock, size_t maxrun);
+void iosched_add(struct iosched *is, struct devreq *req,
+		 struct devreq *active);
+struct devreq *iosched_next(struct iosched *is);
+void iosched_done(struct iosched *is, struct devreq *req);
+
+int iosched_setpolicy(const char *name, const char *policy);
+void iosched_printstats(void);
+
+
+#endif /* _IOSCHED_H_ */
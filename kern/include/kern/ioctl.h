@@ -34,6 +34,13 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/*
+ * Console input mode. The argument points to an int: nonzero for raw
+ * mode (each character is returned as typed, without echo), zero for
+ * line mode (the console echoes and handles backspace, ^U, and ^W,
+ * and reads return at most one line).
+ */
+#define CONSOLE_IOCTL_SETRAW	1
+#define CONSOLE_IOCTL_GETRAW	2
 
 #endif /* _KERN_IOCTL_H_*/
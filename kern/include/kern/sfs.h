@@ -41,8 +41,8 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
@@ -62,6 +62,36 @@
 /* Size of free block bitmap (in blocks) */
 #define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
 
+/*
+ * Journal (see below). A volume without one has sb_journalblocks 0.
+ * mksfs gives a volume a journal of SFS_JOURNALBLOCKS(nblocks) blocks,
+ * placed right after the freemap, if that is at least
+ * SFS_JOURNAL_MINBLOCKS.
+ */
+#define SFS_JOURNAL_MINBLOCKS  256
+#define SFS_JOURNAL_MAXBLOCKS  1024
+#define SFS_JOURNALBLOCKS(nblocks) \
+    ((nblocks)/16 > SFS_JOURNAL_MAXBLOCKS ? SFS_JOURNAL_MAXBLOCKS : \
+     (nblocks)/16 < SFS_JOURNAL_MINBLOCKS ? 0 : (nblocks)/16)
+
+#define SFS_JMAGIC_HEADER 0x4a524e4c    /* journal header ("JRNL") */
+#define SFS_JMAGIC_DESC   0x4a444553    /* descriptor block ("JDES") */
+#define SFS_JMAGIC_COMMIT 0x4a434d54    /* commit block ("JCMT") */
+
+/* # of block numbers in a journal descriptor block */
+#define SFS_JDESCMAX      ((SFS_BLOCKSIZE - 4*sizeof(uint32_t)) / \
+			   sizeof(uint32_t))
+
+/*
+ * Inline data. A regular file with SFS_IFLAG_INLINE set in sfi_flags
+ * keeps its contents in sfi_inline instead of in data blocks; its
+ * size is at most SFS_INLINESIZE and all its block pointers are 0.
+ * The bytes of sfi_inline past the end of the file are 0. Inodes
+ * without the flag leave sfi_inline zeroed.
+ */
+#define SFS_INLINESIZE    ((128-6-SFS_NDIRECT) * sizeof(uint32_t))
+#define SFS_IFLAG_INLINE  0x1     /* file data is in sfi_inline */
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -74,7 +104,9 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_journalstart;		/* First block of journal */
+	uint32_t sb_journalblocks;		/* # of journal blocks, or 0 */
+	uint32_t reserved[116];			/* unused, set to 0 */
 };
 
 /*
@@ -86,7 +118,10 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IFLAG_* */
+	char sfi_inline[SFS_INLINESIZE];	/* Inline data, or 0 */
 };
 
 /*
@@ -97,5 +132,45 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Journal.
+ *
+ * The journal is a metadata write-ahead log. Its first block is the
+ * header; the rest is the log proper, whose blocks are numbered from
+ * 0. The log holds a sequence of transactions, each of which is a
+ * descriptor block, a copy of each block the transaction changed,
+ * and a commit block, all consecutive. Transactions have consecutive
+ * sequence numbers; the header says where the first one that may
+ * not have reached its home locations yet starts and what its number
+ * is. A transaction counts only if its descriptor and commit block
+ * both carry the expected sequence number.
+ *
+ * The descriptor lists the home block numbers of the copies that
+ * follow it (jd_nblocks of them), then the blocks the transaction
+ * freed (jd_nrevoke of them). A freed block must not be overwritten
+ * from an older transaction's copy when the log is replayed, as it
+ * may since have been reused for file data, which isn't logged.
+ */
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JMAGIC_HEADER */
+	uint32_t jh_seq;			/* Seq # of first transaction */
+	uint32_t jh_start;			/* Where it is in the log */
+	uint32_t jh_reserved[125];		/* unused, set to 0 */
+};
+
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_JMAGIC_DESC */
+	uint32_t jd_seq;			/* Transaction seq # */
+	uint32_t jd_nblocks;			/* # of block copies */
+	uint32_t jd_nrevoke;			/* # of freed blocks */
+	uint32_t jd_blocks[SFS_JDESCMAX];	/* Copied, then freed, blocks */
+};
+
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JMAGIC_COMMIT */
+	uint32_t jc_seq;			/* Transaction seq # */
+	uint32_t jc_reserved[126];		/* unused, set to 0 */
+};
+
 
 #endif /* _KERN_SFS_H_ */
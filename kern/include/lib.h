@@ -125,6 +125,10 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_profstart starts the heap profiler, which tracks one in
+ * RATE allocations by call site; kheap_profstop stops it, and
+ * kheap_profdump prints the MAXSITES sites holding the most memory.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +136,9 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_profstart(unsigned rate);
+void kheap_profstop(void);
+void kheap_profdump(unsigned maxsites);
 
 /*
  * C string functions.
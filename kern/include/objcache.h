@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * An object cache hands out fixed-size objects of one type and keeps
+ * a limited number of freed ones around for reuse. Objects in the
+ * cache stay "constructed": the constructor is run once when an
+ * object is first allocated and the destructor once when it is
+ * finally released back to kmalloc, not on every get and put. So a
+ * structure that contains locks or CVs gets them created once and
+ * recycled along with it. The caller must therefore put objects back
+ * in the constructed state (locks released, no CV waiters, etc.);
+ * per-use fields are its own business and are reinitialized after
+ * objcache_get as before.
+ *
+ * Functions:
+ *    objcache_create   - create a cache named NAME for objects of SIZE
+ *                        bytes, keeping at most MAXFREE free objects.
+ *                        CTOR (may be null) sets up a fresh object and
+ *                        returns an error code; DTOR (may be null)
+ *                        undoes it. Panics if out of memory, as it's
+ *                        meant for use at bootstrap time.
+ *    objcache_get      - get an object; returns NULL if out of memory.
+ *    objcache_put      - give back an object.
+ *    objcache_printstats - print usage counters for all caches.
+ */
+
+struct objcache;
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 unsigned maxfree,
+				 int (*ctor)(void *obj),
+				 void (*dtor)(void *obj));
+void *objcache_get(struct objcache *oc);
+void objcache_put(struct objcache *oc, void *obj);
+
+void objcache_printstats(void);
+
+
+#endif /* _OBJCACHE_H_ */
@@ -41,6 +41,7 @@
  */
 #include <fs.h>
 #include <vnode.h>
+#include <buf.h>
 
 /*
  * Get on-disk structures and constants that are made available to
@@ -48,14 +49,79 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * There is no global lock. Instead:
+ *
+ *    sv_lock (per vnode) protects the in-memory inode and everything
+ *    else in struct sfs_vnode, and the file's contents: its data
+ *    blocks, indirect blocks, and, for a directory, its entries.
+ *
+ *    sfs_vnlock (per fs) protects the table of loaded vnodes (and
+ *    sv_hashnext, which links them into it, and sv_busy). It is
+ *    held while looking up or adding a vnode, and while deciding to
+ *    reclaim one, so a vnode can't be found and reclaimed at once.
+ *    It is not held across disk I/O: a vnode being loaded or
+ *    reclaimed sits in the table with sv_busy set, and anyone who
+ *    finds it waits on sfs_vncv until it's ready or gone.
+ *
+ *    sfs_dirtylock (per fs) protects the list of vnodes with dirty
+ *    inodes (and sv_dirtynext/sv_dirtyprev). A vnode is on the list
+ *    exactly when sv_dirty is set; use sfs_dirtyinode to set it.
+ *
+ *    sfs_freemaplock (per fs) protects the free block bitmap and the
+ *    superblock.
+ *
+ *    The journal, if any, has its own lock (see sfs_journal.c).
+ *    Operations that change metadata call sfs_jbegin before taking
+ *    any sv_lock.
+ *
+ * Lock ordering: a directory's sv_lock comes before the sv_lock of
+ * anything in it; any sv_lock comes before sfs_vnlock, which comes
+ * before sfs_dirtylock and sfs_freemaplock. The journal lock comes
+ * after sv_lock and sfs_vnlock and before sfs_freemaplock. The
+ * buffer cache's own lock comes after all of these. Never take an
+ * sv_lock while holding sfs_vnlock; to visit every loaded vnode,
+ * take references under sfs_vnlock and lock the vnodes after letting
+ * it go.
+ */
+
+struct lock;
+struct sfs_journal;
+
 /*
  * In-memory inode
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct lock *sv_lock;           /* protects everything below */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	bool sv_dirtyseen;              /* sv_dirty at last writeback pass */
+	struct sfs_vnode *sv_dirtyprev; /* dirty vnode list */
+	struct sfs_vnode *sv_dirtynext;
+	struct bufowner sv_bufs;        /* our dirty buffers */
+	struct sfs_vnode *sv_hashnext;  /* vnode table chain */
+	bool sv_busy;                   /* being loaded or reclaimed */
+
+	/* Sequential read detection (see sfs_io.c) */
+	off_t sv_rapos;                 /* where the last read ended */
+	unsigned sv_rawindow;           /* current read-ahead, in blocks */
+	uint32_t sv_radone;             /* blocks below this already queued */
+
+	/* Last leaf indirect block used by sfs_bmap (see sfs_bmap.c) */
+	uint32_t sv_bmapbase;           /* first file block it maps */
+	daddr_t sv_bmapblock;           /* its disk block; 0 if none */
+
+	/* Block allocation hints (see sfs_balloc.c) */
+	daddr_t sv_lastalloc;           /* last block allocated to us */
+	daddr_t sv_resvnext;            /* next reserved block */
+	daddr_t sv_resvend;             /* end of reserved blocks */
+
+	/* Name index for directories, built on demand (see sfs_dir.c) */
+	struct sfs_dirindex *sv_dirindex;
 };
 
 /*
@@ -65,10 +131,27 @@ struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
+	bool sfs_superseen;             /* ...at the last writeback pass */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects vnode table */
+	struct cv *sfs_vncv;            /* for sv_busy */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded into memory */
+	unsigned sfs_vnhashsize;        /* # of buckets; power of 2 */
+	unsigned sfs_nvnodes;           /* # of vnodes in table */
+	unsigned sfs_vnlookups;         /* # of table lookups */
+	unsigned sfs_vnprobes;          /* # of vnodes examined by them */
+	struct lock *sfs_dirtylock;     /* protects dirty vnode list */
+	struct sfs_vnode *sfs_dirtyvnodes; /* vnodes with sv_dirty set */
+	unsigned sfs_ndirty;            /* # of them */
+	struct lock *sfs_freemaplock;   /* protects freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	bool sfs_freemapseen;           /* ...at the last writeback pass */
+	struct bitmap *sfs_freemapdirtymap; /* which freemap blocks changed */
+	unsigned sfs_freemapsyncs;      /* # of times freemap written */
+	unsigned sfs_freemapwrites;     /* # of freemap blocks written */
+	struct sfs_journal *sfs_journal; /* metadata log, or NULL if none */
+	bool sfs_crashed;               /* testing: drop all writes */
 };
 
 /*
@@ -76,5 +159,12 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * For testing: make FS act as if the system crashed just now. No
+ * more writes reach the disk; the volume should then be unmounted
+ * and mounted again to recover. Fails with EINVAL if FS isn't sfs.
+ */
+int sfs_simcrash(struct fs *fs);
+
 
 #endif /* _SFS_H_ */
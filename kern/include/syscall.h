@@ -90,6 +90,7 @@ int sys_rename(userptr_t oldpath, userptr_t newpath);
 int sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval);
 int sys_fstat(int fd, userptr_t statptr);
 int sys_fsync(int fd);
+int sys_ioctl(int fd, int code, userptr_t data);
 int sys_ftruncate(int fd, off_t len);
 
 #endif /* _SYSCALL_H_ */
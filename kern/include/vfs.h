@@ -183,6 +183,40 @@ int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
 int vfs_unmountall(void);
 
+/*
+ * Name lookup cache (vfsnamecache.c).
+ *
+ *    vfs_namecache_bootstrap - set up the cache at boot time.
+ *    vfs_namecache_lookup - look up NAME in DIR. Returns true if the
+ *                     answer is cached: *RESULT is then a referenced
+ *                     vnode, or NULL if NAME is known not to exist.
+ *    vfs_namecache_gen - get the invalidation count; call before
+ *                     asking the filesystem and pass the result to
+ *                     vfs_namecache_enter.
+ *    vfs_namecache_enter - cache the result (VN, or NULL for "no
+ *                     such file") of looking up NAME in DIR.
+ *    vfs_namecache_remove - forget NAME in DIR, because it has been
+ *                     created, removed, or renamed.
+ *    vfs_namecache_purgefs - forget everything on FS (for unmount).
+ *    vfs_namecache_printstats - print hit rates.
+ *
+ * Names of VFS_NCNAMELEN characters or more, and "." and "..", are
+ * never cached; vfs_namecache_lookup always says to ask the
+ * filesystem about them, and vfs_namecache_enter ignores them.
+ */
+
+#define VFS_NCNAMELEN 32
+
+void vfs_namecache_bootstrap(void);
+bool vfs_namecache_lookup(struct vnode *dir, const char *name,
+			  struct vnode **result);
+unsigned vfs_namecache_gen(void);
+void vfs_namecache_enter(struct vnode *dir, const char *name,
+			 struct vnode *vn, unsigned gen);
+void vfs_namecache_remove(struct vnode *dir, const char *name);
+void vfs_namecache_purgefs(struct fs *fs);
+void vfs_namecache_printstats(void);
+
 /*
  * Array of vnodes.
  */
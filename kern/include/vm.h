@@ -52,6 +52,11 @@ int copy_pt(paddr_t ** pt_original, paddr_t ** pt_copy);
 void destroy_pt(paddr_t ** pt);
 bool pte_exists(paddr_t ** pt, uint32_t msb, uint32_t lsb);
 
+/* Region allocation (from an object cache) */
+struct region;
+struct region *region_alloc(void);
+void region_free(struct region *r);
+
 /* Initialization function */
 void vm_bootstrap(void);
 
@@ -62,6 +67,10 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Frame owner of a kernel heap page, for kfree (with OPT_UNSW only) */
+void kpage_setowner(vaddr_t addr, void *owner);
+void *kpage_getowner(vaddr_t addr);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
@@ -121,8 +121,8 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 int
 uiomovezeros(size_t n, struct uio *uio)
 {
-	/* static, so initialized as zero */
-	static char zeros[16];
+	/* static, so initialized as zero; a page, so big reads are cheap */
+	static char zeros[4096];
 	size_t amt;
 	int result;
 
@@ -47,6 +47,7 @@
 #include <vfs.h>
 #include <device.h>
 #include <pid.h>
+#include <openfile.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -114,6 +115,7 @@ boot(void)
 	pid_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	openfile_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -186,6 +188,13 @@ sys_reboot(int code)
 
 	shutdown();
 
+	/*
+	 * From here on print by polling; this also pushes out any
+	 * console output still buffered, which would otherwise be
+	 * lost when the power goes off.
+	 */
+	splhigh();
+
 	switch (code) {
 		case RB_HALT:
 			kprintf("The system is halted.\n");
@@ -41,6 +41,9 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <buf.h>
+#include <iosched.h>
+#include <objcache.h>
 #include <sfs.h>
 #include <pid.h>
 #include <syscall.h>
@@ -245,6 +248,30 @@ cmd_sync(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for choosing a disk's I/O scheduling policy.
+ */
+static
+int
+cmd_iosched(int nargs, char **args)
+{
+	char *device;
+
+	if (nargs != 3) {
+		kprintf("Usage: iosched device fifo|clook|deadline\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	return iosched_setpolicy(device, args[2]);
+}
+
 /*
  * Command for dropping to the debugger.
  */
@@ -500,6 +527,90 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for the heap profiler.
+ */
+static
+int
+cmd_kheapprof(int nargs, char **args)
+{
+	int n;
+
+	if (nargs == 1) {
+		kheap_profdump(10);
+		return 0;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "top")) {
+		n = atoi(args[2]);
+		if (n > 0) {
+			kheap_profdump(n);
+			return 0;
+		}
+	}
+	else if ((nargs == 2 || nargs == 3) && !strcmp(args[1], "start")) {
+		n = nargs == 3 ? atoi(args[2]) : 16;
+		if (n > 0) {
+			kheap_profstart(n);
+			return 0;
+		}
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		kheap_profstop();
+		return 0;
+	}
+
+	kprintf("Usage: khprof [start [rate] | stop | top count]\n");
+	return EINVAL;
+}
+
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_namecachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_namecache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_iostats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	iosched_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_objcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	objcache_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -539,6 +650,7 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[iosched] Set disk I/O scheduler    ",
 	"[debug]   Drop to debugger          ",
 	"[panic]   Intentional panic         ",
 	"[deadlock] Intentional deadlock     ",
@@ -566,6 +678,8 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kfree timing test             ",
+	"[km6] kmalloc/kfree timing test     ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -584,6 +698,8 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[fs7] FS rename/unlink test         ",
+	"[fs8] SFS journal crash test        ",
 	NULL
 };
 
@@ -606,6 +722,11 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profiler       ",
+	"[bc] Buffer cache stats             ",
+	"[nc] Name cache stats               ",
+	"[io] Disk I/O scheduler stats       ",
+	"[oc] Object cache stats             ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -646,6 +767,7 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "iosched",	cmd_iosched },
 	{ "debug",	cmd_debug },
 	{ "panic",	cmd_panic },
 	{ "deadlock",	cmd_deadlock },
@@ -657,6 +779,11 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprof },
+	{ "bc",         cmd_bufstats },
+	{ "nc",         cmd_namecachestats },
+	{ "io",         cmd_iostats },
+	{ "oc",         cmd_objcachestats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +794,8 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -715,6 +844,8 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "fs7",	renametest },
+	{ "fs8",	journaltest },
 
 	{ NULL, NULL }
 };
@@ -392,6 +392,25 @@ sys_fsync(int fd)
 	return err;
 }
 
+/*
+ * ioctl - call VOP_IOCTL
+ */
+int
+sys_ioctl(int fd, int code, userptr_t data)
+{
+	struct openfile *file;
+	int err;
+
+	err = filetable_get(curproc->p_filetable, fd, &file);
+	if (err) {
+		return err;
+	}
+
+	err = VOP_IOCTL(file->of_vnode, code, data);
+	filetable_put(curproc->p_filetable, fd, file);
+	return err;
+}
+
 /*
  * ftruncate - call VOP_TRUNCATE
  */
@@ -38,6 +38,48 @@
 #include <synch.h>
 #include <vfs.h>
 #include <openfile.h>
+#include <objcache.h>
+
+/*
+ * Cache of openfile structures. The locks are set up once by
+ * openfile_ctor and kept while a structure sits in the cache, so
+ * opening a file doesn't have to create a new offset lock each time.
+ */
+static struct objcache *openfile_cache;
+
+static
+int
+openfile_ctor(void *obj)
+{
+	struct openfile *file = obj;
+
+	file->of_offsetlock = lock_create("openfile");
+	if (file->of_offsetlock == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&file->of_reflock);
+	return 0;
+}
+
+static
+void
+openfile_dtor(void *obj)
+{
+	struct openfile *file = obj;
+
+	spinlock_cleanup(&file->of_reflock);
+	lock_destroy(file->of_offsetlock);
+}
+
+/*
+ * Set up the openfile cache at boot time.
+ */
+void
+openfile_bootstrap(void)
+{
+	openfile_cache = objcache_create("openfile", sizeof(struct openfile),
+					 32, openfile_ctor, openfile_dtor);
+}
 
 /*
  * Constructor for struct openfile.
@@ -53,19 +95,11 @@ openfile_create(struct vnode *vn, int accmode)
 		accmode == O_WRONLY ||
 		accmode == O_RDWR);
 
-	file = kmalloc(sizeof(struct openfile));
+	file = objcache_get(openfile_cache);
 	if (file == NULL) {
 		return NULL;
 	}
 
-	file->of_offsetlock = lock_create("openfile");
-	if (file->of_offsetlock == NULL) {
-		kfree(file);
-		return NULL;
-	}
-
-	spinlock_init(&file->of_reflock);
-
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
 	file->of_offset = 0;
@@ -85,9 +119,7 @@ openfile_destroy(struct openfile *file)
 	/* balance vfs_open with vfs_close (not VOP_DECREF) */
 	vfs_close(file->of_vnode);
 
-	spinlock_cleanup(&file->of_reflock);
-	lock_destroy(file->of_offsetlock);
-	kfree(file);
+	objcache_put(openfile_cache, file);
 }
 
 /*
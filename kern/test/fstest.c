@@ -674,6 +674,198 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+static
+int
+fstest_rename(const char *fs, const char *fromsuffix, const char *tosuffix)
+{
+	char name[32], name2[32];
+	char buf[32], buf2[32];
+	const char *namesuffix;
+	int err;
+
+	namesuffix = fromsuffix;
+	MAKENAME();
+	strcpy(name2, name);
+	namesuffix = tosuffix;
+	MAKENAME();
+
+	/* vfs_rename destroys the strings it's passed */
+	strcpy(buf, name2);
+	strcpy(buf2, name);
+	err = vfs_rename(buf, buf2);
+	if (err) {
+		kprintf("Could not rename %s to %s: %s\n", name2, name,
+			strerror(err));
+		return -1;
+	}
+	kprintf("%s: renamed to %s\n", name2, name);
+	return 0;
+}
+
+/*
+ * Make sure a name is gone.
+ */
+static
+int
+fstest_gone(const char *fs, const char *namesuffix)
+{
+	struct vnode *vn;
+	char name[32];
+	char buf[32];
+	int err;
+
+	MAKENAME();
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDONLY, 0664, &vn);
+	if (err == 0) {
+		kprintf("%s: Test failed: still exists\n", name);
+		vfs_close(vn);
+		return -1;
+	}
+	if (err != ENOENT) {
+		kprintf("%s: Test failed: open gave %s, not ENOENT\n",
+			name, strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Remove a file while it's open, and check that it can still be
+ * read through the open vnode.
+ */
+static
+int
+fstest_openremove(const char *fs, const char *namesuffix)
+{
+	struct vnode *vn;
+	char name[32];
+	char buf[32];
+	struct iovec iov;
+	struct uio ku;
+	int err;
+
+	MAKENAME();
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDONLY, 0664, &vn);
+	if (err) {
+		kprintf("Could not open test file for read: %s\n",
+			strerror(err));
+		return -1;
+	}
+
+	if (fstest_remove(fs, namesuffix) || fstest_gone(fs, namesuffix)) {
+		vfs_close(vn);
+		return -1;
+	}
+
+	uio_kinit(&iov, &ku, buf, strlen(SLOGAN), 0, UIO_READ);
+	err = VOP_READ(vn, &ku);
+	vfs_close(vn);
+	if (err) {
+		kprintf("%s: Read after remove: %s\n", name, strerror(err));
+		return -1;
+	}
+	buf[strlen(SLOGAN) - ku.uio_resid] = 0;
+	if (strcmp(buf, SLOGAN)) {
+		kprintf("%s: Test failed: read after remove got %s\n",
+			name, buf);
+		return -1;
+	}
+	kprintf("%s: still readable after remove\n", name);
+	return 0;
+}
+
+static
+int
+fstest_dir(const char *fs, const char *namesuffix, bool make)
+{
+	char name[32];
+	char buf[32];
+	int err;
+
+	MAKENAME();
+
+	/* vfs_mkdir and vfs_rmdir destroy the string they're passed */
+	strcpy(buf, name);
+	err = make ? vfs_mkdir(buf, 0775) : vfs_rmdir(buf);
+	if (err) {
+		kprintf("Could not %s %s: %s\n", make ? "mkdir" : "rmdir",
+			name, strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+static
+void
+dorenametest(const char *filesys)
+{
+	char name[32];
+	char buf[32];
+	const char *fs = filesys;
+	const char *namesuffix = "-d";
+	int err;
+
+	kprintf("*** Starting rename/unlink test on %s:\n", filesys);
+
+	/* Rename to a new name */
+	if (fstest_write(filesys, "", 1, 0) ||
+	    fstest_rename(filesys, "", "-r") ||
+	    fstest_gone(filesys, "") ||
+	    fstest_read(filesys, "-r")) {
+		goto fail;
+	}
+
+	/* Rename over an existing file */
+	if (fstest_write(filesys, "", 1, 0) ||
+	    fstest_rename(filesys, "-r", "") ||
+	    fstest_gone(filesys, "-r") ||
+	    fstest_read(filesys, "")) {
+		goto fail;
+	}
+
+	/* Rename into a directory, which then can't be removed */
+	if (fstest_dir(filesys, "-d", true) ||
+	    fstest_rename(filesys, "", "-d/f") ||
+	    fstest_gone(filesys, "") ||
+	    fstest_read(filesys, "-d/f")) {
+		goto fail;
+	}
+	MAKENAME();
+	strcpy(buf, name);
+	err = vfs_rmdir(buf);
+	if (err != ENOTEMPTY) {
+		kprintf("%s: Test failed: rmdir of nonempty dir gave %s\n",
+			name, err ? strerror(err) : "success");
+		goto fail;
+	}
+	if (fstest_remove(filesys, "-d/f") ||
+	    fstest_gone(filesys, "-d/f") ||
+	    fstest_dir(filesys, "-d", false) ||
+	    fstest_gone(filesys, "-d")) {
+		goto fail;
+	}
+
+	/* Remove while open */
+	if (fstest_write(filesys, "", 1, 0) ||
+	    fstest_openremove(filesys, "")) {
+		goto fail;
+	}
+
+	kprintf("*** Rename/unlink test done\n");
+	return;
+
+ fail:
+	kprintf("*** Test failed\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -681,7 +873,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[123456] filesystem:\n");
+		kprintf("Usage: fs[1234567] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -714,6 +906,7 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(createstress);
+DEFTEST(renametest);
 
 ////////////////////////////////////////////////////////////
 
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * journaltest - SFS journal crash/replay test
+ *
+ * Makes some changes to an SFS volume and commits them with fsync,
+ * then simulates a crash with sfs_simcrash and makes some more
+ * changes, which never reach the disk. Then unmounts the volume and
+ * mounts it again, which replays the journal, and checks that the
+ * committed changes are there and the others aren't.
+ *
+ * Run it on an unmounted SFS volume that has a journal.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <fs.h>
+#include <vnode.h>
+#include <sfs.h>
+#include <test.h>
+
+#define KEEPNAME "jtest.keep"	/* committed before the crash */
+#define RMNAME   "jtest.rm"	/* created and removed before the crash */
+#define LOSTNAME "jtest.lost"	/* created after the crash */
+#define NBYTES   3000		/* several blocks */
+
+/*
+ * Contents of the test files, byte by byte.
+ */
+static
+char
+jtest_byte(unsigned seed, unsigned pos)
+{
+	return 'a' + (seed + pos*7) % 26;
+}
+
+static
+void
+jtest_makename(char *buf, size_t buflen, const char *dev, const char *file)
+{
+	snprintf(buf, buflen, "%s:%s", dev, file);
+	KASSERT(strlen(buf) < buflen);
+}
+
+/*
+ * Create FILE with the pattern for SEED and fsync it.
+ */
+static
+int
+jtest_write(const char *dev, const char *file, unsigned seed)
+{
+	struct vnode *vn;
+	char name[32];
+	char buf[128];
+	struct iovec iov;
+	struct uio ku;
+	unsigned pos, i, len;
+	int err;
+
+	jtest_makename(name, sizeof(name), dev, file);
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for write: %s\n",
+			name, strerror(err));
+		return err;
+	}
+
+	for (pos = 0; pos < NBYTES; pos += len) {
+		len = NBYTES - pos < sizeof(buf) ? NBYTES - pos : sizeof(buf);
+		for (i=0; i<len; i++) {
+			buf[i] = jtest_byte(seed, pos + i);
+		}
+		uio_kinit(&iov, &ku, buf, len, pos, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err == 0 && ku.uio_resid > 0) {
+			err = EIO;
+		}
+		if (err) {
+			kprintf("%s: Write error: %s\n", name, strerror(err));
+			vfs_close(vn);
+			return err;
+		}
+	}
+
+	err = VOP_FSYNC(vn);
+	vfs_close(vn);
+	if (err) {
+		kprintf("%s: fsync: %s\n", name, strerror(err));
+		return err;
+	}
+	return 0;
+}
+
+/*
+ * Check that FILE has the pattern for SEED.
+ */
+static
+int
+jtest_check(const char *dev, const char *file, unsigned seed)
+{
+	struct vnode *vn;
+	char name[32];
+	char buf[128];
+	struct iovec iov;
+	struct uio ku;
+	unsigned pos, i;
+	int err;
+
+	jtest_makename(name, sizeof(name), dev, file);
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDONLY, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for read: %s\n",
+			name, strerror(err));
+		return err;
+	}
+
+	pos = 0;
+	do {
+		uio_kinit(&iov, &ku, buf, sizeof(buf), pos, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("%s: Read error: %s\n", name, strerror(err));
+			vfs_close(vn);
+			return err;
+		}
+		for (i=0; i < sizeof(buf) - ku.uio_resid; i++) {
+			if (buf[i] != jtest_byte(seed, pos + i)) {
+				kprintf("%s: Test failed: byte %u is wrong\n",
+					name, pos + i);
+				vfs_close(vn);
+				return EIO;
+			}
+		}
+		pos = ku.uio_offset;
+	} while (ku.uio_resid == 0);
+	vfs_close(vn);
+
+	if (pos != NBYTES) {
+		kprintf("%s: Test failed: %u bytes, should have been %u\n",
+			name, pos, NBYTES);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Check that FILE doesn't exist.
+ */
+static
+int
+jtest_gone(const char *dev, const char *file)
+{
+	struct vnode *vn;
+	char name[32];
+	char buf[32];
+	int err;
+
+	jtest_makename(name, sizeof(name), dev, file);
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDONLY, 0664, &vn);
+	if (err == 0) {
+		kprintf("%s: Test failed: still exists\n", name);
+		vfs_close(vn);
+		return EIO;
+	}
+	if (err != ENOENT) {
+		kprintf("%s: open: %s\n", name, strerror(err));
+		return err;
+	}
+	return 0;
+}
+
+static
+int
+jtest_remove(const char *dev, const char *file)
+{
+	char name[32];
+	char buf[32];
+	int err;
+
+	jtest_makename(name, sizeof(name), dev, file);
+
+	/* vfs_remove destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_remove(buf);
+	if (err) {
+		kprintf("Could not remove %s: %s\n", name, strerror(err));
+	}
+	return err;
+}
+
+/*
+ * Fsync the root directory, which commits the journal, or (if CRASH)
+ * simulate a crash of the volume.
+ */
+static
+int
+jtest_root(const char *dev, bool crash)
+{
+	struct vnode *root;
+	char buf[32];
+	int err;
+
+	jtest_makename(buf, sizeof(buf), dev, "");
+	err = vfs_lookup(buf, &root);
+	if (err) {
+		kprintf("%s: root: %s\n", dev, strerror(err));
+		return err;
+	}
+	err = crash ? sfs_simcrash(root->vn_fs) : VOP_FSYNC(root);
+	VOP_DECREF(root);
+	if (err) {
+		kprintf("%s: %s: %s\n", dev, crash ? "crash" : "fsync",
+			strerror(err));
+	}
+	return err;
+}
+
+static
+int
+jtest_unmount(const char *dev)
+{
+	int err, tries;
+
+	/* The syncer may be holding the root for a moment */
+	for (tries = 0; tries < 5; tries++) {
+		err = vfs_unmount(dev);
+		if (err != EBUSY) {
+			break;
+		}
+		clocksleep(1);
+	}
+	if (err) {
+		kprintf("%s: unmount: %s\n", dev, strerror(err));
+	}
+	return err;
+}
+
+int
+journaltest(int nargs, char **args)
+{
+	char *dev;
+	int err;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs8 device:\n");
+		return EINVAL;
+	}
+
+	dev = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (dev[strlen(dev)-1]==':') {
+		dev[strlen(dev)-1] = 0;
+	}
+
+	kprintf("*** Starting journal crash test on %s:\n", dev);
+
+	err = sfs_mount(dev);
+	if (err) {
+		kprintf("%s: mount: %s\n", dev, strerror(err));
+		return err;
+	}
+
+	/* Committed changes */
+	err = jtest_write(dev, KEEPNAME, 1);
+	if (!err) {
+		err = jtest_write(dev, RMNAME, 2);
+	}
+	if (!err) {
+		err = jtest_remove(dev, RMNAME);
+	}
+	if (!err) {
+		err = jtest_root(dev, false);
+	}
+	if (err) {
+		jtest_unmount(dev);
+		goto fail;
+	}
+
+	/* Lost changes */
+	err = jtest_root(dev, true);
+	if (!err) {
+		err = jtest_write(dev, LOSTNAME, 3);
+	}
+	if (!err) {
+		err = jtest_remove(dev, KEEPNAME);
+	}
+	jtest_unmount(dev);
+	if (err) {
+		goto fail;
+	}
+
+	/* Recover */
+	err = sfs_mount(dev);
+	if (err) {
+		kprintf("%s: remount: %s\n", dev, strerror(err));
+		goto fail;
+	}
+	err = jtest_check(dev, KEEPNAME, 1);
+	if (!err) {
+		err = jtest_gone(dev, RMNAME);
+	}
+	if (!err) {
+		err = jtest_gone(dev, LOSTNAME);
+	}
+	if (!err) {
+		err = jtest_remove(dev, KEEPNAME);
+	}
+	jtest_unmount(dev);
+	if (err) {
+		goto fail;
+	}
+
+	kprintf("*** Journal crash test done\n");
+	return 0;
+
+ fail:
+	kprintf("*** Test failed\n");
+	return err;
+}
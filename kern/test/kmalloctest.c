@@ -33,6 +33,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
@@ -40,6 +41,7 @@
 
 #include "opt-dumbvm.h"
 #include "opt-unsw.h"
+#include "opt-kmallocdebug.h"
 
 ////////////////////////////////////////////////////////////
 // km1/km2
@@ -379,3 +381,180 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Measure the cost of kfree as the heap grows.
+ *
+ * For each heap size, allocate KM5_NOPS blocks to free later, then a
+ * pile of ballast blocks on top of them, then time freeing the first
+ * lot. The ballast is allocated second so that a kfree that searches
+ * the list of heap pages (newest first) has to go past all of it.
+ * With a constant-time kfree the per-free cost should stay flat.
+ */
+
+#define KM5_BLOCKSIZE 64
+#define KM5_NOPS 1000
+
+static const unsigned km5_ballast[] = { 0, 1024, 4096, 16384 };
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	void **ops, **ballast;
+	unsigned i, j, n;
+	struct timespec ts1, ts2;
+	uint64_t ns;
+	int ret = 0;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kfree timing test...\n");
+
+	ops = kmalloc(KM5_NOPS * sizeof(void *));
+	if (ops == NULL) {
+		kprintf("kmalloctest5: out of memory\n");
+		return ENOMEM;
+	}
+
+	for (i=0; i<ARRAYCOUNT(km5_ballast); i++) {
+		n = km5_ballast[i];
+		ballast = NULL;
+		if (n > 0) {
+			ballast = kmalloc(n * sizeof(void *));
+			if (ballast == NULL) {
+				kprintf("kmalloctest5: out of memory\n");
+				ret = ENOMEM;
+				break;
+			}
+		}
+
+		/* if any of these fail, kfree(NULL) below is harmless */
+		for (j=0; j<KM5_NOPS; j++) {
+			ops[j] = kmalloc(KM5_BLOCKSIZE);
+		}
+		for (j=0; j<n; j++) {
+			ballast[j] = kmalloc(KM5_BLOCKSIZE);
+			if (ballast[j] == NULL) {
+				break;
+			}
+		}
+		if (j < n) {
+			kprintf("kmalloctest5: out of memory at %u blocks\n",
+				j);
+			n = j;
+			ret = ENOMEM;
+		}
+
+		gettime(&ts1);
+		for (j=0; j<KM5_NOPS; j++) {
+			kfree(ops[j]);
+		}
+		gettime(&ts2);
+		timespec_sub(&ts2, &ts1, &ts2);
+		ns = ts2.tv_sec * 1000000000ULL + ts2.tv_nsec;
+
+		kprintf("%6u blocks in heap: %6lu ns per kfree\n",
+			n + KM5_NOPS, (unsigned long)(ns / KM5_NOPS));
+
+		for (j=0; j<n; j++) {
+			kfree(ballast[j]);
+		}
+		kfree(ballast);
+		if (ret) {
+			break;
+		}
+	}
+
+	kfree(ops);
+	kprintf("kfree timing test done\n");
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * Measure the cost of kmalloc and kfree for a range of block sizes.
+ *
+ * Each round allocates KM6_BATCH blocks and then frees them all, so
+ * the frees go back through the page freelists and not just a
+ * per-cpu cache. Run it in a debug kernel (options kmallocdebug) and
+ * in an optimized one (e.g. GENERIC-OPT) to compare what the kmalloc
+ * debug checks cost.
+ */
+
+#define KM6_BATCH 100
+#define KM6_ROUNDS 20
+
+static const size_t km6_sizes[] = { 16, 64, 256, 1024, 2000, PAGE_SIZE };
+
+int
+kmalloctest6(int nargs, char **args)
+{
+	void **blocks;
+	unsigned i, j, k;
+	struct timespec ts1, ts2, allocts, freets;
+	uint64_t allocns, freens;
+	int ret = 0;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmalloc timing test (kmalloc debug checks %s)...\n",
+		OPT_KMALLOCDEBUG ? "on" : "off");
+
+	blocks = kmalloc(KM6_BATCH * sizeof(void *));
+	if (blocks == NULL) {
+		kprintf("kmalloctest6: out of memory\n");
+		return ENOMEM;
+	}
+
+	for (i=0; i<ARRAYCOUNT(km6_sizes); i++) {
+		allocts.tv_sec = freets.tv_sec = 0;
+		allocts.tv_nsec = freets.tv_nsec = 0;
+
+		for (j=0; j<KM6_ROUNDS && ret == 0; j++) {
+			gettime(&ts1);
+			for (k=0; k<KM6_BATCH; k++) {
+				blocks[k] = kmalloc(km6_sizes[i]);
+			}
+			gettime(&ts2);
+			timespec_sub(&ts2, &ts1, &ts2);
+			timespec_add(&allocts, &ts2, &allocts);
+
+			for (k=0; k<KM6_BATCH; k++) {
+				if (blocks[k] == NULL) {
+					kprintf("kmalloctest6: out of memory\n");
+					ret = ENOMEM;
+				}
+			}
+
+			/* kfree(NULL) is harmless if anything failed */
+			gettime(&ts1);
+			for (k=0; k<KM6_BATCH; k++) {
+				kfree(blocks[k]);
+			}
+			gettime(&ts2);
+			timespec_sub(&ts2, &ts1, &ts2);
+			timespec_add(&freets, &ts2, &freets);
+		}
+		if (ret) {
+			break;
+		}
+
+		allocns = allocts.tv_sec * 1000000000ULL + allocts.tv_nsec;
+		freens = freets.tv_sec * 1000000000ULL + freets.tv_nsec;
+		kprintf("%5lu bytes: %6lu ns per kmalloc, %6lu ns per kfree\n",
+			(unsigned long)km6_sizes[i],
+			(unsigned long)(allocns / (KM6_BATCH * KM6_ROUNDS)),
+			(unsigned long)(freens / (KM6_BATCH * KM6_ROUNDS)));
+	}
+
+	kfree(blocks);
+	kprintf("kmalloc timing test done\n");
+	return ret;
+}
@@ -50,6 +50,7 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <objcache.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid.h>
@@ -72,6 +73,10 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Caches of thread structures and kernel stacks, for thread_fork. */
+static struct objcache *thread_cache;
+static struct objcache *stack_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -123,14 +128,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = objcache_get(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		objcache_put(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -213,7 +218,7 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		c->c_curthread->t_stack = objcache_get(stack_cache);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -278,7 +283,7 @@ thread_destroy(struct thread *thread)
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		objcache_put(stack_cache, thread->t_stack);
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
@@ -287,7 +292,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	objcache_put(thread_cache, thread);
 }
 
 /*
@@ -374,6 +379,10 @@ thread_shutdown(void)
 void
 thread_bootstrap(void)
 {
+	thread_cache = objcache_create("thread", sizeof(struct thread), 16,
+				       NULL, NULL);
+	stack_cache = objcache_create("thread stack", STACK_SIZE, 8,
+				      NULL, NULL);
 	cpuarray_init(&allcpus);
 
 	/*
@@ -509,7 +518,7 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	newthread->t_stack = objcache_get(stack_cache);
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -0,0 +1,1234 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disk buffer cache.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <array.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <device.h>
+#include <buf.h>
+
+/*
+ * All buffers are this size. Every block device we have (lhd) uses
+ * 512-byte sectors, and so does SFS.
+ */
+#define BUF_BLOCKSIZE	512
+
+/*
+ * Maximum number of buffers. Buffers are allocated on demand up to
+ * this limit and then recycled; with 512-byte blocks this caps the
+ * cache at 64k of kernel memory.
+ */
+#define BUF_MAXBUFS	128
+
+/* Number of hash buckets; should be a power of 2. */
+#define BUF_HASHSIZE	64
+
+/* Maximum number of pending read-ahead requests. */
+#define BUF_RAQUEUESIZE	32
+
+/* Maximum number of read-ahead reads outstanding at the device at once. */
+#define BUF_RABATCH	8
+
+/* Maximum number of buffers buffer_writeback does at once. */
+#define BUF_WBBATCH	16
+
+/*
+ * One buffer.
+ *
+ * All fields other than b_data are protected by buf_lock. The data is
+ * owned by whoever has the buffer busy.
+ */
+struct buf {
+	struct device *b_dev;		/* device, or NULL if unassigned */
+	daddr_t b_block;		/* block number on device */
+	void *b_data;			/* BUF_BLOCKSIZE bytes of data */
+	bool b_valid;			/* data matches (or supersedes) disk */
+	bool b_dirty;			/* data needs to be written back */
+	bool b_busy;			/* handed out to someone */
+	bool b_readahead;		/* read ahead, not yet used */
+	bool b_pinned;			/* may not be written back yet */
+	time_t b_dirtytime;		/* when it last became dirty */
+	struct bufowner *b_owner;	/* file it's dirty for, if any */
+	struct buf *b_ownprev;		/* owner's dirty list */
+	struct buf *b_ownnext;
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list (not busy or pinned) */
+	struct buf *b_lrunext;
+};
+
+DECLARRAY(buf, static __UNUSED inline);
+DEFARRAY(buf, static __UNUSED inline);
+
+/* Every buffer ever created, for scanning. Buffers are never freed. */
+static struct bufarray *allbufs;
+
+/* Hash table on (device, block). */
+static struct buf *buf_hash[BUF_HASHSIZE];
+
+/* Idle buffers, least recently used first. */
+static struct buf *buf_lruhead, *buf_lrutail;
+
+/* Lock for the above, and CV for waiting for a buffer to come free. */
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+
+/*
+ * Pending read-ahead requests (a ring buffer), and the CV the
+ * read-ahead thread waits on. Also protected by buf_lock.
+ */
+static struct {
+	struct device *ra_dev;
+	daddr_t ra_block;
+} buf_raqueue[BUF_RAQUEUESIZE];
+static unsigned buf_rahead, buf_racount;
+static struct cv *buf_racv;
+
+/*
+ * One asynchronous read or write in flight. The completion function
+ * Vs br_sem, which the thread that started it waits on.
+ */
+struct buf_ioreq {
+	struct devreq br_req;
+	struct buf *br_buf;
+	struct semaphore *br_sem;
+	int br_result;
+};
+
+/*
+ * Semaphore for the read-ahead thread's batches. Batched writes make
+ * their own, one per call, so an fsync never waits for (or takes the
+ * wakeups of) anyone else's writes.
+ */
+static struct semaphore *buf_rasem;
+
+/*
+ * Device whose writes are being thrown away, for testing; see
+ * buffer_simcrash. Changed under buf_lock, but read without it.
+ */
+static struct device *buf_crashdev;
+
+/* Statistics. */
+static unsigned buf_hits, buf_misses;
+static unsigned buf_evictions, buf_writebacks, buf_agedwrites;
+static unsigned buf_npinned, buf_pins;
+static unsigned buf_ra_issued, buf_ra_dropped, buf_ra_used, buf_ra_wasted;
+
+////////////////////////////////////////////////////////////
+// Lists
+
+static
+unsigned
+buf_hashfunc(struct device *dev, daddr_t block)
+{
+	return ((uintptr_t)dev / sizeof(struct device) + block)
+		% BUF_HASHSIZE;
+}
+
+static
+struct buf *
+buf_hash_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buf_hash[buf_hashfunc(dev, block)];
+	     b != NULL; b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hash_insert(struct buf *b)
+{
+	unsigned h;
+
+	h = buf_hashfunc(b->b_dev, b->b_block);
+	b->b_hashnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+static
+void
+buf_hash_remove(struct buf *b)
+{
+	struct buf **bp;
+
+	bp = &buf_hash[buf_hashfunc(b->b_dev, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buf_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(buf_lruhead == b);
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(buf_lrutail == b);
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Add as most recently used. */
+static
+void
+buf_lru_addtail(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buf_lrutail;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/* Add as least recently used, so it gets recycled first. */
+static
+void
+buf_lru_addhead(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buf_lruhead;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+////////////////////////////////////////////////////////////
+// Device I/O
+
+/*
+ * Read or write a buffer, retrying I/O errors. The buffer must be
+ * busy, and buf_lock must not be held.
+ */
+static
+int
+buf_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries = 0;
+
+	KASSERT(b->b_busy);
+	KASSERT(!lock_do_i_hold(buf_lock));
+
+	if (rw == UIO_WRITE && b->b_dev == buf_crashdev) {
+		/* "Crashed": pretend the write happened */
+		return 0;
+	}
+
+ retry:
+	uio_kinit(&iov, &ku, b->b_data, BUF_BLOCKSIZE,
+		  ((off_t)b->b_block) * BUF_BLOCKSIZE, rw);
+	result = DEVOP_IO(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/* Out of range or misaligned - our fault, not the disk's */
+		panic("buf: %s: block %u: DEVOP_IO returned EINVAL\n",
+		      rw == UIO_READ ? "read" : "write", b->b_block);
+	}
+	if (result == EIO && tries < 10) {
+		if (tries == 0) {
+			kprintf("buf: block %u I/O error, retrying\n",
+				b->b_block);
+		}
+		tries++;
+		goto retry;
+	}
+	if (result == EIO) {
+		kprintf("buf: block %u I/O error, giving up after %d "
+			"retries\n", b->b_block, tries);
+	}
+	return result;
+}
+
+/*
+ * Completion function for buf_io_batch. May be called from an
+ * interrupt handler, so all it does is record the result.
+ */
+static
+void
+buf_io_done(struct devreq *req, int result)
+{
+	struct buf_ioreq *br = req->dr_arg;
+
+	br->br_result = result;
+	V(br->br_sem);
+}
+
+/*
+ * Read or write the N buffers in BRS (all busy) at once with
+ * dev_submit, so the device can schedule and merge them, and wait
+ * for all of them using SEM. Unlike buf_io there's no retry; the
+ * results are left in br_result.
+ */
+static
+void
+buf_io_batch(struct buf_ioreq *brs, unsigned n, enum uio_rw rw,
+	     struct semaphore *sem)
+{
+	struct buf *b;
+	unsigned i;
+
+	KASSERT(!lock_do_i_hold(buf_lock));
+
+	for (i=0; i<n; i++) {
+		b = brs[i].br_buf;
+		KASSERT(b->b_busy);
+		brs[i].br_req.dr_offset = ((off_t)b->b_block) * BUF_BLOCKSIZE;
+		brs[i].br_req.dr_data = b->b_data;
+		brs[i].br_req.dr_len = BUF_BLOCKSIZE;
+		brs[i].br_req.dr_write = (rw == UIO_WRITE);
+		brs[i].br_req.dr_done = buf_io_done;
+		brs[i].br_req.dr_arg = &brs[i];
+		brs[i].br_sem = sem;
+		if (rw == UIO_WRITE && b->b_dev == buf_crashdev) {
+			buf_io_done(&brs[i].br_req, 0);
+			continue;
+		}
+		dev_submit(b->b_dev, &brs[i].br_req);
+	}
+	for (i=0; i<n; i++) {
+		P(sem);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Getting buffers
+
+/*
+ * Make a new buffer, if we haven't hit the limit yet. Called with
+ * buf_lock held.
+ */
+static
+struct buf *
+buf_create(void)
+{
+	struct buf *b;
+
+	if (bufarray_num(allbufs) >= BUF_MAXBUFS) {
+		return NULL;
+	}
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUF_BLOCKSIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	if (bufarray_add(allbufs, b, NULL)) {
+		kfree(b->b_data);
+		kfree(b);
+		return NULL;
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = false;
+	b->b_readahead = false;
+	b->b_pinned = false;
+	b->b_dirtytime = 0;
+	b->b_owner = NULL;
+	b->b_ownprev = b->b_ownnext = NULL;
+	b->b_hashnext = NULL;
+	b->b_lruprev = b->b_lrunext = NULL;
+	return b;
+}
+
+/*
+ * Take a buffer off its owner's dirty list, if it's on one.
+ */
+static
+void
+buf_owner_remove(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	if (b->b_owner == NULL) {
+		return;
+	}
+	if (b->b_ownprev != NULL) {
+		b->b_ownprev->b_ownnext = b->b_ownnext;
+	}
+	else {
+		b->b_owner->bo_dirty = b->b_ownnext;
+	}
+	if (b->b_ownnext != NULL) {
+		b->b_ownnext->b_ownprev = b->b_ownprev;
+	}
+	b->b_owner = NULL;
+	b->b_ownprev = b->b_ownnext = NULL;
+}
+
+/*
+ * Put a buffer on BO's dirty list.
+ */
+static
+void
+buf_owner_add(struct buf *b, struct bufowner *bo)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_owner == NULL);
+
+	b->b_owner = bo;
+	b->b_ownprev = NULL;
+	b->b_ownnext = bo->bo_dirty;
+	if (bo->bo_dirty != NULL) {
+		bo->bo_dirty->b_ownprev = b;
+	}
+	bo->bo_dirty = b;
+}
+
+/*
+ * Note that a buffer has been written back.
+ */
+static
+void
+buf_setclean(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	b->b_dirty = false;
+	buf_owner_remove(b);
+}
+
+/*
+ * Find the buffer for BLOCK of DEV and mark it busy, or if there
+ * isn't one, recycle (or create) a buffer and assign it. A recycled
+ * buffer comes back with b_valid clear. Called with buf_lock held;
+ * may release and reacquire it.
+ */
+static
+int
+buf_acquire(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(dev->d_blocksize == BUF_BLOCKSIZE);
+
+ again:
+	b = buf_hash_find(dev, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		if (!b->b_pinned) {
+			buf_lru_remove(b);
+		}
+		b->b_busy = true;
+		buf_hits++;
+		if (b->b_readahead) {
+			b->b_readahead = false;
+			buf_ra_used++;
+		}
+		*ret = b;
+		return 0;
+	}
+
+	b = buf_create();
+	if (b == NULL) {
+		/* Recycle the least recently used buffer. */
+		b = buf_lruhead;
+		if (b == NULL) {
+			/* Everything is busy or pinned; wait for something */
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		buf_lru_remove(b);
+		if (b->b_dirty) {
+			/*
+			 * Write it back first. Keep it busy while we
+			 * drop the lock, then start over, since the
+			 * world may have changed in the meantime.
+			 */
+			b->b_busy = true;
+			lock_release(buf_lock);
+			result = buf_io(b, UIO_WRITE);
+			lock_acquire(buf_lock);
+			b->b_busy = false;
+			if (result == 0) {
+				buf_setclean(b);
+				buf_writebacks++;
+				buf_lru_addhead(b);
+			}
+			else {
+				/* try something else; this may succeed later */
+				buf_lru_addtail(b);
+			}
+			cv_broadcast(buf_cv, buf_lock);
+			goto again;
+		}
+		if (b->b_dev != NULL) {
+			buf_hash_remove(b);
+			buf_evictions++;
+			if (b->b_readahead) {
+				buf_ra_wasted++;
+			}
+		}
+	}
+
+	KASSERT(b->b_owner == NULL);
+	KASSERT(!b->b_pinned);
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = true;
+	b->b_readahead = false;
+	buf_hash_insert(b);
+	buf_misses++;
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Unassign a busy buffer whose contents are no good and put it up
+ * for immediate reuse. Called with buf_lock held.
+ */
+static
+void
+buf_discard(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+
+	buf_hash_remove(b);
+	buf_setclean(b);
+	if (b->b_pinned) {
+		b->b_pinned = false;
+		buf_npinned--;
+	}
+	b->b_dev = NULL;
+	b->b_valid = false;
+	b->b_busy = false;
+	b->b_readahead = false;
+	buf_lru_addhead(b);
+	cv_broadcast(buf_cv, buf_lock);
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_acquire(dev, block, &b);
+	lock_release(buf_lock);
+	if (result) {
+		return result;
+	}
+
+	if (!b->b_valid) {
+		result = buf_io(b, UIO_READ);
+		if (result) {
+			lock_acquire(buf_lock);
+			buf_discard(b);
+			lock_release(buf_lock);
+			return result;
+		}
+		b->b_valid = true;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_acquire(dev, block, &b);
+	lock_release(buf_lock);
+	if (result) {
+		return result;
+	}
+
+	if (!b->b_valid) {
+		bzero(b->b_data, BUF_BLOCKSIZE);
+		b->b_valid = true;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+/*
+ * Mark a busy buffer dirty. Call with buf_lock held.
+ */
+static
+void
+buf_mark_dirty(struct buf *b)
+{
+	struct timespec now;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	if (!b->b_dirty) {
+		gettime(&now);
+		b->b_dirtytime = now.tv_sec;
+		b->b_dirty = true;
+	}
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	buf_mark_dirty(b);
+	lock_release(buf_lock);
+}
+
+void
+buffer_mark_dirty_owner(struct buf *b, struct bufowner *bo)
+{
+	lock_acquire(buf_lock);
+	buf_mark_dirty(b);
+	if (b->b_owner != bo) {
+		buf_owner_remove(b);
+		buf_owner_add(b, bo);
+	}
+	lock_release(buf_lock);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	if (!b->b_pinned) {
+		buf_lru_addtail(b);
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+void
+buffer_pin(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+	if (!b->b_pinned) {
+		b->b_pinned = true;
+		buf_npinned++;
+		buf_pins++;
+	}
+	lock_release(buf_lock);
+}
+
+void
+buffer_unpin(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	b = buf_hash_find(dev, block);
+	if (b != NULL && b->b_pinned) {
+		b->b_pinned = false;
+		buf_npinned--;
+		if (!b->b_busy) {
+			buf_lru_addtail(b);
+		}
+		cv_broadcast(buf_cv, buf_lock);
+	}
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Read-ahead
+
+void
+buffer_readahead(struct device *dev, daddr_t block)
+{
+	unsigned i, ix;
+
+	lock_acquire(buf_lock);
+
+	/* If it's already cached (or being read) there's nothing to do */
+	if (buf_hash_find(dev, block) != NULL) {
+		lock_release(buf_lock);
+		return;
+	}
+
+	/* Likewise if it's already queued */
+	for (i=0; i<buf_racount; i++) {
+		ix = (buf_rahead + i) % BUF_RAQUEUESIZE;
+		if (buf_raqueue[ix].ra_dev == dev &&
+		    buf_raqueue[ix].ra_block == block) {
+			lock_release(buf_lock);
+			return;
+		}
+	}
+
+	if (buf_racount == BUF_RAQUEUESIZE) {
+		/* Read-ahead is only advisory; don't wait */
+		buf_ra_dropped++;
+		lock_release(buf_lock);
+		return;
+	}
+
+	ix = (buf_rahead + buf_racount) % BUF_RAQUEUESIZE;
+	buf_raqueue[ix].ra_dev = dev;
+	buf_raqueue[ix].ra_block = block;
+	buf_racount++;
+	buf_ra_issued++;
+	cv_signal(buf_racv, buf_lock);
+
+	lock_release(buf_lock);
+}
+
+/*
+ * Forget queued read-ahead requests for DEV. Called with buf_lock held.
+ */
+static
+void
+buf_readahead_purge(struct device *dev)
+{
+	unsigned i, ix, n;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	n = 0;
+	for (i=0; i<buf_racount; i++) {
+		ix = (buf_rahead + i) % BUF_RAQUEUESIZE;
+		if (buf_raqueue[ix].ra_dev == dev) {
+			continue;
+		}
+		buf_raqueue[(buf_rahead + n) % BUF_RAQUEUESIZE] =
+			buf_raqueue[ix];
+		n++;
+	}
+	buf_racount = n;
+}
+
+
+/*
+ * Read-ahead thread. Pulls requests off the queue and reads them
+ * into the cache, so the thread that asked doesn't have to wait for
+ * the disk. Up to BUF_RABATCH reads are handed to the device at once
+ * with dev_submit, so the device can keep busy and merge adjacent
+ * blocks; then we wait for all of them.
+ */
+static
+void
+buf_readahead_thread(void *data1, unsigned long data2)
+{
+	struct buf_ioreq brs[BUF_RABATCH];
+	struct device *dev;
+	daddr_t block;
+	struct buf *b;
+	unsigned i, n;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(buf_lock);
+	while (1) {
+		while (buf_racount == 0) {
+			cv_wait(buf_racv, buf_lock);
+		}
+
+		n = 0;
+		while (buf_racount > 0 && n < BUF_RABATCH) {
+			dev = buf_raqueue[buf_rahead].ra_dev;
+			block = buf_raqueue[buf_rahead].ra_block;
+			buf_rahead = (buf_rahead + 1) % BUF_RAQUEUESIZE;
+			buf_racount--;
+
+			if (buf_hash_find(dev, block) != NULL) {
+				/* Someone else got there first */
+				continue;
+			}
+
+			result = buf_acquire(dev, block, &b);
+			if (result) {
+				continue;
+			}
+			if (b->b_valid) {
+				/* Showed up while buf_acquire was waiting */
+				b->b_busy = false;
+				buf_lru_addtail(b);
+				cv_broadcast(buf_cv, buf_lock);
+				continue;
+			}
+			brs[n].br_buf = b;
+			n++;
+		}
+		if (n == 0) {
+			continue;
+		}
+
+		lock_release(buf_lock);
+		buf_io_batch(brs, n, UIO_READ, buf_rasem);
+		lock_acquire(buf_lock);
+
+		for (i=0; i<n; i++) {
+			b = brs[i].br_buf;
+			if (brs[i].br_result) {
+				/* Read-ahead is only advisory; don't retry */
+				buf_discard(b);
+				continue;
+			}
+			b->b_valid = true;
+			b->b_readahead = true;
+			b->b_busy = false;
+			buf_lru_addtail(b);
+		}
+		cv_broadcast(buf_cv, buf_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Whole-device operations
+
+void
+buffer_drop(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	while (1) {
+		b = buf_hash_find(dev, block);
+		if (b == NULL || !b->b_busy) {
+			break;
+		}
+		cv_wait(buf_cv, buf_lock);
+	}
+	if (b != NULL) {
+		if (!b->b_pinned) {
+			buf_lru_remove(b);
+		}
+		b->b_busy = true;
+		buf_discard(b);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Write back all dirty buffers belonging to DEV. Buffers that are
+ * busy are waited for, since the owner may be about to dirty them.
+ * Pinned buffers are skipped.
+ */
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<bufarray_num(allbufs); i++) {
+		b = bufarray_get(allbufs, i);
+		if (b->b_dev != dev) {
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			/* look at the same buffer again */
+			i--;
+			continue;
+		}
+		if (!b->b_dirty || b->b_pinned) {
+			continue;
+		}
+		buf_lru_remove(b);
+		b->b_busy = true;
+		lock_release(buf_lock);
+		result = buf_io(b, UIO_WRITE);
+		lock_acquire(buf_lock);
+		if (result == 0) {
+			buf_setclean(b);
+			buf_writebacks++;
+		}
+		b->b_busy = false;
+		buf_lru_addtail(b);
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			lock_release(buf_lock);
+			return result;
+		}
+	}
+	lock_release(buf_lock);
+	return 0;
+}
+
+void
+bufowner_init(struct bufowner *bo)
+{
+	bo->bo_dirty = NULL;
+}
+
+/*
+ * Write back the dirty buffers belonging to BO, BUF_WBBATCH at a
+ * time. Pinned buffers are skipped.
+ */
+int
+buffer_sync_owner(struct bufowner *bo)
+{
+	struct buf_ioreq brs[BUF_WBBATCH];
+	struct semaphore *sem;
+	struct buf *b;
+	unsigned i, n;
+	bool anybusy;
+	int result;
+
+	sem = sem_create("fsync", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(buf_lock);
+	while (1) {
+		n = 0;
+		anybusy = false;
+		for (b = bo->bo_dirty; b != NULL && n < BUF_WBBATCH;
+		     b = b->b_ownnext) {
+			if (b->b_pinned) {
+				continue;
+			}
+			if (b->b_busy) {
+				anybusy = true;
+				continue;
+			}
+			buf_lru_remove(b);
+			b->b_busy = true;
+			brs[n].br_buf = b;
+			n++;
+		}
+		if (n == 0) {
+			if (!anybusy) {
+				/* Nothing left but pinned buffers */
+				break;
+			}
+			/* All busy; wait for some to come back */
+			cv_wait(buf_cv, buf_lock);
+			continue;
+		}
+		lock_release(buf_lock);
+
+		buf_io_batch(brs, n, UIO_WRITE, sem);
+
+		lock_acquire(buf_lock);
+		result = 0;
+		for (i=0; i<n; i++) {
+			b = brs[i].br_buf;
+			if (brs[i].br_result == 0) {
+				buf_setclean(b);
+				buf_writebacks++;
+			}
+			else {
+				result = brs[i].br_result;
+			}
+			b->b_busy = false;
+			buf_lru_addtail(b);
+		}
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			lock_release(buf_lock);
+			sem_destroy(sem);
+			return result;
+		}
+	}
+	lock_release(buf_lock);
+	sem_destroy(sem);
+	return 0;
+}
+
+/*
+ * Forget BO. Its buffers stay dirty and are written back as usual.
+ */
+void
+buffer_disown(struct bufowner *bo)
+{
+	lock_acquire(buf_lock);
+	while (bo->bo_dirty != NULL) {
+		buf_owner_remove(bo->bo_dirty);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Write back up to MAX buffers that have been dirty for at least
+ * MAXAGE seconds, all at once.
+ */
+unsigned
+buffer_writeback(time_t maxage, unsigned max)
+{
+	struct buf_ioreq brs[BUF_WBBATCH];
+	struct semaphore *sem;
+	struct timespec now;
+	struct buf *b;
+	unsigned i, n, total;
+
+	if (max > BUF_WBBATCH) {
+		max = BUF_WBBATCH;
+	}
+
+	sem = sem_create("write-back", 0);
+	if (sem == NULL) {
+		/* nothing written; the caller will try again later */
+		return 0;
+	}
+
+	gettime(&now);
+
+	lock_acquire(buf_lock);
+	n = 0;
+	total = bufarray_num(allbufs);
+	for (i=0; i<total && n<max; i++) {
+		b = bufarray_get(allbufs, i);
+		if (b->b_busy || !b->b_dirty || b->b_pinned ||
+		    now.tv_sec - b->b_dirtytime < maxage) {
+			continue;
+		}
+		buf_lru_remove(b);
+		b->b_busy = true;
+		brs[n].br_buf = b;
+		n++;
+	}
+	lock_release(buf_lock);
+
+	if (n == 0) {
+		sem_destroy(sem);
+		return 0;
+	}
+	buf_io_batch(brs, n, UIO_WRITE, sem);
+	sem_destroy(sem);
+
+	lock_acquire(buf_lock);
+	for (i=0; i<n; i++) {
+		b = brs[i].br_buf;
+		if (brs[i].br_result == 0) {
+			buf_setclean(b);
+			buf_writebacks++;
+			buf_agedwrites++;
+		}
+		/* If it failed it stays dirty and we'll try again later */
+		b->b_busy = false;
+		buf_lru_addtail(b);
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+
+	return n;
+}
+
+/*
+ * Write back and then forget everything cached for DEV.
+ */
+int
+buffer_invalidate(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	lock_acquire(buf_lock);
+	buf_readahead_purge(dev);
+	lock_release(buf_lock);
+
+	result = buffer_sync(dev);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(buf_lock);
+	for (i=0; i<bufarray_num(allbufs); i++) {
+		b = bufarray_get(allbufs, i);
+		if (b->b_dev != dev) {
+			continue;
+		}
+		if (b->b_busy) {
+			/* The read-ahead thread might still have it */
+			cv_wait(buf_cv, buf_lock);
+			i--;
+			continue;
+		}
+		/* The fs is being unmounted; nobody else is using it */
+		KASSERT(!b->b_dirty);
+		KASSERT(!b->b_pinned);
+		buf_lru_remove(b);
+		b->b_busy = true;
+		buf_discard(b);
+	}
+	if (buf_crashdev == dev) {
+		/* Nothing left of what was lost; the "crash" is over */
+		buf_crashdev = NULL;
+	}
+	lock_release(buf_lock);
+	return 0;
+}
+
+/*
+ * Simulate a crash of DEV: from now until buffer_invalidate, all
+ * writes of its buffers are silently dropped, so the disk is left
+ * as it was at this moment. For testing crash recovery.
+ */
+void
+buffer_simcrash(struct device *dev)
+{
+	lock_acquire(buf_lock);
+	KASSERT(buf_crashdev == NULL || buf_crashdev == dev);
+	buf_crashdev = dev;
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Setup and stats
+
+void
+buffer_bootstrap(void)
+{
+	unsigned i;
+	int result;
+
+	allbufs = bufarray_create();
+	if (allbufs == NULL) {
+		panic("buf: Could not create buffer array\n");
+	}
+	buf_lock = lock_create("buffer cache");
+	if (buf_lock == NULL) {
+		panic("buf: Could not create buffer cache lock\n");
+	}
+	buf_cv = cv_create("buffer cache");
+	if (buf_cv == NULL) {
+		panic("buf: Could not create buffer cache cv\n");
+	}
+	buf_racv = cv_create("read-ahead");
+	if (buf_racv == NULL) {
+		panic("buf: Could not create read-ahead cv\n");
+	}
+	buf_rasem = sem_create("read-ahead", 0);
+	if (buf_rasem == NULL) {
+		panic("buf: Could not create read-ahead semaphore\n");
+	}
+	for (i=0; i<BUF_HASHSIZE; i++) {
+		buf_hash[i] = NULL;
+	}
+	buf_lruhead = buf_lrutail = NULL;
+	buf_rahead = buf_racount = 0;
+	buf_hits = buf_misses = 0;
+	buf_evictions = buf_writebacks = buf_agedwrites = 0;
+	buf_npinned = buf_pins = 0;
+	buf_ra_issued = buf_ra_dropped = buf_ra_used = buf_ra_wasted = 0;
+
+	result = thread_fork("read-ahead", NULL, buf_readahead_thread,
+			     NULL, 0);
+	if (result) {
+		panic("buf: Could not start read-ahead thread: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+buffer_printstats(void)
+{
+	unsigned i, ndirty, nbusy, total;
+	struct buf *b;
+
+	ndirty = nbusy = 0;
+
+	lock_acquire(buf_lock);
+	total = bufarray_num(allbufs);
+	for (i=0; i<total; i++) {
+		b = bufarray_get(allbufs, i);
+		if (b->b_dirty) {
+			ndirty++;
+		}
+		if (b->b_busy) {
+			nbusy++;
+		}
+	}
+	kprintf("Buffer cache: %u/%u buffers, %u dirty, %u busy, "
+		"%u pinned\n", total, BUF_MAXBUFS, ndirty, nbusy, buf_npinned);
+	kprintf("    %u hits, %u misses (%u%% hit rate)\n",
+		buf_hits, buf_misses,
+		buf_hits + buf_misses == 0 ? 0 :
+		(buf_hits * 100) / (buf_hits + buf_misses));
+	kprintf("    %u evictions, %u writebacks (%u by age), %u pins\n",
+		buf_evictions, buf_writebacks, buf_agedwrites, buf_pins);
+	kprintf("    read-ahead: %u issued, %u used, %u wasted, %u dropped\n",
+		buf_ra_issued, buf_ra_used, buf_ra_wasted, buf_ra_dropped);
+	lock_release(buf_lock);
+}
@@ -386,3 +386,25 @@ dev_uncreate_vnode(struct vnode *vn)
 	vnode_cleanup(vn);
 	kfree(vn);
 }
+
+/*
+ * Start an asynchronous block I/O.
+ */
+void
+dev_submit(struct device *dev, struct devreq *req)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	if (dev->d_ops->devop_submit != NULL) {
+		DEVOP_SUBMIT(dev, req);
+		return;
+	}
+
+	/* No queue; fall back to synchronous I/O */
+	uio_kinit(&iov, &ku, req->dr_data, req->dr_len, req->dr_offset,
+		  req->dr_write ? UIO_WRITE : UIO_READ);
+	result = DEVOP_IO(dev, &ku);
+	req->dr_done(req, result);
+}
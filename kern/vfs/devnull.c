@@ -29,7 +29,9 @@
 
 /*
  * Implementation of the null device, "null:", which generates an
- * immediate EOF on read and throws away anything written to it.
+ * immediate EOF on read and throws away anything written to it, and
+ * the zero device, "zero:", which is the same except that reads
+ * return as many zero bytes as asked for.
  */
 #include <types.h>
 #include <kern/errno.h>
@@ -66,12 +68,24 @@ nullio(struct device *dev, struct uio *uio)
 	(void)dev; // unused
 
 	if (uio->uio_rw == UIO_WRITE) {
+		uio->uio_offset += uio->uio_resid;
 		uio->uio_resid = 0;
 	}
 
 	return 0;
 }
 
+/* For d_io() on zero: */
+static
+int
+zeroio(struct device *dev, struct uio *uio)
+{
+	if (uio->uio_rw == UIO_READ) {
+		return uiomovezeros(uio->uio_resid, uio);
+	}
+	return nullio(dev, uio);
+}
+
 /* For ioctl() */
 static
 int
@@ -94,21 +108,28 @@ static const struct device_ops null_devops = {
 	.devop_ioctl = nullioctl,
 };
 
+static const struct device_ops zero_devops = {
+	.devop_eachopen = nullopen,
+	.devop_io = zeroio,
+	.devop_ioctl = nullioctl,
+};
+
 /*
- * Function to create and attach null:
+ * Function to create and attach null: or zero:
  */
+static
 void
-devnull_create(void)
+devnull_attach(const char *name, const struct device_ops *ops)
 {
 	int result;
 	struct device *dev;
 
 	dev = kmalloc(sizeof(*dev));
 	if (dev==NULL) {
-		panic("Could not add null device: out of memory\n");
+		panic("Could not add %s device: out of memory\n", name);
 	}
 
-	dev->d_ops = &null_devops;
+	dev->d_ops = ops;
 
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
@@ -117,8 +138,21 @@ devnull_create(void)
 
 	dev->d_data = NULL;
 
-	result = vfs_adddev("null", dev, 0);
+	result = vfs_adddev(name, dev, 0);
 	if (result) {
-		panic("Could not add null device: %s\n", strerror(result));
+		panic("Could not add %s device: %s\n", name,
+		      strerror(result));
 	}
 }
+
+void
+devnull_create(void)
+{
+	devnull_attach("null", &null_devops);
+}
+
+void
+devzero_create(void)
+{
+	devnull_attach("zero", &zero_devops);
+}
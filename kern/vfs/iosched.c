@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Disk I/O scheduling. See iosched.h.
+ *
+ * The queue is a singly linked list (through dr_next) of runs in
+ * arrival order; the policies choose by scanning it. Queues are short
+ * (a few requests per thread doing I/O) so this is cheaper than
+ * keeping several orderings up to date.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <device.h>
+#include <iosched.h>
+
+/* Deadlines for the deadline policy, in microseconds. */
+#define IOSCHED_READEXPIRE	500000
+#define IOSCHED_WRITEEXPIRE	5000000
+
+/* Most devices we keep track of for iosched_setpolicy and stats. */
+#define IOSCHED_MAXDEVS		8
+
+/*
+ * A policy. ip_choose returns the link (the queue head or some run's
+ * dr_next) that points to the run to start next; the queue is never
+ * empty when it's called.
+ */
+struct iosched_policy {
+	const char *ip_name;
+	struct devreq **(*ip_choose)(struct iosched *is);
+};
+
+/*
+ * All the schedulers. These are registered at autoconf time, before
+ * there's more than one thread, so the list isn't locked.
+ */
+static struct iosched *iosched_all[IOSCHED_MAXDEVS];
+static unsigned iosched_num;
+
+/*
+ * Current time in microseconds. Also used from interrupt handlers.
+ */
+static
+uint64_t
+iosched_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Length in bytes of the run starting at RUN, and its last request.
+ */
+static
+size_t
+iosched_runlen(struct devreq *run, struct devreq **last_ret)
+{
+	size_t len = 0;
+
+	while (1) {
+		len += run->dr_len;
+		if (run->dr_mergenext == NULL) {
+			break;
+		}
+		run = run->dr_mergenext;
+	}
+	if (last_ret != NULL) {
+		*last_ret = run;
+	}
+	return len;
+}
+
+////////////////////////////////////////////////////////////
+// Policies
+
+/*
+ * fifo: oldest first.
+ */
+static
+struct devreq **
+iosched_fifo_choose(struct iosched *is)
+{
+	return &is->is_queue;
+}
+
+/*
+ * clook: lowest offset at or past the head, else lowest offset.
+ */
+static
+struct devreq **
+iosched_clook_choose(struct iosched *is)
+{
+	struct devreq **link, **ahead, **lowest;
+
+	ahead = lowest = NULL;
+	for (link = &is->is_queue; *link != NULL; link = &(*link)->dr_next) {
+		if (lowest == NULL ||
+		    (*link)->dr_offset < (*lowest)->dr_offset) {
+			lowest = link;
+		}
+		if ((*link)->dr_offset >= is->is_headpos &&
+		    (ahead == NULL ||
+		     (*link)->dr_offset < (*ahead)->dr_offset)) {
+			ahead = link;
+		}
+	}
+	return ahead != NULL ? ahead : lowest;
+}
+
+/*
+ * deadline: the oldest request if it has expired, else clook. Since
+ * the queue is in arrival order the oldest one is at the front.
+ */
+static
+struct devreq **
+iosched_deadline_choose(struct iosched *is)
+{
+	struct devreq *oldest = is->is_queue;
+	uint64_t expire;
+
+	expire = oldest->dr_write ? IOSCHED_WRITEEXPIRE : IOSCHED_READEXPIRE;
+	if (iosched_now() - oldest->dr_qtime > expire) {
+		is->is_nexpired++;
+		return &is->is_queue;
+	}
+	return iosched_clook_choose(is);
+}
+
+static const struct iosched_policy iosched_policies[] = {
+	{ "fifo", iosched_fifo_choose },
+	{ "clook", iosched_clook_choose },
+	{ "deadline", iosched_deadline_choose },
+};
+
+/* The one new devices get. */
+#define IOSCHED_DEFAULT		(&iosched_policies[2])
+
+////////////////////////////////////////////////////////////
+// Queue
+
+void
+iosched_init(struct iosched *is, const char *name, struct spinlock *lock,
+	     size_t maxrun)
+{
+	is->is_name = name;
+	is->is_lock = lock;
+	is->is_policy = IOSCHED_DEFAULT;
+	is->is_queue = NULL;
+	is->is_headpos = 0;
+	is->is_maxrun = maxrun;
+	is->is_runlen = 0;
+
+	is->is_depth = 0;
+	is->is_maxdepth = 0;
+	is->is_depthsum = 0;
+	is->is_nreqs = 0;
+	is->is_nmerged = 0;
+	is->is_nexpired = 0;
+	is->is_ndone = 0;
+	is->is_latsum = 0;
+	is->is_latmax = 0;
+
+	if (iosched_num < IOSCHED_MAXDEVS) {
+		iosched_all[iosched_num++] = is;
+	}
+	else {
+		kprintf("iosched: %s: too many devices; no stats for it\n",
+			name);
+	}
+}
+
+/*
+ * Try to put REQ on the end of the run starting at RUN, which is LEN
+ * bytes long as far as the cap is concerned.
+ */
+static
+bool
+iosched_merge(struct iosched *is, struct devreq *run, size_t len,
+	      struct devreq *req)
+{
+	struct devreq *last;
+
+	if (run->dr_write != req->dr_write) {
+		return false;
+	}
+	(void)iosched_runlen(run, &last);
+	if (last->dr_offset + last->dr_len != req->dr_offset ||
+	    len + req->dr_len > is->is_maxrun) {
+		return false;
+	}
+	last->dr_mergenext = req;
+	is->is_nmerged++;
+	return true;
+}
+
+void
+iosched_add(struct iosched *is, struct devreq *req, struct devreq *active)
+{
+	struct devreq **link;
+
+	KASSERT(spinlock_do_i_hold(is->is_lock));
+
+	req->dr_next = NULL;
+	req->dr_mergenext = NULL;
+	req->dr_qtime = iosched_now();
+
+	is->is_nreqs++;
+	is->is_depth++;
+	is->is_depthsum += is->is_depth;
+	if (is->is_depth > is->is_maxdepth) {
+		is->is_maxdepth = is->is_depth;
+	}
+
+	/*
+	 * The driver drops requests off the front of the active run as
+	 * they finish, so measure it from when it was started; otherwise
+	 * a steady stream could keep it going forever.
+	 */
+	if (active != NULL &&
+	    iosched_merge(is, active, is->is_runlen, req)) {
+		is->is_runlen += req->dr_len;
+		is->is_headpos += req->dr_len;
+		return;
+	}
+	for (link = &is->is_queue; *link != NULL; link = &(*link)->dr_next) {
+		if (iosched_merge(is, *link, iosched_runlen(*link, NULL),
+				  req)) {
+			return;
+		}
+	}
+	*link = req;
+}
+
+struct devreq *
+iosched_next(struct iosched *is)
+{
+	struct devreq **link, *run;
+
+	KASSERT(spinlock_do_i_hold(is->is_lock));
+
+	if (is->is_queue == NULL) {
+		return NULL;
+	}
+	link = is->is_policy->ip_choose(is);
+	run = *link;
+	*link = run->dr_next;
+	run->dr_next = NULL;
+
+	is->is_runlen = iosched_runlen(run, NULL);
+	is->is_headpos = run->dr_offset + is->is_runlen;
+	return run;
+}
+
+void
+iosched_done(struct iosched *is, struct devreq *req)
+{
+	uint64_t lat;
+
+	KASSERT(spinlock_do_i_hold(is->is_lock));
+	KASSERT(is->is_depth > 0);
+
+	lat = iosched_now() - req->dr_qtime;
+	is->is_depth--;
+	is->is_ndone++;
+	is->is_latsum += lat;
+	if (lat > is->is_latmax) {
+		is->is_latmax = lat;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Control and statistics
+
+int
+iosched_setpolicy(const char *name, const char *policy)
+{
+	struct iosched *is;
+	unsigned i, j;
+
+	for (i=0; i<iosched_num; i++) {
+		is = iosched_all[i];
+		if (strcmp(is->is_name, name) != 0) {
+			continue;
+		}
+		for (j=0; j<ARRAYCOUNT(iosched_policies); j++) {
+			if (!strcmp(iosched_policies[j].ip_name, policy)) {
+				spinlock_acquire(is->is_lock);
+				is->is_policy = &iosched_policies[j];
+				spinlock_release(is->is_lock);
+				return 0;
+			}
+		}
+		return EINVAL;
+	}
+	return ENODEV;
+}
+
+void
+iosched_printstats(void)
+{
+	struct iosched is;
+	unsigned i;
+
+	for (i=0; i<iosched_num; i++) {
+		/* Take a copy so we don't kprintf with the spinlock held */
+		spinlock_acquire(iosched_all[i]->is_lock);
+		is = *iosched_all[i];
+		spinlock_release(iosched_all[i]->is_lock);
+
+		kprintf("%s: policy %s, %u pending\n", is.is_name,
+			is.is_policy->ip_name, is.is_depth);
+		kprintf("    %u requests (%u merged), %u done, "
+			"%u started on deadline\n", is.is_nreqs,
+			is.is_nmerged, is.is_ndone, is.is_nexpired);
+		if (is.is_nreqs > 0) {
+			kprintf("    queue depth: average %u.%02u, max %u\n",
+				(unsigned)(is.is_depthsum / is.is_nreqs),
+				(unsigned)(is.is_depthsum % is.is_nreqs
+					   * 100 / is.is_nreqs),
+				is.is_maxdepth);
+		}
+		if (is.is_ndone > 0) {
+			kprintf("    latency: average %u us, max %u us\n",
+				(unsigned)(is.is_latsum / is.is_ndone),
+				(unsigned)is.is_latmax);
+		}
+	}
+}
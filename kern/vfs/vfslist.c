@@ -38,11 +38,15 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <clock.h>
 #include <synch.h>
+#include <thread.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
+#include "opt-tmpfs.h"
 
 /*
  * Structure for a single named device.
@@ -94,6 +98,17 @@ static struct knowndevarray *knowndevs;
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
+/* How often the syncer thread runs, in seconds. */
+#define SYNCER_INTERVAL	1
+
+/* How long a buffer may be dirty before the syncer writes it back. */
+#define SYNCER_MAXAGE	3
+
+/* Most buffers the syncer writes back per pass. */
+#define SYNCER_BATCH	16
+
+static void vfs_syncer_thread(void *, unsigned long);
+
 
 /*
  * Setup function
@@ -112,8 +127,18 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	buffer_bootstrap();
+	vfs_namecache_bootstrap();
 	devnull_create();
+	devzero_create();
 	semfs_bootstrap();
+#if OPT_TMPFS
+	tmpfs_bootstrap();
+#endif
+
+	if (thread_fork("syncer", NULL, vfs_syncer_thread, NULL, 0)) {
+		panic("vfs: Could not start syncer thread\n");
+	}
 }
 
 /*
@@ -190,6 +215,64 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * Syncer thread. Every SYNCER_INTERVAL seconds, have each filesystem
+ * push its older dirty metadata into the buffer cache, then write
+ * back a batch of buffers that have been dirty for SYNCER_MAXAGE
+ * seconds or more. This spreads writes out over time instead of
+ * saving them all up, and so bounds how much an explicit sync has to
+ * do. A batch is at most SYNCER_BATCH buffers so the syncer never
+ * holds up other disk I/O for long.
+ *
+ * Writeback can take a while (for SFS it commits the journal, which
+ * waits for operations in progress), so it isn't done under
+ * vfs_biglock. Instead we hold a reference to the fs's root vnode,
+ * which keeps it from being unmounted, and drop the biglock. Devices
+ * are only ever added to knowndevs, so the index stays good.
+ */
+static
+void
+vfs_syncer_thread(void *data1, unsigned long data2)
+{
+	struct knowndev *dev;
+	struct vnode *root;
+	struct fs *fs;
+	unsigned i;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(SYNCER_INTERVAL);
+
+		for (i=0; ; i++) {
+			vfs_biglock_acquire();
+			if (i >= knowndevarray_num(knowndevs)) {
+				vfs_biglock_release();
+				break;
+			}
+			dev = knowndevarray_get(knowndevs, i);
+			fs = dev->kd_fs;
+			if (fs == NULL || fs == SWAP_FS ||
+			    fs->fs_ops->fsop_writeback == NULL) {
+				vfs_biglock_release();
+				continue;
+			}
+			result = FSOP_GETROOT(fs, &root);
+			vfs_biglock_release();
+			if (result) {
+				continue;
+			}
+
+			/*result =*/ FSOP_WRITEBACK(fs);
+			VOP_DECREF(root);
+		}
+
+		buffer_writeback(SYNCER_MAXAGE, SYNCER_BATCH);
+	}
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -654,6 +737,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* drop cached names, which hold references to its vnodes */
+	vfs_namecache_purgefs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -745,6 +831,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_namecache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
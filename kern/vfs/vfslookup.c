@@ -234,41 +234,152 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up a single path component NAME in directory DIR, going
+ * through the name cache. Hands back a new reference. "." and ".."
+ * always go to the filesystem.
+ */
+static
+int
+lookup_component(struct vnode *dir, char *name, struct vnode **ret)
+{
+	char savename[VFS_NCNAMELEN];
+	struct vnode *vn;
+	unsigned gen;
+	int result;
+
+	if (vfs_namecache_lookup(dir, name, &vn)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*ret = vn;
+		return 0;
+	}
+	if (strlen(name) >= sizeof(savename)) {
+		/* Too long to cache anyway */
+		return VOP_LOOKUP(dir, name, ret);
+	}
+
+	/* VOP_LOOKUP may destroy the name, so keep a copy */
+	strcpy(savename, name);
+	gen = vfs_namecache_gen();
+
+	result = VOP_LOOKUP(dir, name, &vn);
+	if (result == 0) {
+		vfs_namecache_enter(dir, savename, vn, gen);
+		*ret = vn;
+	}
+	else if (result == ENOENT) {
+		vfs_namecache_enter(dir, savename, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * Walk PATH one component at a time starting from DIR, and hand back
+ * the vnode at the end. Consumes the reference to DIR.
+ */
+static
+int
+lookup_walk(struct vnode *dir, char *path, struct vnode **ret)
+{
+	struct vnode *next;
+	char *s;
+	int result;
+
+	while (1) {
+		while (*path == '/') {
+			path++;
+		}
+		if (*path == 0) {
+			break;
+		}
+
+		s = strchr(path, '/');
+		if (s != NULL) {
+			*s++ = 0;
+		}
+		else {
+			s = path + strlen(path);
+		}
+
+		result = lookup_component(dir, path, &next);
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = next;
+		path = s;
+	}
+
+	*ret = dir;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * We walk the path ourselves, component by component, so the name
+ * cache can answer for each one; only the final step of lookparent
+ * is left to the filesystem.
  */
 
 int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *last;
+	size_t len;
 	int result;
 
+	/*
+	 * The big lock protects the device table and the boot
+	 * filesystem; filesystems do their own locking, so we don't
+	 * need it for the lookup proper.
+	 */
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	if (strlen(path)==0) {
+	/* Trailing slashes don't count */
+	len = strlen(path);
+	while (len > 0 && path[len-1] == '/') {
+		path[--len] = 0;
+	}
+
+	if (len==0) {
 		/*
 		 * It does not make sense to use just a device name in
 		 * a context where "lookparent" is the desired
 		 * operation.
 		 */
-		result = EINVAL;
+		VOP_DECREF(startvn);
+		return EINVAL;
+	}
+
+	/* Find the directory part, if any, and walk it */
+	last = strrchr(path, '/');
+	if (last == NULL) {
+		dir = startvn;
+		last = path;
 	}
 	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		*last++ = 0;
+		result = lookup_walk(startvn, path, &dir);
+		if (result) {
+			return result;
+		}
 	}
 
-	VOP_DECREF(startvn);
+	result = VOP_LOOKPARENT(dir, last, retval, buf, buflen);
+
+	VOP_DECREF(dir);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -279,22 +390,16 @@ vfs_lookup(char *path, struct vnode **retval)
 	int result;
 
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
-
-	VOP_DECREF(startvn);
-	vfs_biglock_release();
-	return result;
+	return lookup_walk(startvn, path, retval);
 }
@@ -0,0 +1,480 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VFS name lookup cache.
+ *
+ * Maps (directory vnode, name) to the vnode the name refers to, or
+ * to "no such file" for negative entries. vfs_lookup and
+ * vfs_lookparent consult it for each path component before asking
+ * the filesystem.
+ *
+ * Each entry holds a reference to both its directory and its target,
+ * so neither can be reclaimed and reused while the entry exists. That
+ * means entries must be dropped when the name goes away (remove,
+ * rename, rmdir), when it comes into existence (create, link, mkdir,
+ * symlink, rename; to kill negative entries), and when the filesystem
+ * is unmounted. vfspath.c and vfslist.c take care of that.
+ *
+ * There is a race between a lookup that goes to the filesystem and a
+ * concurrent operation that changes the name: the lookup could enter
+ * what it found after the other operation has already invalidated
+ * the name. To prevent that, every invalidation bumps a generation
+ * number; callers fetch it with vfs_namecache_gen before going to the
+ * filesystem, and vfs_namecache_enter ignores the result if it has
+ * changed since.
+ *
+ * Names of VFS_NCNAMELEN or more characters are not cached, nor are
+ * "." and "..", which the filesystem answers cheaply and which would
+ * need their own invalidation rules. Lookups of these still go
+ * through vfs_namecache_lookup so they show up in the statistics.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Number of entries */
+#define NC_SIZE      256
+
+/* Number of hash buckets */
+#define NC_HASHSIZE  64
+
+struct ncentry {
+	struct vnode *nc_dir;		/* directory; NULL if entry unused */
+	struct vnode *nc_vn;		/* target; NULL if negative */
+	char nc_name[VFS_NCNAMELEN];	/* name within directory */
+	struct ncentry *nc_hashnext;	/* hash chain */
+	struct ncentry *nc_lruprev;	/* LRU list */
+	struct ncentry *nc_lrunext;
+};
+
+static struct spinlock nc_lock = SPINLOCK_INITIALIZER;
+static struct ncentry nc_entries[NC_SIZE];
+static struct ncentry *nc_hash[NC_HASHSIZE];
+
+/* LRU list; unused entries are kept at the head */
+static struct ncentry *nc_lruhead;
+static struct ncentry *nc_lrutail;
+
+/* Invalidation count; see above */
+static unsigned nc_gen;
+
+/* Statistics */
+static unsigned nc_hits;
+static unsigned nc_neghits;
+static unsigned nc_misses;
+static unsigned nc_uncacheable;
+static unsigned nc_enters;
+static unsigned nc_invalidations;
+
+////////////////////////////////////////////////////////////
+// Internal bits
+
+/*
+ * Check if NAME is something we cache.
+ */
+static
+bool
+nc_cacheable(const char *name)
+{
+	return strcmp(name, ".") && strcmp(name, "..") &&
+		strlen(name) < VFS_NCNAMELEN;
+}
+
+static
+unsigned
+nc_hashfunc(struct vnode *dir, const char *name)
+{
+	uint32_t h;
+
+	h = (uint32_t)(uintptr_t)dir >> 4;
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % NC_HASHSIZE;
+}
+
+static
+void
+nc_lru_remove(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		nc_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		nc_lrutail = nc->nc_lruprev;
+	}
+	nc->nc_lruprev = nc->nc_lrunext = NULL;
+}
+
+static
+void
+nc_lru_addtail(struct ncentry *nc)
+{
+	nc->nc_lruprev = nc_lrutail;
+	nc->nc_lrunext = NULL;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = nc;
+	}
+	else {
+		nc_lruhead = nc;
+	}
+	nc_lrutail = nc;
+}
+
+static
+void
+nc_lru_addhead(struct ncentry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = nc;
+	}
+	else {
+		nc_lrutail = nc;
+	}
+	nc_lruhead = nc;
+}
+
+/*
+ * Find the entry for (DIR, NAME). Call with nc_lock held.
+ */
+static
+struct ncentry *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	for (nc = nc_hash[nc_hashfunc(dir, name)]; nc; nc = nc->nc_hashnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of use and put it at the head of the LRU list
+ * for reuse. The references it held are handed back in DIR and VN;
+ * the caller must drop them after releasing nc_lock, since dropping
+ * a reference can call into the filesystem. Call with nc_lock held.
+ */
+static
+void
+nc_detach(struct ncentry *nc, struct vnode **dir, struct vnode **vn)
+{
+	struct ncentry **ncp;
+
+	KASSERT(nc->nc_dir != NULL);
+
+	ncp = &nc_hash[nc_hashfunc(nc->nc_dir, nc->nc_name)];
+	while (*ncp != nc) {
+		KASSERT(*ncp != NULL);
+		ncp = &(*ncp)->nc_hashnext;
+	}
+	*ncp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+
+	*dir = nc->nc_dir;
+	*vn = nc->nc_vn;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+	nc->nc_name[0] = 0;
+
+	nc_lru_remove(nc);
+	nc_lru_addhead(nc);
+}
+
+/*
+ * Drop references handed back by nc_detach.
+ */
+static
+void
+nc_dropref(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Drop every entry that is in directory DIR, or whose directory is
+ * on filesystem FS.
+ */
+static
+void
+nc_purge(struct fs *fs, struct vnode *dir)
+{
+	struct vnode *olddir, *oldvn;
+	struct ncentry *nc;
+	unsigned i;
+
+	while (1) {
+		olddir = oldvn = NULL;
+
+		spinlock_acquire(&nc_lock);
+		nc_gen++;
+		for (i=0; i<NC_SIZE; i++) {
+			nc = &nc_entries[i];
+			if (nc->nc_dir == NULL) {
+				continue;
+			}
+			if ((fs != NULL && nc->nc_dir->vn_fs == fs) ||
+			    (dir != NULL && nc->nc_dir == dir)) {
+				nc_detach(nc, &olddir, &oldvn);
+				nc_invalidations++;
+				break;
+			}
+		}
+		spinlock_release(&nc_lock);
+
+		if (olddir == NULL) {
+			/* Nothing left */
+			return;
+		}
+		nc_dropref(olddir, oldvn);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Set up the (initially empty) cache.
+ */
+void
+vfs_namecache_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<NC_HASHSIZE; i++) {
+		nc_hash[i] = NULL;
+	}
+	nc_lruhead = nc_lrutail = NULL;
+	for (i=0; i<NC_SIZE; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_vn = NULL;
+		nc_entries[i].nc_name[0] = 0;
+		nc_entries[i].nc_hashnext = NULL;
+		nc_lru_addtail(&nc_entries[i]);
+	}
+}
+
+/*
+ * Look up NAME in DIR. Returns true if the cache knows the answer,
+ * in which case *RESULT is either a new reference to the vnode or
+ * NULL if the name does not exist. Returns false if the caller has
+ * to ask the filesystem.
+ */
+bool
+vfs_namecache_lookup(struct vnode *dir, const char *name,
+		     struct vnode **result)
+{
+	struct ncentry *nc;
+
+	if (!nc_cacheable(name)) {
+		spinlock_acquire(&nc_lock);
+		nc_uncacheable++;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+
+	spinlock_acquire(&nc_lock);
+	nc = nc_find(dir, name);
+	if (nc == NULL) {
+		nc_misses++;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+
+	if (nc->nc_vn != NULL) {
+		VOP_INCREF(nc->nc_vn);
+		nc_hits++;
+	}
+	else {
+		nc_neghits++;
+	}
+	*result = nc->nc_vn;
+
+	nc_lru_remove(nc);
+	nc_lru_addtail(nc);
+	spinlock_release(&nc_lock);
+	return true;
+}
+
+/*
+ * Return the current invalidation count, for vfs_namecache_enter.
+ */
+unsigned
+vfs_namecache_gen(void)
+{
+	unsigned gen;
+
+	spinlock_acquire(&nc_lock);
+	gen = nc_gen;
+	spinlock_release(&nc_lock);
+	return gen;
+}
+
+/*
+ * Record that NAME in DIR refers to VN (or, if VN is NULL, that it
+ * does not exist). GEN is what vfs_namecache_gen returned before the
+ * filesystem was asked; if anything has been invalidated since, the
+ * answer may be stale and is not entered.
+ */
+void
+vfs_namecache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		    unsigned gen)
+{
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	struct ncentry *nc;
+
+	if (!nc_cacheable(name)) {
+		return;
+	}
+
+	spinlock_acquire(&nc_lock);
+	if (gen != nc_gen || nc_find(dir, name) != NULL) {
+		spinlock_release(&nc_lock);
+		return;
+	}
+
+	/* Recycle the least recently used entry */
+	nc = nc_lruhead;
+	KASSERT(nc != NULL);
+	if (nc->nc_dir != NULL) {
+		nc_detach(nc, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+
+	nc->nc_hashnext = nc_hash[nc_hashfunc(dir, name)];
+	nc_hash[nc_hashfunc(dir, name)] = nc;
+	nc_lru_remove(nc);
+	nc_lru_addtail(nc);
+	nc_enters++;
+	spinlock_release(&nc_lock);
+
+	nc_dropref(olddir, oldvn);
+}
+
+/*
+ * NAME in DIR has been (or may have been) created, removed, or
+ * renamed; forget what we know about it. If it was a directory, also
+ * forget the names in it.
+ */
+void
+vfs_namecache_remove(struct vnode *dir, const char *name)
+{
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	struct ncentry *nc;
+
+	spinlock_acquire(&nc_lock);
+	nc_gen++;
+	nc = (strlen(name) < VFS_NCNAMELEN) ? nc_find(dir, name) : NULL;
+	if (nc != NULL) {
+		nc_detach(nc, &olddir, &oldvn);
+		nc_invalidations++;
+	}
+	spinlock_release(&nc_lock);
+
+	if (oldvn != NULL) {
+		nc_purge(NULL, oldvn);
+	}
+	nc_dropref(olddir, oldvn);
+}
+
+/*
+ * Forget everything on filesystem FS; used before unmounting it.
+ */
+void
+vfs_namecache_purgefs(struct fs *fs)
+{
+	nc_purge(fs, NULL);
+}
+
+/*
+ * Print hit/miss counters.
+ */
+void
+vfs_namecache_printstats(void)
+{
+	unsigned hits, neghits, misses, uncacheable, enters, invalidations;
+	unsigned inuse, negative, i, lookups;
+
+	spinlock_acquire(&nc_lock);
+	hits = nc_hits;
+	neghits = nc_neghits;
+	misses = nc_misses;
+	uncacheable = nc_uncacheable;
+	enters = nc_enters;
+	invalidations = nc_invalidations;
+	inuse = negative = 0;
+	for (i=0; i<NC_SIZE; i++) {
+		if (nc_entries[i].nc_dir != NULL) {
+			inuse++;
+			if (nc_entries[i].nc_vn == NULL) {
+				negative++;
+			}
+		}
+	}
+	spinlock_release(&nc_lock);
+
+	lookups = hits + neghits + misses + uncacheable;
+	kprintf("Name cache: %u/%u entries in use (%u negative)\n",
+		inuse, NC_SIZE, negative);
+	kprintf("    %u lookups: %u hits, %u negative hits, %u misses, "
+		"%u not cacheable\n", lookups, hits, neghits, misses,
+		uncacheable);
+	if (lookups > 0) {
+		kprintf("    hit rate %u%%\n",
+			(hits + neghits) * 100 / lookups);
+	}
+	kprintf("    %u entries made, %u invalidated\n",
+		enters, invalidations);
+}
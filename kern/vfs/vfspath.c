@@ -29,6 +29,10 @@
 
 /*
  * High-level VFS operations on pathnames.
+ *
+ * Anything that creates, removes, or renames a name tells the name
+ * cache to forget it afterwards, whether or not the operation
+ * succeeded.
  */
 
 #include <types.h>
@@ -75,6 +79,9 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
 
+		/* Drop any negative name cache entry */
+		vfs_namecache_remove(dir, name);
+
 		VOP_DECREF(dir);
 	}
 	else {
@@ -146,6 +153,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	vfs_namecache_remove(dir, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -179,6 +187,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_namecache_remove(olddir, oldname);
+	vfs_namecache_remove(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -213,6 +223,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	vfs_namecache_remove(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -240,6 +251,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	vfs_namecache_remove(newdir, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -286,6 +298,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	vfs_namecache_remove(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -308,6 +321,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	vfs_namecache_remove(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -96,7 +96,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 
 	while (oldr != NULL) {
 		/* allocate memory to new region */
-		newr = kmalloc(sizeof(struct region));
+		newr = region_alloc();
 		if (newr == NULL) {
 			as_destroy(newas);
 			return ENOMEM; // out of memory!
@@ -145,7 +145,7 @@ as_destroy(struct addrspace *as)
 	current = as->regions;
 	while (current != NULL) {
 		next = current->next;
-		kfree(current);
+		region_free(current);
 		current = next;
 	}
 	as->regions = NULL;
@@ -214,7 +214,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 
 	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	struct region *new_region = kmalloc(sizeof(struct region));
+	struct region *new_region = region_alloc();
 	if (new_region == NULL) return ENOMEM;
 	uint32_t flags = readable | writeable | executable;
 	// if (writeable) flags |= PF_W;
@@ -29,29 +29,19 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
 #include <vm.h>
+#include "opt-unsw.h"
+#include "opt-kmallocdebug.h"
 
 /*
  * Kernel malloc.
  */
 
-
-/*
- * Fill a block with 0xdeadbeef.
- */
-static
-void
-fill_deadbeef(void *vptr, size_t len)
-{
-	uint32_t *ptr = vptr;
-	size_t i;
-
-	for (i=0; i<len/sizeof(uint32_t); i++) {
-		ptr[i] = 0xdeadbeef;
-	}
-}
-
 ////////////////////////////////////////////////////////////
 //
 // Pool-based subpage allocator.
@@ -78,12 +68,26 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    With the UNSW frame allocator, each heap page's pageref is also
+//    recorded in the frame table, so kfree can go straight from a
+//    pointer to its pageref instead of searching the list of all
+//    pages.
+//
 
 ////////////////////////////////////////
 
 /*
  * Debugging modes.
  *
+ * These are only available in kernels configured with "options
+ * kmallocdebug", as the debug configs (e.g. GENERIC, ASST3) are. In
+ * the others (e.g. GENERIC-OPT) they are all compiled out, including
+ * the 0xdeadbeef fill of freed blocks, and the kmalloc and kfree
+ * paths carry no checking code at all.
+ *
+ * POISON fills freed blocks with 0xdeadbeef to make uses of dangling
+ * pointers easier to detect. It is always on in debug kernels.
+ *
  * SLOW enables consistency checks; this will check the integrity of
  * kernel heap pages that kmalloc touches in the course of ordinary
  * operations.
@@ -111,8 +115,17 @@ fill_deadbeef(void *vptr, size_t len)
  * CHECKGUARDS checks that allocated blocks' guard bands are intact
  * when checking kernel heap pages with SLOW and SLOWER. This is also
  * quite slow in its own right.
+ *
+ * CHECKSAMPLE makes the SLOW and SLOWER checks run only one time in
+ * that many: one in CHECKSAMPLE of the single-page checks is done,
+ * and one in CHECKSAMPLE of the whole-heap scans. With 1 every check
+ * is done. Larger values make SLOWER, CHECKBEEF and CHECKGUARDS
+ * bearable on a busy system, at the cost of noticing corruption later.
  */
 
+#if OPT_KMALLOCDEBUG
+
+#define POISON
 #undef  SLOW
 #undef SLOWER
 #undef GUARDS
@@ -121,6 +134,27 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+#define CHECKSAMPLE 1
+
+#endif /* OPT_KMALLOCDEBUG */
+
+#ifdef POISON
+/*
+ * Fill a block with 0xdeadbeef.
+ */
+static
+void
+fill_deadbeef(void *vptr, size_t len)
+{
+	uint32_t *ptr = vptr;
+	size_t i;
+
+	for (i=0; i<len/sizeof(uint32_t); i++) {
+		ptr[i] = 0xdeadbeef;
+	}
+}
+#endif /* POISON */
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -450,6 +484,12 @@ checkguardband(vaddr_t blockaddr, size_t smallerblocksize, size_t blocksize)
 #endif
 #endif
 
+/* Per-cpu magazines (see below) need UNSW and no debugging modes */
+#if OPT_UNSW && !defined(SLOW) && !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+static void mag_printstats(void);
+#endif
+
 #ifdef CHECKBEEF
 /*
  * Check that a (free) block contains deadbeef as it should.
@@ -471,6 +511,26 @@ checkdeadbeef(void *block, size_t blocksize)
 #endif /* CHECKBEEF */
 
 #ifdef SLOW
+/*
+ * Sampling for the checks; see CHECKSAMPLE above. Returns true if
+ * this is the check in CHECKSAMPLE that should actually be done. The
+ * counters are protected by kmalloc_spinlock.
+ */
+static unsigned checksubpage_count, checksubpages_count;
+
+static
+bool
+checksample(unsigned *count)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (++*count < CHECKSAMPLE) {
+		return false;
+	}
+	*count = 0;
+	return true;
+}
+
 /*
  * Check that a particular heap page (the one managed by the argument
  * PR) is valid.
@@ -492,7 +552,7 @@ checkdeadbeef(void *block, size_t blocksize)
  */
 static
 void
-checksubpage(struct pageref *pr)
+do_checksubpage(struct pageref *pr)
 {
 	vaddr_t prpage, fla;
 	struct freelist *fl;
@@ -566,14 +626,27 @@ checksubpage(struct pageref *pr)
 	}
 #endif
 }
+
+/*
+ * Check a heap page, if the sampling says so.
+ */
+static
+void
+checksubpage(struct pageref *pr)
+{
+	if (checksample(&checksubpage_count)) {
+		do_checksubpage(pr);
+	}
+}
 #else
 #define checksubpage(pr) ((void)(pr))
 #endif
 
 #ifdef SLOWER
 /*
- * Run checksubpage on all heap pages. This also checks that the
- * linked lists of pagerefs are more or less intact.
+ * Check all heap pages. This also checks that the linked lists of
+ * pagerefs are more or less intact. Sampled as a whole: when it
+ * runs, every page is checked.
  */
 static
 void
@@ -585,16 +658,20 @@ checksubpages(void)
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
+	if (!checksample(&checksubpages_count)) {
+		return;
+	}
+
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			checksubpage(pr);
+			do_checksubpage(pr);
 			KASSERT(sc < TOTAL_PAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
+		do_checksubpage(pr);
 		KASSERT(ac < TOTAL_PAGEREFS);
 		ac++;
 	}
@@ -812,6 +889,10 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	mag_printstats();
+#endif
 }
 
 ////////////////////////////////////////
@@ -866,6 +947,341 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take the first block off the freelist of the page PR manages.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Put the block at PTRADDR back on the freelist of the page PR
+ * manages. If that makes the whole page free, release the pageref and
+ * return the page address, which the caller should pass to
+ * free_kpages once it has dropped kmalloc_spinlock. Otherwise return
+ * 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+
+	fl = (struct freelist *)ptraddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+#if OPT_UNSW
+		kpage_setowner(prpage, NULL);
+#endif
+		return prpage;
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps, for each block size, a small stack ("magazine") of
+ * free blocks. kmalloc and kfree use the local magazine when they
+ * can, which only needs interrupts off on this cpu rather than
+ * kmalloc_spinlock. When it's empty or full, half a magazine's worth
+ * of blocks is moved from or to the page freelists in one go under
+ * the lock.
+ *
+ * kfree needs the frame table to find a block's page without the
+ * lock, so this requires OPT_UNSW. Blocks sitting in a magazine still
+ * look allocated to their page (e.g. in kheap_printstats, and they
+ * keep it from being released), so the debugging modes, which check
+ * pages, turn magazines off; see above.
+ */
+
+#ifdef MAGAZINES
+
+#define MAG_MAXCPUS 32
+#define MAG_SIZE 16
+
+struct magazine {
+	unsigned nrounds;
+	void *rounds[MAG_SIZE];
+	unsigned allochits, allocmisses;
+	unsigned freehits, freemisses;
+};
+
+static struct magazine magazines[MAG_MAXCPUS][NSIZES];
+
+/*
+ * How many blocks a magazine holds. Keep it to half a page or less
+ * for the big sizes, so magazines don't pin down much memory.
+ */
+static
+unsigned
+mag_capacity(unsigned blktype)
+{
+	unsigned n;
+
+	n = PAGE_SIZE / 2 / sizes[blktype];
+	if (n > MAG_SIZE) {
+		n = MAG_SIZE;
+	}
+	return n;
+}
+
+/*
+ * Get this cpu's magazine for BLKTYPE, or NULL if we can't use one.
+ * Call with interrupts off, so we can't be moved to another cpu.
+ */
+static
+struct magazine *
+mag_get(unsigned blktype)
+{
+	if (!CURCPU_EXISTS() || curcpu->c_number >= MAG_MAXCPUS) {
+		return NULL;
+	}
+	return &magazines[curcpu->c_number][blktype];
+}
+
+/*
+ * Fill an empty magazine halfway from pages that have free blocks.
+ * Doesn't allocate new pages; if there are no free blocks the
+ * magazine stays empty and the caller takes the slow path.
+ */
+static
+void
+mag_refill(struct magazine *m, unsigned blktype)
+{
+	struct pageref *pr;
+	unsigned want;
+
+	want = DIVROUNDUP(mag_capacity(blktype), 2);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = sizebases[blktype];
+	     pr != NULL && m->nrounds < want;
+	     pr = pr->next_samesize) {
+		while (pr->nfree > 0 && m->nrounds < want) {
+			m->rounds[m->nrounds++] = subpage_takeblock(pr);
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Return the older half of a full magazine to the page freelists.
+ */
+static
+void
+mag_drain(struct magazine *m, unsigned blktype)
+{
+	vaddr_t freepages[MAG_SIZE];
+	unsigned nfreepages, n, i;
+	struct pageref *pr;
+	vaddr_t ptraddr, page;
+
+	n = DIVROUNDUP(mag_capacity(blktype), 2);
+	KASSERT(n <= m->nrounds);
+	nfreepages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		ptraddr = (vaddr_t)m->rounds[i];
+		pr = kpage_getowner(ptraddr);
+		KASSERT(pr != NULL);
+		page = subpage_putblock(pr, ptraddr);
+		if (page != 0) {
+			freepages[nfreepages++] = page;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	m->nrounds -= n;
+	for (i=0; i<m->nrounds; i++) {
+		m->rounds[i] = m->rounds[i + n];
+	}
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Get a block from this cpu's magazine. Returns NULL if there's no
+ * magazine or it can't be filled.
+ */
+static
+void *
+mag_alloc(unsigned blktype)
+{
+	struct magazine *m;
+	void *ret;
+	int spl;
+
+	spl = splhigh();
+	m = mag_get(blktype);
+	if (m == NULL) {
+		splx(spl);
+		return NULL;
+	}
+	if (m->nrounds > 0) {
+		m->allochits++;
+	}
+	else {
+		m->allocmisses++;
+		mag_refill(m, blktype);
+		if (m->nrounds == 0) {
+			splx(spl);
+			return NULL;
+		}
+	}
+	ret = m->rounds[--m->nrounds];
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Put a block in this cpu's magazine. Returns false if there's no
+ * magazine.
+ *
+ * With POISON on, check the block isn't already in the magazine; the
+ * slow path's freelist check doesn't see blocks sitting here, so a
+ * double kfree would otherwise hand the block out twice. (Like that
+ * check, this only catches the common case of freeing the same block
+ * twice in a row on the same cpu.)
+ */
+static
+bool
+mag_free(vaddr_t ptraddr, unsigned blktype)
+{
+	struct magazine *m;
+	int spl;
+#ifdef POISON
+	unsigned i;
+#endif
+
+	spl = splhigh();
+	m = mag_get(blktype);
+	if (m == NULL) {
+		splx(spl);
+		return false;
+	}
+#ifdef POISON
+	for (i=0; i<m->nrounds; i++) {
+		if (m->rounds[i] == (void *)ptraddr) {
+			panic("kfree: block %p freed twice\n",
+			      (void *)ptraddr);
+		}
+	}
+#endif
+	if (m->nrounds < mag_capacity(blktype)) {
+		m->freehits++;
+	}
+	else {
+		m->freemisses++;
+		mag_drain(m, blktype);
+	}
+	m->rounds[m->nrounds++] = (void *)ptraddr;
+	splx(spl);
+	return true;
+}
+
+/*
+ * Print per-cpu hit rates.
+ */
+static
+void
+mag_printstats(void)
+{
+	unsigned cpu, i;
+	unsigned ah, am, fh, fm;
+	struct magazine *m;
+
+	kprintf("Magazine hit rates:\n");
+	for (cpu=0; cpu<MAG_MAXCPUS; cpu++) {
+		ah = am = fh = fm = 0;
+		for (i=0; i<NSIZES; i++) {
+			m = &magazines[cpu][i];
+			ah += m->allochits;
+			am += m->allocmisses;
+			fh += m->freehits;
+			fm += m->freemisses;
+		}
+		if (ah + am + fh + fm == 0) {
+			continue;
+		}
+		kprintf("   cpu%u: kmalloc %u/%u hits, kfree %u/%u hits\n",
+			cpu, ah, ah + am, fh, fh + fm);
+	}
+}
+
+#endif /* MAGAZINES */
+
+////////////////////////////////////////
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -907,6 +1323,13 @@ subpage_kmalloc(size_t sz
 	sz = sizes[blktype];
 #endif
 
+#ifdef MAGAZINES
+	retptr = mag_alloc(blktype);
+	if (retptr != NULL) {
+		return retptr;
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -921,25 +1344,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -988,6 +1393,9 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+#if OPT_UNSW
+	kpage_setowner(prpage, pr);
+#endif
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1029,8 +1437,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1061,6 +1467,33 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
+#ifdef MAGAZINES
+	/*
+	 * Fast path: find the page through the frame table and put
+	 * the block in this cpu's magazine. No lock is needed to look
+	 * at the pageref, because its page can't go away while the
+	 * block we're freeing is still allocated.
+	 */
+	pr = kpage_getowner(ptraddr);
+	if (pr == NULL) {
+		/* Not on any of our pages - not a subpage allocation */
+		return -1;
+	}
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	offset = ptraddr - prpage;
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+#ifdef POISON
+	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+#endif
+	if (mag_free(ptraddr, blktype)) {
+		return 0;
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -1069,6 +1502,18 @@ subpage_kfree(void *ptr)
 	prpage = 0;
 	blktype = 0;
 
+#if OPT_UNSW
+	pr = kpage_getowner(ptraddr);
+	if (pr != NULL) {
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+
+		/* check for corruption */
+		KASSERT(blktype>=0 && blktype<NSIZES);
+		KASSERT(ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE);
+		checksubpage(pr);
+	}
+#else
 	for (pr = allbase; pr; pr = pr->next_all) {
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
@@ -1082,6 +1527,7 @@ subpage_kfree(void *ptr)
 			break;
 		}
 	}
+#endif
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
@@ -1102,53 +1548,25 @@ subpage_kfree(void *ptr)
 	checkguardband(ptraddr, smallerblocksize, blocksize);
 #endif
 
+#ifdef POISON
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+#endif
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
 	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
+	prpage = subpage_putblock(pr, ptraddr);
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (prpage != 0) {
 		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -1162,6 +1580,339 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Heap profiler.
+//
+// While it's running (see kheap_profstart) this records the call
+// site (kmalloc's return address) and size of a sample of kmalloc
+// calls, and keeps per-site totals of live bytes and allocations, so
+// we can see which call sites are holding the most memory. One in
+// every RATE allocations is tracked and the totals are scaled up by
+// RATE when printed; with a rate of 1 they are exact. Unlike LABELS
+// this doesn't change the heap layout and works in any kernel.
+//
+// When it's not running, kmalloc and kfree only pay for testing
+// khprof_on. When it is, an allocation that isn't sampled costs a
+// counter decrement, and a kfree looks at one hash bucket without
+// the lock; it only takes khprof_lock if the bucket isn't empty.
+//
+// It can't use kmalloc, so the tables are fixed-size arrays: sites
+// in an open-addressed hash on the return address and tracked
+// blocks in a chained hash on the block address. Samples that don't
+// fit are counted as dropped. Stopping the profiler freezes the
+// tables so they can still be printed; starting it again clears
+// them.
+//
+
+#define KHPROF_HASHBITS  8
+#define KHPROF_NSITES    (1 << KHPROF_HASHBITS)
+#define KHPROF_NBUCKETS  (1 << KHPROF_HASHBITS)
+#define KHPROF_NBLOCKS   1024
+#define KHPROF_NONE      0xffff
+#define KHPROF_MAXTOP    20
+
+struct khprof_site {
+	vaddr_t ks_site;		/* return address; 0 if unused */
+	uint32_t ks_livebytes;		/* sampled bytes still allocated */
+	uint32_t ks_liveblocks;		/* sampled blocks still allocated */
+	uint32_t ks_allocs;		/* sampled allocations in total */
+};
+
+struct khprof_block {
+	vaddr_t kb_addr;		/* block address */
+	uint32_t kb_size;		/* size requested */
+	uint16_t kb_site;		/* index into khprof_sites */
+	uint16_t kb_next;		/* hash chain, or free list */
+};
+
+static struct spinlock khprof_lock = SPINLOCK_INITIALIZER;
+static volatile bool khprof_on;		/* tested without the lock */
+static unsigned khprof_countdown;	/* allocations until next sample */
+static unsigned khprof_rate;		/* 0 if never started */
+static unsigned khprof_dropped;
+static struct timespec khprof_started, khprof_stopped;
+static struct khprof_site khprof_sites[KHPROF_NSITES];
+static struct khprof_block khprof_blocks[KHPROF_NBLOCKS];
+static uint16_t khprof_buckets[KHPROF_NBUCKETS];
+static uint16_t khprof_freeblocks;
+
+/*
+ * Multiplicative hash down to KHPROF_HASHBITS bits.
+ */
+static
+unsigned
+khprof_hash(vaddr_t addr)
+{
+	return ((uint32_t)addr * 2654435761U) >> (32 - KHPROF_HASHBITS);
+}
+
+/*
+ * Find the slot for SITE, claiming an empty one if it isn't there
+ * yet. Returns KHPROF_NONE if the table is full.
+ */
+static
+unsigned
+khprof_findsite(vaddr_t site)
+{
+	unsigned h, i;
+
+	KASSERT(spinlock_do_i_hold(&khprof_lock));
+
+	h = khprof_hash(site);
+	for (i=0; i<KHPROF_NSITES; i++) {
+		struct khprof_site *ks;
+
+		ks = &khprof_sites[(h + i) % KHPROF_NSITES];
+		if (ks->ks_site == site) {
+			return (h + i) % KHPROF_NSITES;
+		}
+		if (ks->ks_site == 0) {
+			ks->ks_site = site;
+			return (h + i) % KHPROF_NSITES;
+		}
+	}
+	return KHPROF_NONE;
+}
+
+/*
+ * Record an allocation, if it's the one to sample.
+ *
+ * The countdown is updated without the lock. A racing update can
+ * only store a value between 0 and the rate, so at worst it moves
+ * the next sample a little.
+ */
+static
+void
+khprof_alloc(void *ptr, size_t sz, vaddr_t site)
+{
+	unsigned c, s, b, h;
+
+	c = khprof_countdown;
+	if (c > 1) {
+		khprof_countdown = c - 1;
+		return;
+	}
+
+	spinlock_acquire(&khprof_lock);
+	if (!khprof_on) {
+		/* stopped behind our back */
+		spinlock_release(&khprof_lock);
+		return;
+	}
+	khprof_countdown = khprof_rate;
+
+	s = khprof_findsite(site);
+	b = khprof_freeblocks;
+	if (s == KHPROF_NONE || b == KHPROF_NONE) {
+		khprof_dropped++;
+		spinlock_release(&khprof_lock);
+		return;
+	}
+	khprof_freeblocks = khprof_blocks[b].kb_next;
+
+	khprof_blocks[b].kb_addr = (vaddr_t)ptr;
+	khprof_blocks[b].kb_size = sz;
+	khprof_blocks[b].kb_site = s;
+	h = khprof_hash((vaddr_t)ptr);
+	khprof_blocks[b].kb_next = khprof_buckets[h];
+	khprof_buckets[h] = b;
+
+	khprof_sites[s].ks_livebytes += sz;
+	khprof_sites[s].ks_liveblocks++;
+	khprof_sites[s].ks_allocs++;
+
+	spinlock_release(&khprof_lock);
+}
+
+/*
+ * Note that a block is being freed, if it's one we're tracking.
+ *
+ * Most frees are of blocks that weren't sampled, so first look at
+ * the block's hash bucket without the lock: if the block is tracked
+ * it was put there before kmalloc returned it, so an empty bucket
+ * means there's nothing to do. Only a non-empty bucket costs the
+ * lock.
+ */
+static
+void
+khprof_free(void *ptr)
+{
+	struct khprof_site *ks;
+	uint16_t *bp;
+	unsigned b, h;
+
+	h = khprof_hash((vaddr_t)ptr);
+	if (khprof_buckets[h] == KHPROF_NONE) {
+		return;
+	}
+
+	spinlock_acquire(&khprof_lock);
+	if (!khprof_on) {
+		spinlock_release(&khprof_lock);
+		return;
+	}
+	for (bp = &khprof_buckets[h];
+	     *bp != KHPROF_NONE; bp = &khprof_blocks[*bp].kb_next) {
+		b = *bp;
+		if (khprof_blocks[b].kb_addr == (vaddr_t)ptr) {
+			*bp = khprof_blocks[b].kb_next;
+
+			ks = &khprof_sites[khprof_blocks[b].kb_site];
+			KASSERT(ks->ks_liveblocks > 0);
+			KASSERT(ks->ks_livebytes >= khprof_blocks[b].kb_size);
+			ks->ks_livebytes -= khprof_blocks[b].kb_size;
+			ks->ks_liveblocks--;
+
+			khprof_blocks[b].kb_next = khprof_freeblocks;
+			khprof_freeblocks = b;
+			break;
+		}
+	}
+	spinlock_release(&khprof_lock);
+}
+
+/*
+ * Start profiling, sampling one in RATE allocations. Discards any
+ * previous profile.
+ */
+void
+kheap_profstart(unsigned rate)
+{
+	struct timespec now;
+	unsigned i;
+
+	KASSERT(rate > 0);
+	gettime(&now);
+
+	spinlock_acquire(&khprof_lock);
+	for (i=0; i<KHPROF_NSITES; i++) {
+		khprof_sites[i].ks_site = 0;
+		khprof_sites[i].ks_livebytes = 0;
+		khprof_sites[i].ks_liveblocks = 0;
+		khprof_sites[i].ks_allocs = 0;
+	}
+	for (i=0; i<KHPROF_NBUCKETS; i++) {
+		khprof_buckets[i] = KHPROF_NONE;
+	}
+	for (i=0; i<KHPROF_NBLOCKS; i++) {
+		khprof_blocks[i].kb_next =
+			i + 1 < KHPROF_NBLOCKS ? i + 1 : KHPROF_NONE;
+	}
+	khprof_freeblocks = 0;
+	khprof_dropped = 0;
+	khprof_rate = rate;
+	khprof_countdown = rate;
+	khprof_started = now;
+	khprof_on = true;
+	spinlock_release(&khprof_lock);
+}
+
+/*
+ * Stop profiling, keeping the profile.
+ */
+void
+kheap_profstop(void)
+{
+	struct timespec now;
+
+	gettime(&now);
+
+	spinlock_acquire(&khprof_lock);
+	if (khprof_on) {
+		khprof_on = false;
+		khprof_stopped = now;
+	}
+	spinlock_release(&khprof_lock);
+}
+
+/*
+ * Print the (up to) MAXSITES call sites holding the most memory,
+ * with estimated live bytes and blocks, total allocations, and the
+ * allocation rate since profiling started.
+ */
+void
+kheap_profdump(unsigned maxsites)
+{
+	struct khprof_site top[KHPROF_MAXTOP], *ks;
+	unsigned ntop, nsites, i, j, rate, dropped;
+	uint64_t livebytes, ms;
+	struct timespec now;
+	bool running;
+
+	if (maxsites > KHPROF_MAXTOP) {
+		maxsites = KHPROF_MAXTOP;
+	}
+	gettime(&now);
+
+	/* Pick the top sites under the lock; print them afterwards. */
+	spinlock_acquire(&khprof_lock);
+	rate = khprof_rate;
+	if (rate == 0) {
+		spinlock_release(&khprof_lock);
+		kprintf("The heap profiler has not been started.\n");
+		return;
+	}
+	running = khprof_on;
+	if (!running) {
+		now = khprof_stopped;
+	}
+	timespec_sub(&now, &khprof_started, &now);
+	dropped = khprof_dropped;
+
+	ntop = nsites = 0;
+	livebytes = 0;
+	for (i=0; i<KHPROF_NSITES; i++) {
+		ks = &khprof_sites[i];
+		if (ks->ks_site == 0) {
+			continue;
+		}
+		nsites++;
+		livebytes += ks->ks_livebytes;
+
+		/* insertion into top[], largest first */
+		for (j = ntop; j > 0; j--) {
+			if (top[j-1].ks_livebytes >= ks->ks_livebytes) {
+				break;
+			}
+			if (j < maxsites) {
+				top[j] = top[j-1];
+			}
+		}
+		if (j < maxsites) {
+			top[j] = *ks;
+			if (ntop < maxsites) {
+				ntop++;
+			}
+		}
+	}
+	spinlock_release(&khprof_lock);
+
+	ms = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+	kprintf("Heap profile (%s, %lu.%03lu s, sampling 1 in %u):\n",
+		running ? "running" : "stopped",
+		(unsigned long)(ms / 1000), (unsigned long)(ms % 1000), rate);
+	kprintf("    about %lu bytes live from %u call sites\n",
+		(unsigned long)(livebytes * rate), nsites);
+	kprintf("    %-10s %10s %8s %8s %8s\n",
+		"site", "bytes", "blocks", "allocs", "allocs/s");
+	for (i=0; i<ntop; i++) {
+		ks = &top[i];
+		kprintf("    0x%08lx %10lu %8lu %8lu %8lu\n",
+			(unsigned long)ks->ks_site,
+			(unsigned long)ks->ks_livebytes * rate,
+			(unsigned long)ks->ks_liveblocks * rate,
+			(unsigned long)ks->ks_allocs * rate,
+			ms == 0 ? 0UL :
+			(unsigned long)(ks->ks_allocs * 1000ULL * rate / ms));
+	}
+	if (dropped > 0) {
+		kprintf("    (%u samples dropped, tables full)\n", dropped);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
  * alloc_kpages depending on how big SZ is.
@@ -1170,6 +1921,7 @@ void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
+	void *ret;
 #ifdef LABELS
 	vaddr_t label;
 #endif
@@ -1195,14 +1947,21 @@ kmalloc(size_t sz)
 		}
 		KASSERT(address % PAGE_SIZE == 0);
 
-		return (void *)address;
+		ret = (void *)address;
 	}
-
+	else {
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+		ret = subpage_kmalloc(sz, label);
 #else
-	return subpage_kmalloc(sz);
+		ret = subpage_kmalloc(sz);
 #endif
+	}
+
+	if (khprof_on && ret != NULL) {
+		khprof_alloc(ret, sz,
+			     (vaddr_t)__builtin_return_address(0));
+	}
+	return ret;
 }
 
 /*
@@ -1216,7 +1975,11 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	if (khprof_on) {
+		khprof_free(ptr);
+	}
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Object caches. See objcache.h.
+ *
+ * Each cache keeps its free (but still constructed) objects in a
+ * fixed-size array used as a stack, so the most recently freed and
+ * most likely cache-warm object is reused first. The array and the
+ * counters are protected by a spinlock; constructors and destructors
+ * may sleep (e.g. lock_create) and so are always called without it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <objcache.h>
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+
+	struct spinlock oc_lock;	/* protects everything below */
+	void **oc_free;			/* free constructed objects */
+	unsigned oc_nfree;		/* number of objects in oc_free */
+	unsigned oc_maxfree;		/* size of oc_free */
+
+	/* statistics */
+	unsigned oc_live;		/* constructed objects, in use or free */
+	unsigned oc_gets;		/* calls to objcache_get */
+	unsigned oc_hits;		/* ... that reused a free object */
+	unsigned oc_ctors;		/* constructor calls */
+	unsigned oc_dtors;		/* destructor calls */
+
+	struct objcache *oc_next;	/* list of all caches */
+};
+
+static struct spinlock objcache_listlock = SPINLOCK_INITIALIZER;
+static struct objcache *objcaches;
+
+/*
+ * Create a cache.
+ */
+struct objcache *
+objcache_create(const char *name, size_t size, unsigned maxfree,
+		int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct objcache *oc;
+
+	KASSERT(size > 0);
+	KASSERT(maxfree > 0);
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		panic("objcache_create: %s: Out of memory\n", name);
+	}
+	oc->oc_free = kmalloc(maxfree * sizeof(oc->oc_free[0]));
+	if (oc->oc_free == NULL) {
+		panic("objcache_create: %s: Out of memory\n", name);
+	}
+
+	oc->oc_name = name;
+	oc->oc_size = size;
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+	spinlock_init(&oc->oc_lock);
+	oc->oc_nfree = 0;
+	oc->oc_maxfree = maxfree;
+	oc->oc_live = 0;
+	oc->oc_gets = 0;
+	oc->oc_hits = 0;
+	oc->oc_ctors = 0;
+	oc->oc_dtors = 0;
+
+	spinlock_acquire(&objcache_listlock);
+	oc->oc_next = objcaches;
+	objcaches = oc;
+	spinlock_release(&objcache_listlock);
+
+	return oc;
+}
+
+/*
+ * Get an object: a free one if there is one, otherwise a freshly
+ * allocated and constructed one.
+ */
+void *
+objcache_get(struct objcache *oc)
+{
+	void *obj;
+
+	spinlock_acquire(&oc->oc_lock);
+	oc->oc_gets++;
+	if (oc->oc_nfree > 0) {
+		obj = oc->oc_free[--oc->oc_nfree];
+		oc->oc_hits++;
+		spinlock_release(&oc->oc_lock);
+		return obj;
+	}
+	spinlock_release(&oc->oc_lock);
+
+	obj = kmalloc(oc->oc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (oc->oc_ctor != NULL && oc->oc_ctor(obj)) {
+		kfree(obj);
+		return NULL;
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	oc->oc_ctors++;
+	oc->oc_live++;
+	spinlock_release(&oc->oc_lock);
+
+	return obj;
+}
+
+/*
+ * Give back an object. Keep it if there's room, otherwise destroy it.
+ */
+void
+objcache_put(struct objcache *oc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&oc->oc_lock);
+	if (oc->oc_nfree < oc->oc_maxfree) {
+		oc->oc_free[oc->oc_nfree++] = obj;
+		spinlock_release(&oc->oc_lock);
+		return;
+	}
+	KASSERT(oc->oc_live > 0);
+	oc->oc_live--;
+	oc->oc_dtors++;
+	spinlock_release(&oc->oc_lock);
+
+	if (oc->oc_dtor != NULL) {
+		oc->oc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Print the counters for all the caches.
+ */
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+	unsigned nfree, live, gets, hits, ctors, dtors;
+
+	kprintf("Object caches:\n");
+
+	/*
+	 * Caches are never destroyed and new ones go on the front, so
+	 * once we have the head the rest of the list won't change.
+	 * Don't hold the list lock across kprintf, which can sleep.
+	 */
+	spinlock_acquire(&objcache_listlock);
+	oc = objcaches;
+	spinlock_release(&objcache_listlock);
+
+	for (; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		nfree = oc->oc_nfree;
+		live = oc->oc_live;
+		gets = oc->oc_gets;
+		hits = oc->oc_hits;
+		ctors = oc->oc_ctors;
+		dtors = oc->oc_dtors;
+		spinlock_release(&oc->oc_lock);
+
+		kprintf("    %-16s %4lu bytes: %u in use, %u/%u free\n",
+			oc->oc_name, (unsigned long) oc->oc_size,
+			live - nfree, nfree, oc->oc_maxfree);
+		kprintf("        %u gets, %u reused (%u%% hit rate), "
+			"%u constructed, %u destroyed\n",
+			gets, hits, gets == 0 ? 0 : (hits * 100) / gets,
+			ctors, dtors);
+	}
+}
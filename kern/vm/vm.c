@@ -9,9 +9,35 @@
 #include <current.h>
 #include <elf.h>
 #include <spl.h>
+#include <objcache.h>
 
 /* Place your page table functions here */
 
+/*
+ * Object caches for regions and second-level page tables, which are
+ * allocated and freed on every fork, exec and exit. L2 tables go
+ * back into the cache all zero (destroy_pt clears each entry as it
+ * frees the page) so they only need zeroing once, when constructed.
+ */
+static struct objcache *region_cache;
+static struct objcache *pt_l2_cache;
+
+static int pt_l2_ctor(void *obj)
+{
+    bzero(obj, sizeof(paddr_t) * L2_PT_SIZE);
+    return 0;
+}
+
+struct region *region_alloc(void)
+{
+    return objcache_get(region_cache);
+}
+
+void region_free(struct region *r)
+{
+    objcache_put(region_cache, r);
+}
+
 /* PT init */
 int create_pt_l1(paddr_t ** pt) {
     pt = kmalloc(sizeof(paddr_t **) * L1_PT_SIZE);
@@ -27,13 +53,10 @@ int create_pt_l2(paddr_t ** pt, uint32_t msb)
     
     if (pt[msb] != NULL) return EINVAL;
 
-    pt[msb] = kmalloc(sizeof(paddr_t) * L2_PT_SIZE);
+    /* comes out of the cache already zeroed */
+    pt[msb] = objcache_get(pt_l2_cache);
     if (pt[msb] == NULL) return ENOMEM;
 
-    for (int lsb = 0; lsb < L2_PT_SIZE; lsb++) {
-        pt[msb][lsb] = 0;
-    }
-    
     return 0;
 }
 
@@ -72,7 +95,7 @@ int copy_pt(paddr_t ** pt_original, paddr_t ** pt_copy)
  
     for (int msb = 0; msb < L1_PT_SIZE; msb++) {
         if (pt_original[msb] != NULL) {
-            pt_copy[msb] = kmalloc(sizeof(paddr_t) * L2_PT_SIZE);
+            pt_copy[msb] = objcache_get(pt_l2_cache);
             if (pt_copy[msb] == NULL) return ENOMEM;
 
             for (int lsb = 0; lsb < L2_PT_SIZE; lsb++) {
@@ -105,7 +128,7 @@ void destroy_pt(paddr_t ** pt)
                      pt[msb][lsb] = 0;
                 }
             }
-            kfree(pt[msb]);
+            objcache_put(pt_l2_cache, pt[msb]);
         }
     }
 
@@ -115,7 +138,11 @@ void destroy_pt(paddr_t ** pt)
 /* Initialization function */
 void vm_bootstrap(void)
 {
-    /* empty */
+    region_cache = objcache_create("region", sizeof(struct region), 32,
+                                   NULL, NULL);
+    pt_l2_cache = objcache_create("L2 page table",
+                                  sizeof(paddr_t) * L2_PT_SIZE, 64,
+                                  pt_l2_ctor, NULL);
 }
 
 bool pte_exists(paddr_t ** pt, uint32_t msb, uint32_t lsb) {
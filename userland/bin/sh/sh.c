@@ -483,6 +483,11 @@ docommand(char *buf, struct exitinfo *ei)
  *
  * if there's an invalid character or a backspace when there's nothing
  * in the buffer, putchars an alert (bell).
+ *
+ * if stdin is the console, it's put in line mode instead, so the
+ * kernel does the editing and echoing and the whole line arrives in
+ * one read. it's put back in raw mode afterwards, which is what other
+ * programs expect.
  */
 static
 void
@@ -490,6 +495,38 @@ getcmd(char *buf, size_t len)
 {
 	size_t pos = 0;
 	int done=0, ch;
+#ifndef HOST
+	int raw = 0;
+	ssize_t r;
+
+	if (ioctl(STDIN_FILENO, CONSOLE_IOCTL_SETRAW, &raw) == 0) {
+		while (!done) {
+			r = read(STDIN_FILENO, buf + pos, len - 1 - pos);
+			if (r <= 0) {
+				break;
+			}
+			pos += r;
+			if (buf[pos-1] == '\n') {
+				pos--;
+				done = 1;
+			}
+			else if (pos == len-1) {
+				/* too long; throw away the rest of the line */
+				pos = 0;
+				while (read(STDIN_FILENO, &buf[0], 1) == 1 &&
+				       buf[0] != '\n') {
+					/* nothing */
+				}
+				putchar('\a');
+				done = 1;
+			}
+		}
+		buf[pos] = 0;
+		raw = 1;
+		ioctl(STDIN_FILENO, CONSOLE_IOCTL_SETRAW, &raw);
+		return;
+	}
+#endif
 
 	/*
 	 * In the absence of a <ctype.h>, assume input is 7-bit ASCII.
@@ -163,6 +163,14 @@ dumpsb(void)
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
 	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
 	dumplval("Volume name", sb.sb_volname);
+	if (sb.sb_journalblocks != 0) {
+		dumpvalf("Journal start", "%u", SWAP32(sb.sb_journalstart));
+		dumpvalf("Journal size", "%u blocks",
+			 SWAP32(sb.sb_journalblocks));
+	}
+	else {
+		dumpval("Journal", "none");
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -230,8 +238,74 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpjournal(void)
 {
+	struct sfs_superblock sb;
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+	struct sfs_jcommit jc;
+	uint32_t start, logsize, pos, seq, n, nr, i;
+
+	diskread(&sb, SFS_SUPER_BLOCK);
+	printf("Journal\n");
+	printf("-------\n");
+	if (sb.sb_journalblocks == 0) {
+		printf("    (none)\n\n");
+		return;
+	}
+	start = SWAP32(sb.sb_journalstart);
+	logsize = SWAP32(sb.sb_journalblocks) - 1;
+
+	diskread(&jh, start);
+	dumpvalf("Header magic", "0x%8x", SWAP32(jh.jh_magic));
+	dumpvalf("First seq", "%u", SWAP32(jh.jh_seq));
+	dumpvalf("First position", "%u", SWAP32(jh.jh_start));
+	printf("\n");
+
+	/* List the committed transactions, as replay would see them */
+	pos = SWAP32(jh.jh_start);
+	seq = SWAP32(jh.jh_seq);
+	while (pos + 2 <= logsize) {
+		diskread(&jd, start + 1 + pos);
+		n = SWAP32(jd.jd_nblocks);
+		nr = SWAP32(jd.jd_nrevoke);
+		if (SWAP32(jd.jd_magic) != SFS_JMAGIC_DESC ||
+		    SWAP32(jd.jd_seq) != seq ||
+		    n + nr > SFS_JDESCMAX || pos + n + 2 > logsize) {
+			break;
+		}
+		diskread(&jc, start + 1 + pos + n + 1);
+		if (SWAP32(jc.jc_magic) != SFS_JMAGIC_COMMIT ||
+		    SWAP32(jc.jc_seq) != seq) {
+			printf("    Transaction %u at %u: not committed\n",
+			       seq, pos);
+			break;
+		}
+		printf("    Transaction %u at %u: %u blocks, %u freed\n",
+		       seq, pos, n, nr);
+		for (i=0; i<n + nr; i++) {
+			if (i == n) {
+				printf("\n      freed:");
+			}
+			else if (i == 0) {
+				printf("      ");
+			}
+			printf(" %u", SWAP32(jd.jd_blocks[i]));
+		}
+		printf("\n");
+		pos += n + 2;
+		seq++;
+	}
+	printf("\n");
+}
+
+static
+void
+dumpindirect(uint32_t block, unsigned levels)
+{
+	static const char *const names[] = { "", "Indirect",
+					     "Double indirect",
+					     "Triple indirect" };
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	char tmp[128];
 	unsigned i;
@@ -239,7 +313,7 @@ dumpindirect(uint32_t block)
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("%s block %u\n", names[levels], block);
 
 	diskread(ib, block);
 	for (i=0; i<ARRAYCOUNT(ib); i++) {
@@ -253,12 +327,17 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+	if (levels > 1) {
+		for (i=0; i<ARRAYCOUNT(ib); i++) {
+			dumpindirect(SWAP32(ib[i]), levels - 1);
+		}
+	}
 }
 
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned levels, void (*doblock)(uint32_t, uint32_t))
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	unsigned i;
@@ -270,7 +349,14 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 		diskread(ib, block);
 	}
 	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+		if (levels > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), levels - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
@@ -291,7 +377,15 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3, doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -374,23 +468,19 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 	printf("Done with directory %u\n", ino);
 }
 
+/*
+ * Hex dump LEN bytes of file data that start at file offset BASE.
+ */
 static
-void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+void
+dumpdata(const uint8_t *data, unsigned len, uint32_t base)
 {
-	uint8_t data[SFS_BLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
-	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
-		return;
-	}
-
-	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0) {
-			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+			snprintf(tmp, sizeof(tmp), "0x%x", base + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -400,9 +490,13 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 			printf(" ");
 		}
 		printf("%02x", data[i]);
-		if (i % 16 == 15) {
+		if (i % 16 == 15 || i == len-1) {
+			/* Line up the text of a short last line */
+			for (j = i % 16; j < 15; j++) {
+				printf(j % 8 == 7 ? "    " : "   ");
+			}
 			printf("  ");
-			for (j = i-15; j<=i; j++) {
+			for (j = i - i % 16; j<=i; j++) {
 				if (data[j] < 32 || data[j] > 126) {
 					putchar('.');
 				}
@@ -415,11 +509,36 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint8_t data[SFS_BLOCKSIZE];
+
+	if (diskblock == 0) {
+		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
+		return;
+	}
+
+	diskread(data, diskblock);
+	dumpdata(data, SFS_BLOCKSIZE, fileblock * SFS_BLOCKSIZE);
+}
+
 static
 void
 dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 {
+	uint32_t size;
+
 	printf("File contents for inode %u:\n", ino);
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_INLINE) {
+		size = SWAP32(sfi->sfi_size);
+		if (size > SFS_INLINESIZE) {
+			size = SFS_INLINESIZE;
+		}
+		printf("    [inline]\n");
+		dumpdata((const uint8_t *)sfi->sfi_inline, size, 0);
+		return;
+	}
 	traverse(sfi, dumpfileblock);
 }
 
@@ -449,6 +568,8 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	dumpvalf("Flags", "0x%x%s", SWAP32(sfi.sfi_flags),
+		 (SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) ? " (inline)" : "");
 	printf("\n");
 
         printf("    Direct blocks:\n");
@@ -476,15 +597,23 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
-	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
-		if (sfi.sfi_waste[i] != 0) {
-			printf("    Word %u in waste area: 0x%x\n",
-			       i, SWAP32(sfi.sfi_waste[i]));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
+	if ((SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) == 0) {
+		for (i=0; i<ARRAYCOUNT(sfi.sfi_inline); i++) {
+			if (sfi.sfi_inline[i] != 0) {
+				printf("    Byte %u in inline area: 0x%x\n",
+				       i, (uint8_t)sfi.sfi_inline[i]);
+			}
 		}
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -508,12 +637,13 @@ usage(void)
 	warnx("Usage: dumpsfs [options] device/diskfile");
 	warnx("   -s: dump superblock");
 	warnx("   -b: dump free block bitmap");
+	warnx("   -j: dump journal");
 	warnx("   -i ino: dump specified inode");
 	warnx("   -I: dump indirect blocks");
 	warnx("   -f: dump file contents");
 	warnx("   -d: dump directory contents");
 	warnx("   -r: recurse into directory contents");
-	warnx("   -a: equivalent to -sbdfr -i 1");
+	warnx("   -a: equivalent to -sbjdfr -i 1");
 	errx(1, "   Default is -i 1");
 }
 
@@ -522,6 +652,7 @@ main(int argc, char **argv)
 {
 	bool dosb = false;
 	bool dofreemap = false;
+	bool dojournal = false;
 	uint32_t dumpino = 0;
 	const char *dumpdisk = NULL;
 
@@ -540,6 +671,7 @@ main(int argc, char **argv)
 				switch (argv[i][j]) {
 				    case 's': dosb = true; break;
 				    case 'b': dofreemap = true; break;
+				    case 'j': dojournal = true; break;
 				    case 'i':
 					if (argv[i][j+1] == 0) {
 						dumpino = atoi(argv[++i]);
@@ -557,6 +689,7 @@ main(int argc, char **argv)
 				    case 'a':
 					dosb = true;
 					dofreemap = true;
+					dojournal = true;
 					if (dumpino == 0) {
 						dumpino = SFS_ROOTDIR_INO;
 					}
@@ -584,7 +717,7 @@ main(int argc, char **argv)
 		usage();
 	}
 
-	if (!dosb && !dofreemap && dumpino == 0) {
+	if (!dosb && !dofreemap && !dojournal && dumpino == 0) {
 		dumpino = SFS_ROOTDIR_INO;
 	}
 
@@ -597,6 +730,9 @@ main(int argc, char **argv)
 	if (dofreemap) {
 		dumpfreemap(nblocks);
 	}
+	if (dojournal) {
+		dumpjournal();
+	}
 	if (dumpino != 0) {
 		dumpinode(dumpino, NULL);
 	}
@@ -58,7 +58,7 @@
 #include "disk.h"
 
 /* Maximum size of freemap we support */
-#define MAXFREEMAPBLOCKS 32
+#define MAXFREEMAPBLOCKS 256
 
 /* Free block bitmap */
 static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
@@ -73,6 +73,9 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 }
 
 /*
@@ -118,6 +121,11 @@ initfreemap(uint32_t fsblocks)
 	for (i=fsblocks; i<freemapbits; i++) {
 		allocblock(i);
 	}
+
+	/* so is the journal, which goes right after the freemap */
+	for (i=0; i<SFS_JOURNALBLOCKS(fsblocks); i++) {
+		allocblock(SFS_FREEMAP_START + freemapblocks + i);
+	}
 }
 
 /*
@@ -140,6 +148,11 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	if (SFS_JOURNALBLOCKS(nblocks) > 0) {
+		sb.sb_journalstart =
+			SWAP32(SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(nblocks));
+		sb.sb_journalblocks = SWAP32(SFS_JOURNALBLOCKS(nblocks));
+	}
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -164,6 +177,36 @@ writefreemap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Write out an empty journal, if the volume gets one. The whole log
+ * is zeroed so nothing left over on the disk can look like a
+ * transaction.
+ */
+static
+void
+writejournal(uint32_t fsblocks)
+{
+	struct sfs_jheader jh;
+	char zeros[SFS_BLOCKSIZE];
+	uint32_t start, i;
+
+	if (SFS_JOURNALBLOCKS(fsblocks) == 0) {
+		return;
+	}
+	start = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(fsblocks);
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAP32(SFS_JMAGIC_HEADER);
+	jh.jh_seq = SWAP32(1);
+	jh.jh_start = SWAP32(0);
+	diskwrite(&jh, start);
+
+	bzero(zeros, sizeof(zeros));
+	for (i=1; i<SFS_JOURNALBLOCKS(fsblocks); i++) {
+		diskwrite(zeros, start + i);
+	}
+}
+
 /*
  * Write out the root directory inode.
  */
@@ -178,6 +221,8 @@ writerootdir(void)
 	sfi.sfi_size = SWAP32(0);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
+	/* Directories are never inline, only regular files */
+	sfi.sfi_flags = SWAP32(0);
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
@@ -232,6 +277,7 @@ main(int argc, char **argv)
 	initfreemap(size);
 	writesuper(volname, size);
 	writefreemap(size);
+	writejournal(size);
 	writerootdir();
 
 	closedisk();
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2009, 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "utils.h"
+#include "sfs.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+/* A freed block listed in the log, and the transaction that freed it */
+struct revoke {
+	uint32_t block;
+	uint32_t seq;
+};
+
+static uint32_t logstart;	/* block number of log block 0 */
+static uint32_t logsize;	/* # of log blocks */
+
+/*
+ * Read the descriptor for transaction SEQ at log position POS into
+ * JD. Return 1 if the transaction is there and was committed, which
+ * is the same test the kernel uses; 0 if the log ends here.
+ */
+static
+int
+readtxn(uint32_t pos, uint32_t seq, struct sfs_jdesc *jd)
+{
+	struct sfs_jcommit jc;
+
+	if (pos + 2 > logsize) {
+		return 0;
+	}
+	sfs_readjdesc(logstart + pos, jd);
+	if (jd->jd_magic != SFS_JMAGIC_DESC || jd->jd_seq != seq ||
+	    jd->jd_nblocks + jd->jd_nrevoke > SFS_JDESCMAX ||
+	    pos + jd->jd_nblocks + 2 > logsize) {
+		return 0;
+	}
+	sfs_readjcommit(logstart + pos + jd->jd_nblocks + 1, &jc);
+	return jc.jc_magic == SFS_JMAGIC_COMMIT && jc.jc_seq == seq;
+}
+
+/*
+ * Return 1 if BLOCK was freed by a transaction after SEQ.
+ */
+static
+int
+isrevoked(const struct revoke *revokes, unsigned nrevokes,
+	  uint32_t block, uint32_t seq)
+{
+	unsigned i;
+
+	for (i=0; i<nrevokes; i++) {
+		if (revokes[i].block == block && revokes[i].seq > seq) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void
+journal_replay(void)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+	struct revoke *revokes;
+	unsigned nrevokes, maxrevokes, ntxns, nblocks;
+	uint32_t pos, seq, i, block;
+	char data[SFS_BLOCKSIZE];
+
+	if (sb_journalblocks() == 0) {
+		return;
+	}
+	logstart = sb_journalstart() + 1;
+	logsize = sb_journalblocks() - 1;
+
+	sfs_readjheader(sb_journalstart(), &jh);
+	if (jh.jh_magic != SFS_JMAGIC_HEADER) {
+		warnx("Journal header has bad magic number (fixed)");
+		setbadness(EXIT_RECOV);
+		memset(&jh, 0, sizeof(jh));
+		jh.jh_magic = SFS_JMAGIC_HEADER;
+		jh.jh_seq = 1;
+		jh.jh_start = 0;
+		/* zero the first log block so nothing old looks committed */
+		memset(data, 0, sizeof(data));
+		diskwrite(data, logstart);
+		sfs_writejheader(sb_journalstart(), &jh);
+		return;
+	}
+
+	/* First collect the freed blocks from every committed transaction. */
+	revokes = NULL;
+	nrevokes = maxrevokes = 0;
+	pos = jh.jh_start;
+	seq = jh.jh_seq;
+	while (readtxn(pos, seq, &jd)) {
+		for (i=0; i<jd.jd_nrevoke; i++) {
+			if (nrevokes == maxrevokes) {
+				revokes = dorealloc(revokes,
+					    maxrevokes * sizeof(*revokes),
+					    (maxrevokes + 16) * sizeof(*revokes));
+				maxrevokes += 16;
+			}
+			revokes[nrevokes].block =
+				jd.jd_blocks[jd.jd_nblocks + i];
+			revokes[nrevokes].seq = seq;
+			nrevokes++;
+		}
+		pos += jd.jd_nblocks + 2;
+		seq++;
+	}
+
+	/* Then copy the blocks home. */
+	ntxns = nblocks = 0;
+	pos = jh.jh_start;
+	seq = jh.jh_seq;
+	while (readtxn(pos, seq, &jd)) {
+		for (i=0; i<jd.jd_nblocks; i++) {
+			block = jd.jd_blocks[i];
+			if (block >= sb_totalblocks() ||
+			    isrevoked(revokes, nrevokes, block, seq)) {
+				continue;
+			}
+			diskread(data, logstart + pos + 1 + i);
+			diskwrite(data, block);
+			nblocks++;
+		}
+		pos += jd.jd_nblocks + 2;
+		seq++;
+		ntxns++;
+	}
+	free(revokes);
+
+	if (ntxns == 0 && jh.jh_start == 0) {
+		/* Nothing there and nothing to reset */
+		return;
+	}
+	if (ntxns > 0) {
+		warnx("Replayed %u transactions (%u blocks) from journal",
+		      ntxns, nblocks);
+		setbadness(EXIT_RECOV);
+	}
+
+	/* Start the log over, the same way the kernel does. */
+	jh.jh_seq = seq;
+	jh.jh_start = 0;
+	sfs_writejheader(sb_journalstart(), &jh);
+}
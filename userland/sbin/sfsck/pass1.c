@@ -247,6 +247,72 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * Check an inline file (see kern/sfs.h). Its data lives in the inode,
+ * so it must not have any blocks; we drop any block pointers rather
+ * than guess which copy of the data is right.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_inline(uint32_t ino, struct sfs_dinode *sfi)
+{
+	int changed = 0;
+	int i;
+
+	if (sfi->sfi_size > SFS_INLINESIZE) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: inline file too large (%lu bytes) "
+		      "(truncated)", (unsigned long) ino,
+		      (unsigned long) sfi->sfi_size);
+		sfi->sfi_size = SFS_INLINESIZE;
+		changed = 1;
+	}
+
+	for (i=0; i<NUM_D; i++) {
+		if (GET_D(sfi, i) != 0) {
+			changed = 1;
+			SET_D(sfi, i) = 0;
+		}
+	}
+	for (i=0; i<NUM_I; i++) {
+		if (GET_I(sfi, i) != 0) {
+			changed = 1;
+			SET_I(sfi, i) = 0;
+		}
+	}
+	for (i=0; i<NUM_II; i++) {
+		if (GET_II(sfi, i) != 0) {
+			changed = 1;
+			SET_II(sfi, i) = 0;
+		}
+	}
+	for (i=0; i<NUM_III; i++) {
+		if (GET_III(sfi, i) != 0) {
+			changed = 1;
+			SET_III(sfi, i) = 0;
+		}
+	}
+	if (changed) {
+		/* The blocks will show up as leaked and get freed */
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: inline file has block pointers (cleared)",
+		      (unsigned long) ino);
+	}
+
+	if (checkzeroed(sfi->sfi_inline + sfi->sfi_size,
+			SFS_INLINESIZE - sfi->sfi_size)) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: inline data past EOF not zeroed (fixed)",
+		      (unsigned long) ino);
+		changed = 1;
+	}
+
+	return changed;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -270,17 +336,41 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 
 	freemap_blockinuse(ino, B_INODE, ino);
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
-		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
-		      (unsigned long) ino);
+	if (sfi->sfi_flags & ~(uint32_t)SFS_IFLAG_INLINE) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_flags);
 		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IFLAG_INLINE;
 		changed = 1;
 	}
 
-	if (check_inode_blocks(ino, sfi, isdir)) {
+	if ((sfi->sfi_flags & SFS_IFLAG_INLINE) && isdir) {
+		/* The directory's entries are in its blocks, if anywhere */
+		warnx("Inode %lu: directory marked inline (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IFLAG_INLINE;
 		changed = 1;
 	}
 
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		if (check_inode_inline(ino, sfi)) {
+			changed = 1;
+		}
+	}
+	else {
+		if (checkzeroed(sfi->sfi_inline, sizeof(sfi->sfi_inline))) {
+			warnx("Inode %lu: inline area not zeroed (fixed)",
+			      (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+
+		if (check_inode_blocks(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+
 	if (changed) {
 		sfs_writeinode(ino, sfi);
 	}
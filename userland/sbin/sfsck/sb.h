@@ -46,6 +46,12 @@ uint32_t sb_totalblocks(void);
 /* After the superblock is loaded: return number of freemap blocks. */
 uint32_t sb_freemapblocks(void);
 
+/* After the superblock is loaded: return where the journal is. */
+uint32_t sb_journalstart(void);
+
+/* After the superblock is loaded: return journal size, or 0 if none. */
+uint32_t sb_journalblocks(void);
+
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
@@ -51,6 +51,9 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -62,6 +65,40 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
+	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+}
+
+static
+void
+swapjheader(struct sfs_jheader *jh)
+{
+	jh->jh_magic = SWAP32(jh->jh_magic);
+	jh->jh_seq = SWAP32(jh->jh_seq);
+	jh->jh_start = SWAP32(jh->jh_start);
+}
+
+static
+void
+swapjdesc(struct sfs_jdesc *jd)
+{
+	unsigned i;
+
+	jd->jd_magic = SWAP32(jd->jd_magic);
+	jd->jd_seq = SWAP32(jd->jd_seq);
+	jd->jd_nblocks = SWAP32(jd->jd_nblocks);
+	jd->jd_nrevoke = SWAP32(jd->jd_nrevoke);
+	for (i=0; i<SFS_JDESCMAX; i++) {
+		jd->jd_blocks[i] = SWAP32(jd->jd_blocks[i]);
+	}
+}
+
+static
+void
+swapjcommit(struct sfs_jcommit *jc)
+{
+	jc->jc_magic = SWAP32(jc->jc_magic);
+	jc->jc_seq = SWAP32(jc->jc_seq);
 }
 
 static
@@ -81,6 +118,7 @@ swapinode(struct sfs_dinode *sfi)
 	sfi->sfi_size = SWAP32(sfi->sfi_size);
 	sfi->sfi_type = SWAP16(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAP16(sfi->sfi_linkcount);
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
@@ -206,6 +244,39 @@ sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 	swapsb(sb);
 }
 
+/*
+ * journal blocks - blocknum is a disk block number.
+ */
+
+void
+sfs_readjheader(uint32_t blocknum, struct sfs_jheader *jh)
+{
+	diskread(jh, blocknum);
+	swapjheader(jh);
+}
+
+void
+sfs_writejheader(uint32_t blocknum, struct sfs_jheader *jh)
+{
+	swapjheader(jh);
+	diskwrite(jh, blocknum);
+	swapjheader(jh);
+}
+
+void
+sfs_readjdesc(uint32_t blocknum, struct sfs_jdesc *jd)
+{
+	diskread(jd, blocknum);
+	swapjdesc(jd);
+}
+
+void
+sfs_readjcommit(uint32_t blocknum, struct sfs_jcommit *jc)
+{
+	diskread(jc, blocknum);
+	swapjcommit(jc);
+}
+
 /*
  * freemap blocks - whichblock is a block number within the free block
  * bitmap.